@@ -3,9 +3,10 @@ uniform sampler2D tex[2];
 void main()
 {
     vec2 y_coord = gl_TexCoord[0].xy;
+    vec2 uv_coord = gl_TexCoord[1].xy;
     float y = texture2D(tex[0], y_coord).r;
-    float cb = texture2D(tex[1], y_coord).r - 0.5;
-    float cr = texture2D(tex[1], y_coord).g - 0.5;
+    float cb = texture2D(tex[1], uv_coord).r - 0.5;
+    float cr = texture2D(tex[1], uv_coord).g - 0.5;
 
     gl_FragColor = vec4(
         y + 1.4021 * cr,
@@ -0,0 +1,12 @@
+#version 110
+uniform sampler2D tex_0;
+void main()
+{
+    // linear filtering averages pixels covered by chroma sample
+    vec3 rgb = texture2D(tex_0, gl_TexCoord[0].xy).rgb;
+    float y = dot(rgb, vec3(0.299, 0.587, 0.114));
+    float cb = (rgb.b - y) / 1.7713 + 0.5;
+    float cr = (rgb.r - y) / 1.4021 + 0.5;
+
+    gl_FragColor = vec4(cb, cr, 0.0, 1.0);
+}
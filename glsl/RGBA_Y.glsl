@@ -0,0 +1,9 @@
+#version 110
+uniform sampler2D tex_0;
+void main()
+{
+    vec3 rgb = texture2D(tex_0, gl_TexCoord[0].xy).rgb;
+    float y = dot(rgb, vec3(0.299, 0.587, 0.114));
+
+    gl_FragColor = vec4(y, 0.0, 0.0, 1.0);
+}
@@ -0,0 +1,19 @@
+#version 110
+uniform sampler2D tex_0;
+void main()
+{
+    // each texel covers two pixels, its center lies between them
+    vec2 coord = gl_TexCoord[0].xy;
+    vec2 offset = vec2(0.25 * dFdx(coord.x), 0.0);
+    vec3 rgb_0 = texture2D(tex_0, coord - offset).rgb;
+    vec3 rgb_1 = texture2D(tex_0, coord + offset).rgb;
+    vec3 luma = vec3(0.299, 0.587, 0.114);
+
+    // linear filtering averages both pixels for chroma
+    vec3 rgb = texture2D(tex_0, coord).rgb;
+    float y = dot(rgb, luma);
+    float cb = (rgb.b - y) / 1.7713 + 0.5;
+    float cr = (rgb.r - y) / 1.4021 + 0.5;
+
+    gl_FragColor = vec4(dot(rgb_0, luma), cb, dot(rgb_1, luma), cr);
+}
@@ -0,0 +1,16 @@
+#version 110
+uniform sampler2D tex_0;
+void main()
+{
+    // each texel holds two pixels as U, Y0, V, Y1
+    vec4 uyvy = texture2D(tex_0, gl_TexCoord[0].xy);
+    float y = mod(floor(gl_FragCoord.x), 2.0) < 0.5 ? uyvy.g : uyvy.a;
+    float cb = uyvy.r - 0.5;
+    float cr = uyvy.b - 0.5;
+
+    gl_FragColor = vec4(
+        y + 1.4021 * cr,
+        y - 0.34482 * cb - 0.71405 * cr,
+        y + 1.7713 * cb,
+        1.0);
+}
@@ -0,0 +1,15 @@
+#version 110
+uniform sampler2D tex_0;
+void main()
+{
+    vec4 vuya = texture2D(tex_0, gl_TexCoord[0].xy);
+    float y = vuya.b;
+    float cb = vuya.g - 0.5;
+    float cr = vuya.r - 0.5;
+
+    gl_FragColor = vec4(
+        y + 1.4021 * cr,
+        y - 0.34482 * cb - 0.71405 * cr,
+        y + 1.7713 * cb,
+        1.0);
+}
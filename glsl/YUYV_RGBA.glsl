@@ -0,0 +1,16 @@
+#version 110
+uniform sampler2D tex_0;
+void main()
+{
+    // each texel holds two pixels as Y0, U, Y1, V
+    vec4 yuyv = texture2D(tex_0, gl_TexCoord[0].xy);
+    float y = mod(floor(gl_FragCoord.x), 2.0) < 0.5 ? yuyv.r : yuyv.b;
+    float cb = yuyv.g - 0.5;
+    float cr = yuyv.a - 0.5;
+
+    gl_FragColor = vec4(
+        y + 1.4021 * cr,
+        y - 0.34482 * cb - 0.71405 * cr,
+        y + 1.7713 * cb,
+        1.0);
+}
@@ -3,8 +3,9 @@ uniform sampler2D tex[2];
 void main()
 {
     vec2 y_coord = gl_TexCoord[0].xy;
-    vec2 cb_coord = vec2(y_coord.x, y_coord.y/2.0);
-    vec2 cr_coord = vec2(y_coord.x, y_coord.y/2.0 + 0.5);
+    vec2 c_coord = gl_TexCoord[1].xy;
+    vec2 cb_coord = vec2(c_coord.x, c_coord.y/2.0);
+    vec2 cr_coord = vec2(c_coord.x, c_coord.y/2.0 + 0.5);
     float y = texture2D(tex[0], y_coord).r;
     float cb = texture2D(tex[1], cb_coord).r - 0.5;
     float cr = texture2D(tex[1], cr_coord).r - 0.5;
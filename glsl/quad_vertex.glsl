@@ -0,0 +1,11 @@
+#version 110
+attribute vec2 position;
+attribute vec2 tex_coord;
+attribute vec4 color;
+void main()
+{
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(position, 0.0, 1.0);
+    gl_TexCoord[0] = gl_TextureMatrix[0] * vec4(tex_coord, 0.0, 1.0);
+    gl_TexCoord[1] = gl_TextureMatrix[1] * vec4(tex_coord, 0.0, 1.0);
+    gl_FrontColor = color;
+}
@@ -0,0 +1,8 @@
+#version 110
+
+uniform sampler2D tex_0;
+
+void main()
+{
+    gl_FragColor = gl_Color * texture2D(tex_0, gl_TexCoord[0].xy);
+}
@@ -24,21 +24,23 @@
 
 #include "api-bitmap-surface.hh"
 #include "api-device.hh"
+#include "gl-debug.hh"
+#include "gl-state.hh"
 #include "glx-context.hh"
 #include "handle-storage.hh"
 #include "reverse-constant.hh"
 #include "trace.hh"
 #include <GL/gl.h>
+#include <memory>
 #include <stdlib.h>
 #include <string.h>
 #include <vdpau/vdpau.h>
 
 
-using std::shared_ptr;
 
 namespace vdp { namespace BitmapSurface {
 
-Resource::Resource(shared_ptr<vdp::Device::Resource> a_device, VdpRGBAFormat a_rgba_format,
+Resource::Resource(ResourcePtr<vdp::Device::Resource> a_device, VdpRGBAFormat a_rgba_format,
                    uint32_t a_width, uint32_t a_height, VdpBool a_frequently_accessed)
     : rgba_format{a_rgba_format}
     , width{a_width}
@@ -97,14 +99,14 @@ Resource::Resource(shared_ptr<vdp::Device::Resource> a_device, VdpRGBAFormat a_r
     GLXThreadLocalContext glc_guard{device};
 
     glGenTextures(1, &tex_id);
-    glBindTexture(GL_TEXTURE_2D, tex_id);
+    gl_state::bind_texture(tex_id);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexImage2D(GL_TEXTURE_2D, 0, gl_internal_format, width, height, 0, gl_format, gl_type,
                  nullptr);
-    glFinish();
+    fence.set();
 
     const auto gl_error = glGetError();
     if (gl_error != GL_NO_ERROR) {
@@ -118,11 +120,10 @@ Resource::~Resource()
 {
     try {
         GLXThreadLocalContext glc_guard{device};
-        glDeleteTextures(1, &tex_id);
+        fence.release();
+        gl_state::delete_textures(1, &tex_id);
 
-        const auto gl_error = glGetError();
-        if (gl_error != GL_NO_ERROR)
-            traceError("BitmapSurface::Resource::~Resource(): gl error %d\n", gl_error);
+        gl_debug::check_error("BitmapSurface::Resource::~Resource()");
 
     } catch (...) {
         traceError("BitmapSurface::Resource::~Resource(): caught exception\n");
@@ -138,7 +139,7 @@ CreateImpl(VdpDevice device_id, VdpRGBAFormat rgba_format, uint32_t width, uint3
 
     vdp::ResourceRef<vdp::Device::Resource> device{device_id};
 
-    auto data = std::make_shared<Resource>(device, rgba_format, width, height, frequently_accessed);
+    auto data = make_resource<Resource>(device, rgba_format, width, height, frequently_accessed);
 
     *surface = vdp::ResourceStorage<Resource>::instance().insert(data);
 
@@ -149,8 +150,9 @@ VdpStatus
 Create(VdpDevice device_id, VdpRGBAFormat rgba_format, uint32_t width, uint32_t height,
        VdpBool frequently_accessed, VdpBitmapSurface *surface)
 {
-    return check_for_exceptions(CreateImpl, device_id, rgba_format, width, height,
-                                frequently_accessed, surface);
+    return call_on_render_thread<vdp::Device::Resource>(device_id, CreateImpl, device_id,
+                                                        rgba_format, width, height,
+                                                        frequently_accessed, surface);
 }
 
 VdpStatus
@@ -165,7 +167,7 @@ DestroyImpl(VdpBitmapSurface surface_id)
 VdpStatus
 Destroy(VdpBitmapSurface surface_id)
 {
-    return check_for_exceptions(DestroyImpl, surface_id);
+    return call_on_render_thread<Resource>(surface_id, DestroyImpl, surface_id);
 }
 
 VdpStatus
@@ -175,7 +177,8 @@ GetParametersImpl(VdpBitmapSurface surface_id, VdpRGBAFormat *rgba_format, uint3
     if (!rgba_format || !width || !height || !frequently_accessed)
         return VDP_STATUS_INVALID_POINTER;
 
-    vdp::ResourceRef<Resource> src_surf{surface_id};
+    // all parameters are immutable, no need to lock
+    vdp::SharedResourceRef<Resource> src_surf{surface_id};
 
     *rgba_format = src_surf->rgba_format;
     *width =       src_surf->width;
@@ -231,7 +234,8 @@ PutBitsNativeImpl(VdpBitmapSurface surface_id, void const *const *source_data,
     } else {
         GLXThreadLocalContext glc_guard{dst_surf->device};
 
-        glBindTexture(GL_TEXTURE_2D, dst_surf->tex_id);
+        dst_surf->fence.wait();
+        gl_state::bind_texture(dst_surf->tex_id);
         glPixelStorei(GL_UNPACK_ROW_LENGTH,
                       source_pitches[0] / dst_surf->bytes_per_pixel);
 
@@ -246,14 +250,10 @@ PutBitsNativeImpl(VdpBitmapSurface surface_id, void const *const *source_data,
         if (dst_surf->bytes_per_pixel != 4)
             glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-        glFinish();
+        dst_surf->fence.set();
 
-        const auto gl_error = glGetError();
-
-        if (gl_error != GL_NO_ERROR) {
-            traceError("BitmapSurface::PutBitsNativeImpl(): gl error %d\n", gl_error);
+        if (gl_debug::check_error("BitmapSurface::PutBitsNativeImpl()"))
             return VDP_STATUS_ERROR;
-        }
     }
 
     return VDP_STATUS_OK;
@@ -263,8 +263,30 @@ VdpStatus
 PutBitsNative(VdpBitmapSurface surface_id, void const *const *source_data,
               uint32_t const *source_pitches, VdpRect const *destination_rect)
 {
-    return check_for_exceptions(PutBitsNativeImpl, surface_id, source_data, source_pitches,
-                                destination_rect);
+    auto surf = find_with_render_thread<Resource>(surface_id);
+    if (!surf || !source_data || !source_pitches || !rect_is_valid(destination_rect)) {
+        return call_on_render_thread<Resource>(surface_id, PutBitsNativeImpl, surface_id,
+                                               source_data, source_pitches, destination_rect);
+    }
+
+    // copy source image, so the call can return before the upload happens
+    VdpRect d_rect = {0, 0, surf->width, surf->height};
+    if (destination_rect)
+        d_rect = *destination_rect;
+
+    auto data = std::make_shared<DeferredData>();
+    const void *plane = data->copy_plane(source_data[0], source_pitches[0], d_rect.y1 - d_rect.y0,
+                                         (d_rect.x1 - d_rect.x0) * surf->bytes_per_pixel);
+    const auto src =     data->copy(&plane);
+    const auto pitches = data->copy(source_pitches);
+    const auto rect =    data->copy(destination_rect);
+
+    post_call(render_thread_of(surf.get()), "BitmapSurface::PutBitsNative",
+              [data, surface_id, src, pitches, rect] () {
+                  return check_for_exceptions(PutBitsNativeImpl, surface_id, src, pitches, rect);
+              });
+
+    return VDP_STATUS_OK;
 }
 
 VdpStatus
@@ -294,11 +316,8 @@ QueryCapabilitiesImpl(VdpDevice device_id, VdpRGBAFormat surface_rgba_format, Vd
     GLint max_texture_size;
     glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
 
-    const auto gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        traceError("BitmapSurface::QueryCapabilitiesImpl(): gl error %d\n", gl_error);
+    if (gl_debug::check_error("BitmapSurface::QueryCapabilitiesImpl()"))
         return VDP_STATUS_ERROR;
-    }
 
     *max_width = max_texture_size;
     *max_height = max_texture_size;
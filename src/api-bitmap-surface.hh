@@ -26,6 +26,7 @@
 
 #include "api-device.hh"
 #include "api.hh"
+#include "gl-fence.hh"
 #include <GL/gl.h>
 #include <vdpau/vdpau.h>
 #include <vector>
@@ -35,13 +36,14 @@ namespace vdp { namespace BitmapSurface {
 
 struct Resource: public vdp::GenericResource
 {
-    Resource(std::shared_ptr<vdp::Device::Resource> a_device, VdpRGBAFormat a_rgba_format,
+    Resource(ResourcePtr<vdp::Device::Resource> a_device, VdpRGBAFormat a_rgba_format,
              uint32_t a_width, uint32_t a_height, VdpBool a_frequently_accessed);
 
     ~Resource();
 
     VdpRGBAFormat   rgba_format;        ///< RGBA format of data stored
     GLuint          tex_id;             ///< GL texture id
+    vdp::GLFence    fence;              ///< completion of the last GL command using surface
     uint32_t        width;
     uint32_t        height;
     VdpBool         frequently_accessed;///< 1 if surface should be optimized for frequent access
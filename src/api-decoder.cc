@@ -29,18 +29,17 @@
 #include "handle-storage.hh"
 #include "reverse-constant.hh"
 #include "trace.hh"
+#include <algorithm>
 #include <stdlib.h>
 #include <string.h>
 
 
-using std::make_shared;
-using std::shared_ptr;
 using std::vector;
 
 
 namespace vdp { namespace Decoder {
 
-Resource::Resource(shared_ptr<vdp::Device::Resource> a_device, VdpDecoderProfile a_profile,
+Resource::Resource(ResourcePtr<vdp::Device::Resource> a_device, VdpDecoderProfile a_profile,
                    uint32_t a_width, uint32_t a_height, uint32_t n_max_references)
     : profile{a_profile}
     , width{a_width}
@@ -53,6 +52,10 @@ Resource::Resource(shared_ptr<vdp::Device::Resource> a_device, VdpDecoderProfile
     if (!device->va_available)
         throw vdp::invalid_decoder_profile();
 
+    ref_cache.reserve(kMaxRenderTargets);
+
+    std::unique_lock<decltype(device->va_mtx)> va_lock{device->va_mtx};
+
     // initialize free_list. Initially they all free
     for (int k = 0; k < vdp::kMaxRenderTargets; k ++)
         free_list.push_back(k);
@@ -133,6 +136,7 @@ Resource::~Resource()
 {
     try {
         if (device->va_available) {
+            std::unique_lock<decltype(device->va_mtx)> va_lock{device->va_mtx};
             const VADisplay va_dpy = device->va_dpy;
             vaDestroySurfaces(va_dpy, render_targets.data(), render_targets.size());
             vaDestroyContext(va_dpy, context_id);
@@ -153,7 +157,7 @@ CreateImpl(VdpDevice device_id, VdpDecoderProfile profile, uint32_t width, uint3
 
     ResourceRef<vdp::Device::Resource> device{device_id};
 
-    auto data = make_shared<Resource>(device, profile, width, height, max_references);
+    auto data = make_resource<Resource>(device, profile, width, height, max_references);
 
     *decoder = ResourceStorage<Resource>::instance().insert(data);
     return VDP_STATUS_OK;
@@ -186,7 +190,8 @@ VdpStatus
 GetParametersImpl(VdpDecoder decoder_id, VdpDecoderProfile *profile, uint32_t *width,
                   uint32_t *height)
 {
-    ResourceRef<Resource> decoder{decoder_id};
+    // all parameters are immutable, no need to lock
+    SharedResourceRef<Resource> decoder{decoder_id};
 
     if (profile)
         *profile = decoder->profile;
@@ -206,9 +211,41 @@ GetParameters(VdpDecoder decoder_id, VdpDecoderProfile *profile, uint32_t *width
     return check_for_exceptions(GetParametersImpl, decoder_id, profile, width, height);
 }
 
+uint32_t
+h264_ref_frame_count(const VdpPictureInfoH264 *vdppi)
+{
+    const uint32_t max_ref_frames = sizeof(vdppi->referenceFrames) /
+                                    sizeof(vdppi->referenceFrames[0]);
+
+    return std::min<uint32_t>(vdppi->num_ref_frames, max_ref_frames);
+}
+
+/// Returns VA surface of a video surface, if it was recently used by this decoder and still
+/// exists, or VA_INVALID_SURFACE.
+VASurfaceID
+lookup_ref_cache(Resource *decoder, VdpVideoSurface surface)
+{
+    for (const auto &entry: decoder->ref_cache) {
+        if (entry.surface != surface)
+            continue;
+
+        // VA surface is assigned once in a video surface lifetime, and the handle can't be
+        // reused while the surface is alive
+        if (!ResourceStorage<vdp::VideoSurface::Resource>::instance().is_live(surface))
+            return VA_INVALID_SURFACE;
+
+        return entry.va_surf;
+    }
+
+    return VA_INVALID_SURFACE;
+}
+
+/// ref_surfs[k] is either locked reference surface, or nullptr when cached_va_surfs[k] is
+/// taken from the cache
 VdpStatus
-h264_translate_reference_frames(shared_ptr<vdp::VideoSurface::Resource> &dst_surf,
-                                shared_ptr<Resource> &decoder,
+h264_translate_reference_frames(vdp::VideoSurface::Resource *dst_surf, Resource *decoder,
+                                vdp::VideoSurface::Resource *const *ref_surfs,
+                                const VASurfaceID *cached_va_surfs,
                                 VAPictureParameterBufferH264 *pic_param,
                                 const VdpPictureInfoH264 *vdppi)
 {
@@ -220,7 +257,7 @@ h264_translate_reference_frames(shared_ptr<vdp::VideoSurface::Resource> &dst_sur
         auto idx = decoder->free_list.back();
         decoder->free_list.pop_back();
 
-        dst_surf->decoder = decoder;
+        dst_surf->decoder = ResourcePtr<Resource>(decoder);
         dst_surf->va_surf = decoder->render_targets[idx];
         dst_surf->rt_idx  = idx;
     }
@@ -243,7 +280,7 @@ h264_translate_reference_frames(shared_ptr<vdp::VideoSurface::Resource> &dst_sur
         reset_va_picture_h264(&pic_param->ReferenceFrames[k]);
 
     // reference frames
-    for (int k = 0; k < vdppi->num_ref_frames; k ++) {
+    for (uint32_t k = 0; k < h264_ref_frame_count(vdppi); k ++) {
         if (vdppi->referenceFrames[k].surface == VDP_INVALID_HANDLE) {
             reset_va_picture_h264(&pic_param->ReferenceFrames[k]);
             continue;
@@ -251,23 +288,24 @@ h264_translate_reference_frames(shared_ptr<vdp::VideoSurface::Resource> &dst_sur
 
         VdpReferenceFrameH264 const *vdp_ref = &vdppi->referenceFrames[k];
 
-        ResourceRef<vdp::VideoSurface::Resource> video_surf{vdp_ref->surface};
+        // already locked by the caller
+        auto *video_surf = ref_surfs[k];
         VAPictureH264 *va_ref = &pic_param->ReferenceFrames[k];
 
         // take new VA surface from buffer if needed
-        if (video_surf->va_surf == VA_INVALID_SURFACE) {
+        if (video_surf && video_surf->va_surf == VA_INVALID_SURFACE) {
             if (decoder->free_list.size() == 0)
                 return VDP_STATUS_RESOURCES;
 
             const auto idx = decoder->free_list.back();
             decoder->free_list.pop_back();
 
-            dst_surf->decoder = decoder;
-            dst_surf->va_surf = decoder->render_targets[idx];
-            dst_surf->rt_idx  = idx;
+            video_surf->decoder = ResourcePtr<Resource>(decoder);
+            video_surf->va_surf = decoder->render_targets[idx];
+            video_surf->rt_idx  = idx;
         }
 
-        va_ref->picture_id = video_surf->va_surf;
+        va_ref->picture_id = video_surf ? video_surf->va_surf : cached_va_surfs[k];
         va_ref->frame_idx = vdp_ref->frame_idx;
         va_ref->flags = vdp_ref->is_long_term ? VA_PICTURE_H264_LONG_TERM_REFERENCE
                                               : VA_PICTURE_H264_SHORT_TERM_REFERENCE;
@@ -285,6 +323,17 @@ h264_translate_reference_frames(shared_ptr<vdp::VideoSurface::Resource> &dst_sur
         va_ref->BottomFieldOrderCnt = vdp_ref->field_order_cnt[1];
     }
 
+    // Current frame most likely becomes a reference for the next one, while references not
+    // mentioned in this frame will never be used again.
+    decoder->ref_cache.clear();
+    decoder->ref_cache.push_back({dst_surf->id, dst_surf->va_surf});
+
+    for (uint32_t k = 0; k < h264_ref_frame_count(vdppi); k ++) {
+        const VdpVideoSurface surface = vdppi->referenceFrames[k].surface;
+        if (surface != VDP_INVALID_HANDLE)
+            decoder->ref_cache.push_back({surface, pic_param->ReferenceFrames[k].picture_id});
+    }
+
     return VDP_STATUS_OK;
 }
 
@@ -318,8 +367,11 @@ QueryCapabilitiesImpl(VdpDevice device_id, VdpDecoderProfile profile, VdpBool *i
     vector<VAProfile> va_profile_list(vaMaxNumProfiles(device->va_dpy));
 
     int num_profiles;
-    VAStatus status = vaQueryConfigProfiles(device->va_dpy, va_profile_list.data(),
-                                            &num_profiles);
+    VAStatus status;
+    {
+        std::unique_lock<decltype(device->va_mtx)> va_lock{device->va_mtx};
+        status = vaQueryConfigProfiles(device->va_dpy, va_profile_list.data(), &num_profiles);
+    }
     if (status != VA_STATUS_SUCCESS)
         return VDP_STATUS_ERROR;
 
@@ -522,7 +574,8 @@ h264_translate_iq_matrix(VAIQMatrixBufferH264 *iq_matrix, const VdpPictureInfoH2
 }
 
 VdpStatus
-Render_h264(shared_ptr<Resource> decoder, shared_ptr<vdp::VideoSurface::Resource> dst_surf,
+Render_h264(Resource *decoder, vdp::VideoSurface::Resource *dst_surf,
+            vdp::VideoSurface::Resource *const *ref_surfs, const VASurfaceID *cached_va_surfs,
             VdpPictureInfo const *picture_info, uint32_t bitstream_buffer_count,
             VdpBitstreamBuffer const *bitstream_buffers)
 {
@@ -537,7 +590,8 @@ Render_h264(shared_ptr<Resource> decoder, shared_ptr<vdp::VideoSurface::Resource
     VAPictureParameterBufferH264 pic_param = {};
     VAIQMatrixBufferH264 iq_matrix;
 
-    const auto vs = h264_translate_reference_frames(dst_surf, decoder, &pic_param, vdppi);
+    const auto vs = h264_translate_reference_frames(dst_surf, decoder, ref_surfs, cached_va_surfs,
+                                                    &pic_param, vdppi);
     if (vs != VDP_STATUS_OK) {
         if (vs == VDP_STATUS_RESOURCES) {
             traceError("Decoder::Render_h264(): no surfaces left in buffer\n");
@@ -551,7 +605,7 @@ Render_h264(shared_ptr<Resource> decoder, shared_ptr<vdp::VideoSurface::Resource
     h264_translate_iq_matrix(&iq_matrix, vdppi);
 
     {
-        GLXLockGuard guard;
+        std::unique_lock<decltype(decoder->device->va_mtx)> va_lock{decoder->device->va_mtx};
         VABufferID pic_param_buf, iq_matrix_buf;
 
 
@@ -645,7 +699,7 @@ Render_h264(shared_ptr<Resource> decoder, shared_ptr<vdp::VideoSurface::Resource
 
         VABufferID slice_parameters_buf;
 
-        GLXLockGuard guard;
+        std::unique_lock<decltype(decoder->device->va_mtx)> va_lock{decoder->device->va_mtx};
 
         status = vaCreateBuffer(va_dpy, decoder->context_id, VASliceParameterBufferType,
                                 sizeof(VASliceParameterBufferH264), 1, &sp_h264,
@@ -677,13 +731,15 @@ Render_h264(shared_ptr<Resource> decoder, shared_ptr<vdp::VideoSurface::Resource
     } while (1);
 
     {
-        GLXLockGuard guard;
+        std::unique_lock<decltype(decoder->device->va_mtx)> va_lock{decoder->device->va_mtx};
         status = vaEndPicture(va_dpy, decoder->context_id);
         if (status != VA_STATUS_SUCCESS)
             return VDP_STATUS_ERROR;
     }
 
     dst_surf->sync_va_to_glx = true;
+    dst_surf->sync_planes_to_glx = false;
+    dst_surf->planes_staged = false;
     return VDP_STATUS_OK;
 }
 
@@ -694,16 +750,42 @@ RenderImpl(VdpDecoder decoder_id, VdpVideoSurface target, VdpPictureInfo const *
     if (not picture_info || not bitstream_buffers)
         return VDP_STATUS_INVALID_POINTER;
 
+    // Decoder handles sort before video surface handles, so locking decoder first and surfaces
+    // in a batch afterwards keeps the global lock order.
     ResourceRef<Resource> decoder{decoder_id};
-    ResourceRef<vdp::VideoSurface::Resource> dst_surf{target};
 
-    if (decoder->profile == VDP_DECODER_PROFILE_H264_CONSTRAINED_BASELINE ||
-        decoder->profile == VDP_DECODER_PROFILE_H264_BASELINE ||
-        decoder->profile == VDP_DECODER_PROFILE_H264_MAIN ||
-        decoder->profile == VDP_DECODER_PROFILE_H264_HIGH)
-    {
+    ResourceRefSet refs;
+    auto dst_surf = refs.add<vdp::VideoSurface::Resource>(target);
+
+    const bool is_h264 = decoder->profile == VDP_DECODER_PROFILE_H264_CONSTRAINED_BASELINE ||
+                         decoder->profile == VDP_DECODER_PROFILE_H264_BASELINE ||
+                         decoder->profile == VDP_DECODER_PROFILE_H264_MAIN ||
+                         decoder->profile == VDP_DECODER_PROFILE_H264_HIGH;
+
+    // Only VA surface ids of reference frames are needed, and they are usually known from the
+    // previous frame. The rest of reference surfaces are locked together with target surface.
+    vdp::VideoSurface::Resource *ref_surfs[16] = {};
+    VASurfaceID cached_va_surfs[16];
+    if (is_h264) {
+        const auto *vdppi = static_cast<VdpPictureInfoH264 const *>(picture_info);
+
+        for (uint32_t k = 0; k < h264_ref_frame_count(vdppi); k ++) {
+            const VdpVideoSurface ref_surface_id = vdppi->referenceFrames[k].surface;
+            if (ref_surface_id == VDP_INVALID_HANDLE)
+                continue;
+
+            cached_va_surfs[k] = lookup_ref_cache(decoder.get(), ref_surface_id);
+            if (cached_va_surfs[k] == VA_INVALID_SURFACE)
+                ref_surfs[k] = refs.add<vdp::VideoSurface::Resource>(ref_surface_id);
+        }
+    }
+
+    refs.acquire();
+
+    if (is_h264) {
         // TODO: check exit code
-        Render_h264(decoder, dst_surf, picture_info, bitstream_buffer_count, bitstream_buffers);
+        Render_h264(decoder.get(), dst_surf, ref_surfs, cached_va_surfs, picture_info,
+                    bitstream_buffer_count, bitstream_buffers);
     } else {
         traceError("Decoder::RenderImpl(): no implementation for profile %s\n",
                    reverse_decoder_profile(decoder->profile));
@@ -717,8 +799,9 @@ VdpStatus
 Render(VdpDecoder decoder_id, VdpVideoSurface target, VdpPictureInfo const *picture_info,
        uint32_t bitstream_buffer_count, VdpBitstreamBuffer const *bitstream_buffers)
 {
-    return check_for_exceptions(RenderImpl, decoder_id, target, picture_info,
-                                bitstream_buffer_count, bitstream_buffers);
+    return call_on_render_thread<Resource>(decoder_id, RenderImpl, decoder_id, target,
+                                           picture_info, bitstream_buffer_count,
+                                           bitstream_buffers);
 }
 
 } } // namespace vdp::Decoder
@@ -36,7 +36,7 @@ namespace vdp { namespace Decoder {
 
 struct Resource: public vdp::GenericResource
 {
-    Resource(std::shared_ptr<vdp::Device::Resource> a_device, VdpDecoderProfile a_profile,
+    Resource(ResourcePtr<vdp::Device::Resource> a_device, VdpDecoderProfile a_profile,
              uint32_t a_width, uint32_t a_height, uint32_t n_max_references);
 
     ~Resource();
@@ -50,6 +50,13 @@ struct Resource: public vdp::GenericResource
 
     std::vector<VASurfaceID>    render_targets; ///< spare VA surfaces
     std::vector<int32_t>        free_list;
+
+    struct RefCacheEntry {
+        VdpVideoSurface     surface;    ///< full handle, so generation check comes for free
+        VASurfaceID         va_surf;
+    };
+    std::vector<RefCacheEntry>  ref_cache;  ///< VA surfaces of the last decoded frame and its
+                                            ///< references
 };
 
 VdpDecoderQueryCapabilities QueryCapabilities;
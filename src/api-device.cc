@@ -31,9 +31,15 @@
 #include "api-presentation-queue.hh"
 #include "api-video-mixer.hh"
 #include "api-video-surface.hh"
+#include "egl-context.hh"
+#include "gl-debug.hh"
+#include "gl-fence.hh"
+#include "gl-state.hh"
 #include "globals.hh"
 #include "glx-context.hh"
 #include "handle-storage.hh"
+#include "plane-texture.hh"
+#include "quad-batch.hh"
 #include "reverse-constant.hh"
 #include "trace.hh"
 #include "watermark.hh"
@@ -374,11 +380,18 @@ PreemptionCallbackRegister(VdpDevice device, VdpPreemptionCallback callback, voi
 namespace Device {
 
 Resource::Resource(Display *a_display, int a_screen)
-    : dpy{not not global.quirks.buggy_XCloseDisplay}
+    : backend{a_display != nullptr}
+    , dpy{not not global.quirks.buggy_XCloseDisplay}
     , screen{a_screen}
     , glc{dpy.get(), screen}
 {
-    {
+    if (egl::enabled()) {
+        // no X server to talk to, rendering is offscreen only
+        root = None;
+        color_depth = 24;
+        fn.glXBindTexImageEXT = nullptr;
+        fn.glXReleaseTexImageEXT = nullptr;
+    } else {
         GLXLockGuard glx_lock_guard;
 
         root = DefaultRootWindow(dpy.get());
@@ -391,28 +404,27 @@ Resource::Resource(Display *a_display, int a_screen)
             (PFNGLXBINDTEXIMAGEEXTPROC)glXGetProcAddress((GLubyte *)"glXBindTexImageEXT");
         fn.glXReleaseTexImageEXT =
             (PFNGLXRELEASETEXIMAGEEXTPROC)glXGetProcAddress((GLubyte *)"glXReleaseTexImageEXT");
-    }
 
-    if (!fn.glXBindTexImageEXT || !fn.glXReleaseTexImageEXT) {
-        traceError("error (%s): can't get glXBindTexImageEXT address\n");
-        throw std::bad_alloc();
+        if (!fn.glXBindTexImageEXT || !fn.glXReleaseTexImageEXT) {
+            traceError("error (%s): can't get glXBindTexImageEXT address\n");
+            throw std::bad_alloc();
+        }
     }
 
     GLXThreadLocalContext glc_guard{root};
 
     glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    GLFence::detect_support();
+    PlaneTexture::detect_support();
 
     // initialize VAAPI
     va_available = 0;
-    if (global.quirks.avoid_va) {
+    if (global.quirks.avoid_va || egl::enabled()) {
         // pretend there is no VA-API available
     } else {
+        GLXLockGuard glx_lock_guard;
+
         va_dpy = vaGetDisplay(dpy.get());
 
         VAStatus status = vaInitialize(va_dpy, &va_version_major, &va_version_minor);
@@ -423,7 +435,7 @@ Resource::Resource(Display *a_display, int a_screen)
     compile_shaders();
 
     glGenTextures(1, &watermark_tex_id);
-    glBindTexture(GL_TEXTURE_2D, watermark_tex_id);
+    gl_state::bind_texture(watermark_tex_id);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -434,23 +446,28 @@ Resource::Resource(Display *a_display, int a_screen)
                  GL_UNSIGNED_BYTE, watermark_data);
     glFinish();
 
-    const auto gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        traceError("Device::Resource::Resource(): gl error %d\n", gl_error);
+    if (gl_debug::check_error("Device::Resource::Resource()"))
         throw vdp::generic_error();
-    }
+
+    if (global.quirks.render_thread)
+        render_thread.reset(new vdp::RenderThread());
 }
 
 template<typename T>
 void
-destroy_orphaned_resources(VdpDevice device_id)
+destroy_child_resources(const std::vector<uint32_t> &children)
 {
-    for (const auto res_id: ResourceStorage<T>::instance().enumerate()) {
+    auto &storage = ResourceStorage<T>::instance();
+
+    for (const auto res_id: children) {
+        if (handle_type(res_id) != storage.type())
+            continue;
+
         try {
+            // wait for operations in flight to finish
             ResourceRef<T> res{res_id};
 
-            if (res->device->id == device_id)
-                ResourceStorage<T>::instance().drop(res_id);
+            storage.drop(res_id);
 
         } catch (const vdp::resource_not_found &) {
             // ignore missing resources
@@ -462,25 +479,23 @@ Resource::~Resource()
 {
     try {
         // cleaup libva
-        if (va_available)
+        if (va_available) {
+            GLXLockGuard guard;
+            std::unique_lock<decltype(va_mtx)> va_lock{va_mtx};
             vaTerminate(va_dpy);
+        }
 
         {
             GLXThreadLocalContext guard{root};
 
-            glDeleteTextures(1, &watermark_tex_id);
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            gl_state::delete_textures(1, &watermark_tex_id);
+            gl_state::bind_framebuffer(0);
             destroy_shaders();
         }
 
-        {
-            GLXLockGuard guard;
-            glXMakeCurrent(dpy.get(), None, nullptr);
-        }
+        release_current_gl_context();
 
-        const auto gl_error = glGetError();
-        if (gl_error != GL_NO_ERROR)
-            traceError("Device::Resource::~Resource(): gl error %d\n", gl_error);
+        gl_debug::check_error("Device::Resource::~Resource()");
 
     } catch (...) {
         traceError("Device::Resource::~Resource(): caught exception\n");
@@ -490,30 +505,26 @@ Resource::~Resource()
 void
 Resource::compile_shaders()
 {
-    for (int k = 0; k < SHADER_COUNT; k ++) {
-        struct shader_s *s = &glsl_shaders[k];
-        int ok;
+    v_shader = compile_shader(GL_VERTEX_SHADER, glsl_quad_vertex);
 
-        const GLuint f_shader = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(f_shader, 1, &s->body, &s->len);
-        glCompileShader(f_shader);
-        glGetShaderiv(f_shader, GL_COMPILE_STATUS, &ok);
+    for (int k = 0; k < SHADER_COUNT; k ++) {
+        shaders[k].f_shader = 0;
+        shaders[k].program = 0;
 
-        if (!ok) {
-            GLint errmsg_len;
-            glGetShaderiv(f_shader, GL_INFO_LOG_LENGTH, &errmsg_len);
+        if (k == glsl_quad_vertex)
+            continue;
 
-            std::vector<char> errmsg(errmsg_len);
-            glGetShaderInfoLog(f_shader, errmsg.size(), nullptr, errmsg.data());
-            traceError("Device::Resource::compile_shaders(): compilation of shader #%d failed with "
-                       "'%s'\n", k, errmsg.data());
-            glDeleteShader(f_shader);
-            throw shader_compilation_failed();
-        }
+        const GLuint f_shader = compile_shader(GL_FRAGMENT_SHADER, k);
 
         const GLuint program = glCreateProgram();
+        glAttachShader(program, v_shader);
         glAttachShader(program, f_shader);
+        glBindAttribLocation(program, kQuadAttribPosition, "position");
+        glBindAttribLocation(program, kQuadAttribTexCoord, "tex_coord");
+        glBindAttribLocation(program, kQuadAttribColor, "color");
         glLinkProgram(program);
+
+        int ok;
         glGetProgramiv(program, GL_LINK_STATUS, &ok);
 
         if (!ok) {
@@ -524,7 +535,7 @@ Resource::compile_shaders()
             glGetProgramInfoLog(program, errmsg.size(), nullptr, errmsg.data());
             traceError("Device::Resource::compile_shaders(): linking of shader #%d failed with "
                        "'%s'\n", k, errmsg.data());
-            glDeleteProgram(program);
+            gl_state::delete_program(program);
             glDeleteShader(f_shader);
             throw shader_compilation_failed();
         }
@@ -532,37 +543,84 @@ Resource::compile_shaders()
         shaders[k].f_shader = f_shader;
         shaders[k].program = program;
 
+        // samplers never change, set them once
+        gl_state::use_program(program);
+
         switch (k) {
         case glsl_YV12_RGBA:
         case glsl_NV12_RGBA:
             shaders[k].uniform.tex_0 = glGetUniformLocation(program, "tex[0]");
             shaders[k].uniform.tex_1 = glGetUniformLocation(program, "tex[1]");
+            glUniform1i(shaders[k].uniform.tex_0, 0);
+            glUniform1i(shaders[k].uniform.tex_1, 1);
             break;
 
+        case glsl_RGBA_UV:
+        case glsl_RGBA_UYVY:
+        case glsl_RGBA_V8U8Y8A8:
+        case glsl_RGBA_Y:
+        case glsl_RGBA_Y8U8V8A8:
+        case glsl_RGBA_YUYV:
+        case glsl_UYVY_RGBA:
+        case glsl_V8U8Y8A8_RGBA:
+        case glsl_Y8U8V8A8_RGBA:
+        case glsl_YUYV_RGBA:
         case glsl_red_to_alpha_swizzle:
+        case glsl_texture_color:
             shaders[k].uniform.tex_0 = glGetUniformLocation(program, "tex_0");
+            glUniform1i(shaders[k].uniform.tex_0, 0);
             break;
         }
     }
+
+    gl_state::use_program(0);
+}
+
+GLuint
+Resource::compile_shader(GLenum type, int k)
+{
+    struct shader_s *s = &glsl_shaders[k];
+    int ok;
+
+    const GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &s->body, &s->len);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+
+    if (!ok) {
+        GLint errmsg_len;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &errmsg_len);
+
+        std::vector<char> errmsg(errmsg_len);
+        glGetShaderInfoLog(shader, errmsg.size(), nullptr, errmsg.data());
+        traceError("Device::Resource::compile_shader(): compilation of shader #%d failed with "
+                   "'%s'\n", k, errmsg.data());
+        glDeleteShader(shader);
+        throw shader_compilation_failed();
+    }
+
+    return shader;
 }
 
 void
 Resource::destroy_shaders()
 {
     for (int k = 0; k < SHADER_COUNT; k ++) {
-        glDeleteProgram(shaders[k].program);
+        gl_state::delete_program(shaders[k].program);
         glDeleteShader(shaders[k].f_shader);
     }
+    glDeleteShader(v_shader);
 }
 
 VdpStatus
 CreateX11Impl(Display *display_orig, int screen, VdpDevice *device,
               VdpGetProcAddress **get_proc_address)
 {
-    if (!display_orig || !device)
+    // no display selects EGL mode, which works without X server
+    if (!device)
         return VDP_STATUS_INVALID_POINTER;
 
-    auto data = std::make_shared<Resource>(display_orig, screen);
+    auto data = make_resource<Resource>(display_orig, screen);
 
     *device = vdp::ResourceStorage<Resource>::instance().insert(data);
 
@@ -586,13 +644,15 @@ DestroyImpl(VdpDevice device_id)
 
     ResourceStorage<Resource>::instance().drop(device_id);
 
-    destroy_orphaned_resources<vdp::BitmapSurface::Resource>(device_id);
-    destroy_orphaned_resources<vdp::Decoder::Resource>(device_id);
-    destroy_orphaned_resources<vdp::OutputSurface::Resource>(device_id);
-    destroy_orphaned_resources<vdp::PresentationQueue::Resource>(device_id);
-    destroy_orphaned_resources<vdp::PresentationQueue::TargetResource>(device_id);
-    destroy_orphaned_resources<vdp::VideoMixer::Resource>(device_id);
-    destroy_orphaned_resources<vdp::VideoSurface::Resource>(device_id);
+    const auto children = device->children.snapshot();
+
+    destroy_child_resources<vdp::BitmapSurface::Resource>(children);
+    destroy_child_resources<vdp::Decoder::Resource>(children);
+    destroy_child_resources<vdp::OutputSurface::Resource>(children);
+    destroy_child_resources<vdp::PresentationQueue::Resource>(children);
+    destroy_child_resources<vdp::PresentationQueue::TargetResource>(children);
+    destroy_child_resources<vdp::VideoMixer::Resource>(children);
+    destroy_child_resources<vdp::VideoSurface::Resource>(children);
 
     return VDP_STATUS_OK;
 }
@@ -600,6 +660,11 @@ DestroyImpl(VdpDevice device_id)
 VdpStatus
 Destroy(VdpDevice device_id)
 {
+    // let queued commands finish while no locks are held. Commands issued after that point
+    // are executed by the calling threads.
+    if (auto device = find_with_render_thread<Resource>(device_id))
+        device->render_thread->stop();
+
     return check_for_exceptions(DestroyImpl, device_id);
 }
 
@@ -26,10 +26,13 @@
 
 #include "api.hh"
 #include "glx-context.hh"
+#include "lock-stats.hh"
+#include "render-thread.hh"
 #include "shaders.h"
 #include "x-display-ref.hh"
 #include <GL/glx.h>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <va/va_x11.h>
 #include <vdpau/vdpau.h>
@@ -43,16 +46,23 @@ struct Resource: public vdp::GenericResource
 
     ~Resource();
 
+    egl::BackendRef     backend;        ///< keeps GL backend chosen while device exists
     vdp::XDisplayRef    dpy;            ///< own X display connection
     int                 screen;         ///< X screen
     int                 color_depth;    ///< screen color depth
     GLXGlobalContext    glc;            ///< master GL context
     Window              root;           ///< X drawable (root window) used for offscreen drawing
     VADisplay           va_dpy;         ///< VA display
+    vdp::ProfiledMutex<std::mutex> va_mtx{vdp::kLockSiteVA};    ///< serializes calls on va_dpy.
+                                        ///< If GLX lock is needed too, it's taken first
     int                 va_available;   ///< 1 if VA-API available
     int                 va_version_major;
     int                 va_version_minor;
     GLuint              watermark_tex_id;   ///< GL texture id for watermark
+    vdp::ResourceRegistry   children;   ///< resources created on this device
+    std::unique_ptr<vdp::RenderThread>  render_thread;  ///< executes GL work of the device, if
+                                                        ///< RenderThread quirk is enabled
+    GLuint              v_shader;       ///< vertex shader shared by all programs
     struct {
         GLuint      f_shader;
         GLuint      program;
@@ -70,6 +80,9 @@ private:
     void
     compile_shaders();
 
+    GLuint
+    compile_shader(GLenum type, int k);
+
     void
     destroy_shaders();
 };
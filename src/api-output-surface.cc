@@ -26,18 +26,20 @@
 #include "api-bitmap-surface.hh"
 #include "api-device.hh"
 #include "api-output-surface.hh"
+#include "gl-debug.hh"
+#include "gl-state.hh"
 #include "glx-context.hh"
 #include "handle-storage.hh"
+#include "quad-batch.hh"
 #include "reverse-constant.hh"
 #include "trace.hh"
 #include <GL/gl.h>
+#include <memory>
 #include <stdlib.h>
 #include <vdpau/vdpau.h>
 #include <vector>
 
 
-using std::shared_ptr;
-using std::make_shared;
 
 namespace vdp { namespace OutputSurface {
 
@@ -115,80 +117,50 @@ vdpBlendEquationToGLEquation(VdpOutputSurfaceRenderBlendEquation blend_equation)
 static
 void
 compose_surfaces(struct blend_state_struct bs, VdpRect srcRect, VdpRect dstRect,
-                 VdpColor const *colors, int flags, bool has_src_surf)
-{
-    glBlendFuncSeparate(bs.srcFuncRGB, bs.dstFuncRGB, bs.srcFuncAlpha, bs.dstFuncAlpha);
-    glBlendEquationSeparate(bs.modeRGB, bs.modeAlpha);
-
-    glColor4f(1, 1, 1, 1);
-    glBegin(GL_QUADS);
-
-    if (has_src_surf) {
-        switch (flags & 3) {
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_0:
-            glTexCoord2i(srcRect.x0, srcRect.y0); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_90:
-            glTexCoord2i(srcRect.x0, srcRect.y1); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_180:
-            glTexCoord2i(srcRect.x1, srcRect.y1); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_270:
-            glTexCoord2i(srcRect.x1, srcRect.y0); break;
+                 VdpColor const *colors, int flags)
+{
+    gl_state::blend_func(bs.srcFuncRGB, bs.dstFuncRGB, bs.srcFuncAlpha, bs.dstFuncAlpha);
+    gl_state::blend_equation(bs.modeRGB, bs.modeAlpha);
+
+    const GLfloat src_corners[4][2] = {
+        {static_cast<GLfloat>(srcRect.x0), static_cast<GLfloat>(srcRect.y0)},
+        {static_cast<GLfloat>(srcRect.x1), static_cast<GLfloat>(srcRect.y0)},
+        {static_cast<GLfloat>(srcRect.x1), static_cast<GLfloat>(srcRect.y1)},
+        {static_cast<GLfloat>(srcRect.x0), static_cast<GLfloat>(srcRect.y1)},
+    };
+    const GLfloat dst_corners[4][2] = {
+        {static_cast<GLfloat>(dstRect.x0), static_cast<GLfloat>(dstRect.y0)},
+        {static_cast<GLfloat>(dstRect.x1), static_cast<GLfloat>(dstRect.y0)},
+        {static_cast<GLfloat>(dstRect.x1), static_cast<GLfloat>(dstRect.y1)},
+        {static_cast<GLfloat>(dstRect.x0), static_cast<GLfloat>(dstRect.y1)},
+    };
+
+    // rotation by 90 degrees shifts source corners by one position against destination ones
+    const int rotation = flags & 3;
+
+    QuadVertex v[4];
+    for (int k = 0; k < 4; k ++) {
+        const int src_k = (k + 4 - rotation) % 4;
+        const int color_k = (flags & VDP_OUTPUT_SURFACE_RENDER_COLOR_PER_VERTEX) ? k : 0;
+
+        v[k].x = dst_corners[k][0];
+        v[k].y = dst_corners[k][1];
+        v[k].s = src_corners[src_k][0];
+        v[k].t = src_corners[src_k][1];
+
+        if (colors) {
+            v[k].r = colors[color_k].red;
+            v[k].g = colors[color_k].green;
+            v[k].b = colors[color_k].blue;
+            v[k].a = colors[color_k].alpha;
+        } else {
+            v[k].r = v[k].g = v[k].b = v[k].a = 1.0f;
         }
     }
-    if (colors)
-        glColor4f(colors[0].red, colors[0].green, colors[0].blue, colors[0].alpha);
-    glVertex2f(dstRect.x0, dstRect.y0);
-
-    if (has_src_surf) {
-        switch (flags & 3) {
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_0:
-            glTexCoord2i(srcRect.x1, srcRect.y0); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_90:
-            glTexCoord2i(srcRect.x0, srcRect.y0); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_180:
-            glTexCoord2i(srcRect.x0, srcRect.y1); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_270:
-            glTexCoord2i(srcRect.x1, srcRect.y1); break;
-        }
-    }
-    if (colors && (flags & VDP_OUTPUT_SURFACE_RENDER_COLOR_PER_VERTEX))
-        glColor4f(colors[1].red, colors[1].green, colors[1].blue, colors[1].alpha);
-    glVertex2f(dstRect.x1, dstRect.y0);
-
-    if (has_src_surf) {
-        switch (flags & 3) {
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_0:
-            glTexCoord2i(srcRect.x1, srcRect.y1); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_90:
-            glTexCoord2i(srcRect.x1, srcRect.y0); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_180:
-            glTexCoord2i(srcRect.x0, srcRect.y0); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_270:
-            glTexCoord2i(srcRect.x0, srcRect.y1); break;
-        }
-    }
-    if (colors && (flags & VDP_OUTPUT_SURFACE_RENDER_COLOR_PER_VERTEX))
-        glColor4f(colors[2].red, colors[2].green, colors[2].blue, colors[2].alpha);
-    glVertex2f(dstRect.x1, dstRect.y1);
-
-    if (has_src_surf) {
-        switch (flags & 3) {
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_0:
-            glTexCoord2i(srcRect.x0, srcRect.y1); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_90:
-            glTexCoord2i(srcRect.x1, srcRect.y1); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_180:
-            glTexCoord2i(srcRect.x1, srcRect.y0); break;
-        case VDP_OUTPUT_SURFACE_RENDER_ROTATE_270:
-            glTexCoord2i(srcRect.x0, srcRect.y0); break;
-        }
-    }
-    if (colors && (flags & VDP_OUTPUT_SURFACE_RENDER_COLOR_PER_VERTEX))
-        glColor4f(colors[3].red, colors[3].green, colors[3].blue, colors[3].alpha);
-    glVertex2f(dstRect.x0, dstRect.y1);
 
-    glEnd();
-    glColor4f(1, 1, 1, 1);
+    QuadBatch batch;
+    batch.add(v);
+    batch.draw();
 }
 
 static
@@ -229,7 +201,7 @@ vdpBlendStateToGLBlendState(VdpOutputSurfaceRenderBlendState const *blend_state)
     return bs;
 }
 
-Resource::Resource(shared_ptr<vdp::Device::Resource> a_device, VdpRGBAFormat a_rgba_format,
+Resource::Resource(ResourcePtr<vdp::Device::Resource> a_device, VdpRGBAFormat a_rgba_format,
                    uint32_t a_width, uint32_t a_height)
     : rgba_format{a_rgba_format}
     , width{a_width}
@@ -288,7 +260,7 @@ Resource::Resource(shared_ptr<vdp::Device::Resource> a_device, VdpRGBAFormat a_r
     GLXThreadLocalContext guard{device};
 
     glGenTextures(1, &tex_id);
-    glBindTexture(GL_TEXTURE_2D, tex_id);
+    gl_state::bind_texture(tex_id);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -299,7 +271,7 @@ Resource::Resource(shared_ptr<vdp::Device::Resource> a_device, VdpRGBAFormat a_r
                  nullptr);
 
     glGenFramebuffers(1, &fbo_id);
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo_id);
+    gl_state::bind_framebuffer(fbo_id);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex_id, 0);
 
     const auto gl_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
@@ -310,13 +282,10 @@ Resource::Resource(shared_ptr<vdp::Device::Resource> a_device, VdpRGBAFormat a_r
 
     glClearColor(0.0, 0.0, 0.0, 0.0);
     glClear(GL_COLOR_BUFFER_BIT);
-    glFinish();
+    fence.set();
 
-    const auto gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        traceError("OutputSurface::Resource::Resource(): gl error %d\n", gl_error);
+    if (gl_debug::check_error("OutputSurface::Resource::Resource()"))
         throw vdp::generic_error();
-    }
 }
 
 Resource::~Resource()
@@ -324,12 +293,11 @@ Resource::~Resource()
     try {
         GLXThreadLocalContext guard{device};
 
-        glDeleteTextures(1, &tex_id);
-        glDeleteFramebuffers(1, &fbo_id);
+        fence.release();
+        gl_state::delete_textures(1, &tex_id);
+        gl_state::delete_framebuffers(1, &fbo_id);
 
-        const auto gl_error = glGetError();
-        if (gl_error != GL_NO_ERROR)
-            traceError("OutputSurface::Resource::~Resource(): gl error %d\n", gl_error);
+        gl_debug::check_error("OutputSurface::Resource::~Resource()");
 
     } catch (...) {
         traceError("OutputSurface::Resource::~Resource(): caught exception\n");
@@ -345,7 +313,7 @@ CreateImpl(VdpDevice device_id, VdpRGBAFormat rgba_format, uint32_t width, uint3
 
     ResourceRef<vdp::Device::Resource> device{device_id};
 
-    auto data = std::make_shared<Resource>(device, rgba_format, width, height);
+    auto data = make_resource<Resource>(device, rgba_format, width, height);
 
     *surface = ResourceStorage<Resource>::instance().insert(data);
     return VDP_STATUS_OK;
@@ -355,7 +323,8 @@ VdpStatus
 Create(VdpDevice device_id, VdpRGBAFormat rgba_format, uint32_t width, uint32_t height,
        VdpOutputSurface *surface)
 {
-    return check_for_exceptions(CreateImpl, device_id, rgba_format, width, height, surface);
+    return call_on_render_thread<vdp::Device::Resource>(device_id, CreateImpl, device_id,
+                                                        rgba_format, width, height, surface);
 }
 
 VdpStatus
@@ -370,7 +339,7 @@ DestroyImpl(VdpOutputSurface surface_id)
 VdpStatus
 Destroy(VdpOutputSurface surface_id)
 {
-    return check_for_exceptions(DestroyImpl, surface_id);
+    return call_on_render_thread<Resource>(surface_id, DestroyImpl, surface_id);
 }
 
 VdpStatus
@@ -388,7 +357,8 @@ GetBitsNativeImpl(VdpOutputSurface surface_id, VdpRect const *source_rect,
 
     GLXThreadLocalContext guard{surface->device};
 
-    glBindFramebuffer(GL_FRAMEBUFFER, surface->fbo_id);
+    surface->fence.wait();
+    gl_state::bind_framebuffer(surface->fbo_id);
     glReadBuffer(GL_COLOR_ATTACHMENT0);
     glPixelStorei(GL_UNPACK_ROW_LENGTH, destination_pitches[0] / surface->bytes_per_pixel);
 
@@ -402,13 +372,10 @@ GetBitsNativeImpl(VdpOutputSurface surface_id, VdpRect const *source_rect,
     if (surface->bytes_per_pixel != 4)
         glPixelStorei(GL_PACK_ALIGNMENT, 4);
 
-    glFinish();
+    // glReadPixels() to client memory is synchronous, no need to wait for anything here
 
-    const auto gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        traceError("OutputSurface::GetBitsNativeImpl(): gl error %d\n", gl_error);
+    if (gl_debug::check_error("OutputSurface::GetBitsNativeImpl()"))
         return VDP_STATUS_ERROR;
-    }
 
     return VDP_STATUS_OK;
 }
@@ -417,8 +384,8 @@ VdpStatus
 GetBitsNative(VdpOutputSurface surface_id, VdpRect const *source_rect,
               void *const *destination_data, uint32_t const *destination_pitches)
 {
-    return check_for_exceptions(GetBitsNativeImpl, surface_id, source_rect, destination_data,
-                                destination_pitches);
+    return call_on_render_thread<Resource>(surface_id, GetBitsNativeImpl, surface_id, source_rect,
+                                           destination_data, destination_pitches);
 }
 
 VdpStatus
@@ -428,7 +395,8 @@ GetParametersImpl(VdpOutputSurface surface_id, VdpRGBAFormat *rgba_format, uint3
     if (!rgba_format || !width || !height)
         return VDP_STATUS_INVALID_POINTER;
 
-    ResourceRef<Resource> surface{surface_id};
+    // all parameters are immutable, no need to lock
+    SharedResourceRef<Resource> surface{surface_id};
 
     *rgba_format = surface->rgba_format;
     *width       = surface->width;
@@ -490,17 +458,15 @@ PutBitsIndexedImpl(VdpOutputSurface surface_id, VdpIndexedFormat source_indexed_
                 }
             }
 
-            glBindTexture(GL_TEXTURE_2D, surface->tex_id);
+            surface->fence.wait();
+            gl_state::bind_texture(surface->tex_id);
             glTexSubImage2D(GL_TEXTURE_2D, 0, dst_rect.x0, dst_rect.y0,
                             dst_rect.x1 - dst_rect.x0, dst_rect.y1 - dst_rect.y0,
                             GL_BGRA, GL_UNSIGNED_BYTE, unpacked_buf.data());
-            glFinish();
+            surface->fence.set();
 
-            const auto gl_error = glGetError();
-            if (gl_error != GL_NO_ERROR) {
-                traceError("OutputSurface::PutBitsIndexedImpl(): gl error %d\n", gl_error);
+            if (gl_debug::check_error("OutputSurface::PutBitsIndexedImpl()"))
                 return VDP_STATUS_ERROR;
-            }
         } while (0);
         break;
 
@@ -519,8 +485,9 @@ PutBitsIndexed(VdpOutputSurface surface_id, VdpIndexedFormat source_indexed_form
                VdpRect const *destination_rect, VdpColorTableFormat color_table_format,
                void const *color_table)
 {
-    return check_for_exceptions(PutBitsIndexedImpl, surface_id, source_indexed_format, source_data,
-                                source_pitch, destination_rect, color_table_format, color_table);
+    return call_on_render_thread<Resource>(surface_id, PutBitsIndexedImpl, surface_id,
+                                           source_indexed_format, source_data, source_pitch,
+                                           destination_rect, color_table_format, color_table);
 }
 
 VdpStatus
@@ -538,7 +505,8 @@ PutBitsNativeImpl(VdpOutputSurface surface_id, void const *const *source_data,
 
     GLXThreadLocalContext guard{surface->device};
 
-    glBindTexture(GL_TEXTURE_2D, surface->tex_id);
+    surface->fence.wait();
+    gl_state::bind_texture(surface->tex_id);
 
     glPixelStorei(GL_UNPACK_ROW_LENGTH, source_pitches[0] / surface->bytes_per_pixel);
 
@@ -553,13 +521,10 @@ PutBitsNativeImpl(VdpOutputSurface surface_id, void const *const *source_data,
     if (surface->bytes_per_pixel != 4)
         glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-    glFinish();
+    surface->fence.set();
 
-    const auto gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        traceError("OutputSurface::PutBitsNativeImpl(): gl error %d\n", gl_error);
+    if (gl_debug::check_error("OutputSurface::PutBitsNativeImpl()"))
         return VDP_STATUS_ERROR;
-    }
 
     return VDP_STATUS_OK;
 }
@@ -568,8 +533,30 @@ VdpStatus
 PutBitsNative(VdpOutputSurface surface_id, void const *const *source_data,
               uint32_t const *source_pitches, VdpRect const *destination_rect)
 {
-    return check_for_exceptions(PutBitsNativeImpl, surface_id, source_data, source_pitches,
-                                destination_rect);
+    auto surf = find_with_render_thread<Resource>(surface_id);
+    if (!surf || !source_data || !source_pitches || !rect_is_valid(destination_rect)) {
+        return call_on_render_thread<Resource>(surface_id, PutBitsNativeImpl, surface_id,
+                                               source_data, source_pitches, destination_rect);
+    }
+
+    // copy source image, so the call can return before the upload happens
+    VdpRect d_rect = {0, 0, surf->width, surf->height};
+    if (destination_rect)
+        d_rect = *destination_rect;
+
+    auto data = std::make_shared<DeferredData>();
+    const void *plane = data->copy_plane(source_data[0], source_pitches[0], d_rect.y1 - d_rect.y0,
+                                         (d_rect.x1 - d_rect.x0) * surf->bytes_per_pixel);
+    const auto src =     data->copy(&plane);
+    const auto pitches = data->copy(source_pitches);
+    const auto rect =    data->copy(destination_rect);
+
+    post_call(render_thread_of(surf.get()), "OutputSurface::PutBitsNative",
+              [data, surface_id, src, pitches, rect] () {
+                  return check_for_exceptions(PutBitsNativeImpl, surface_id, src, pitches, rect);
+              });
+
+    return VDP_STATUS_OK;
 }
 
 VdpStatus
@@ -592,8 +579,9 @@ PutBitsYCbCr(VdpOutputSurface surface, VdpYCbCrFormat source_ycbcr_format,
              void const *const *source_data, uint32_t const *source_pitches,
              VdpRect const *destination_rect, VdpCSCMatrix const *csc_matrix)
 {
-    return check_for_exceptions(PutBitsYCbCrImpl, surface, source_ycbcr_format, source_data,
-                                source_pitches, destination_rect, csc_matrix);
+    return call_on_render_thread<Resource>(surface, PutBitsYCbCrImpl, surface, source_ycbcr_format,
+                                           source_data, source_pitches, destination_rect,
+                                           csc_matrix);
 }
 
 VdpStatus
@@ -623,11 +611,8 @@ QueryCapabilitiesImpl(VdpDevice device_id, VdpRGBAFormat surface_rgba_format, Vd
     GLint max_texture_size;
     glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
 
-    const auto gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        traceError("OutputSurface::QueryCapabilitiesImpl(): gl error %d\n", gl_error);
+    if (gl_debug::check_error("OutputSurface::QueryCapabilitiesImpl()"))
         return VDP_STATUS_ERROR;
-    }
 
     *max_width = max_texture_size;
     *max_height = max_texture_size;
@@ -705,6 +690,33 @@ QueryPutBitsYCbCrCapabilities(VdpDevice device, VdpRGBAFormat surface_rgba_forma
                                 bits_ycbcr_format, is_supported);
 }
 
+/// Checks arguments of RenderBitmapSurface and RenderOutputSurface before the call is queued to
+/// the render thread, where errors could not be returned anymore. `Source` is the resource type
+/// of the source surface.
+template <class Source>
+static
+bool
+render_args_valid(Resource *dst_surf, VdpRect const *destination_rect, uint32_t source_surface,
+                  VdpRect const *source_rect, VdpOutputSurfaceRenderBlendState const *blend_state)
+{
+    if (blend_state) {
+        if (blend_state->struct_version != VDP_OUTPUT_SURFACE_RENDER_BLEND_STATE_VERSION)
+            return false;
+    }
+
+    const struct blend_state_struct bs = vdpBlendStateToGLBlendState(blend_state);
+    if (bs.invalid_func || bs.invalid_eq)
+        return false;
+
+    if (source_surface != VDP_INVALID_HANDLE) {
+        auto src_surf = ResourceStorage<Source>::instance().find(source_surface);
+        if (!src_surf || src_surf->device->id != dst_surf->device->id)
+            return false;
+    }
+
+    return rect_is_valid(destination_rect) && rect_is_valid(source_rect);
+}
+
 VdpStatus
 RenderBitmapSurfaceImpl(VdpOutputSurface destination_surface, VdpRect const *destination_rect,
                         VdpBitmapSurface source_surface, VdpRect const *source_rect,
@@ -716,7 +728,14 @@ RenderBitmapSurfaceImpl(VdpOutputSurface destination_surface, VdpRect const *des
             return VDP_STATUS_INVALID_VALUE;
     }
 
-    ResourceRef<vdp::OutputSurface::Resource> dst_surf{destination_surface};
+    ResourceRefSet refs;
+    auto dst_surf = refs.add<vdp::OutputSurface::Resource>(destination_surface);
+
+    vdp::BitmapSurface::Resource *src_surf = nullptr;
+    if (source_surface != VDP_INVALID_HANDLE)
+        src_surf = refs.add<vdp::BitmapSurface::Resource>(source_surface);
+
+    refs.acquire();
 
     // select blend functions
     struct blend_state_struct bs = vdpBlendStateToGLBlendState(blend_state);
@@ -729,29 +748,28 @@ RenderBitmapSurfaceImpl(VdpOutputSurface destination_surface, VdpRect const *des
 
     GLXThreadLocalContext guard{dst_surf->device};
 
-    glBindFramebuffer(GL_FRAMEBUFFER, dst_surf->fbo_id);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(0, dst_surf->width, 0, dst_surf->height, -1.0f, 1.0f);
-    glViewport(0, 0, dst_surf->width, dst_surf->height);
-    glEnable(GL_TEXTURE_2D);
-    glEnable(GL_BLEND);
+    dst_surf->fence.wait();
+    if (src_surf)
+        src_surf->fence.wait();
 
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    gl_state::bind_framebuffer(dst_surf->fbo_id);
+    gl_state::ortho(0, dst_surf->width, 0, dst_surf->height);
+    gl_state::viewport(0, 0, dst_surf->width, dst_surf->height);
+    gl_state::set_blend(true);
 
     VdpRect s_rect = {0, 0, 1, 1};
 
-    if (source_surface != VDP_INVALID_HANDLE) {
-        ResourceRef<vdp::BitmapSurface::Resource> src_surf{source_surface};
+    // without source surface, source is treated as opaque white
+    gl_state::use_program(dst_surf->device->shaders[glsl_solid_color].program);
 
+    if (src_surf) {
         if (dst_surf->device->id != src_surf->device->id)
             return VDP_STATUS_HANDLE_DEVICE_MISMATCH;
 
         s_rect.x1 = src_surf->width;
         s_rect.y1 = src_surf->height;
 
-        glBindTexture(GL_TEXTURE_2D, src_surf->tex_id);
+        gl_state::bind_texture(src_surf->tex_id);
 
         if (src_surf->dirty) {
             if (src_surf->bytes_per_pixel != 4)
@@ -767,14 +785,12 @@ RenderBitmapSurfaceImpl(VdpOutputSurface destination_surface, VdpRect const *des
             src_surf->dirty = false;
         }
 
-        glMatrixMode(GL_TEXTURE);
-        glLoadIdentity();
-        glScalef(1.0f / src_surf->width, 1.0f / src_surf->height, 1.0f);
+        gl_state::texture_scale(1.0f / src_surf->width, 1.0f / src_surf->height);
 
-        if (src_surf->rgba_format == VDP_RGBA_FORMAT_A8) {
-            glUseProgram(src_surf->device->shaders[glsl_red_to_alpha_swizzle].program);
-            glUniform1i(src_surf->device->shaders[glsl_red_to_alpha_swizzle].uniform.tex_0, 0);
-        }
+        if (src_surf->rgba_format == VDP_RGBA_FORMAT_A8)
+            gl_state::use_program(src_surf->device->shaders[glsl_red_to_alpha_swizzle].program);
+        else
+            gl_state::use_program(src_surf->device->shaders[glsl_texture_color].program);
     }
 
     VdpRect d_rect = {0, 0, dst_surf->width, dst_surf->height};
@@ -784,16 +800,14 @@ RenderBitmapSurfaceImpl(VdpOutputSurface destination_surface, VdpRect const *des
     if (source_rect)
         s_rect = *source_rect;
 
-    compose_surfaces(bs, s_rect, d_rect, colors, flags, source_surface != VDP_INVALID_HANDLE);
+    compose_surfaces(bs, s_rect, d_rect, colors, flags);
 
-    glUseProgram(0);
-    glFinish();
+    dst_surf->fence.set();
+    if (src_surf)
+        src_surf->fence.set();
 
-    const auto gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        traceError("OutputSurface::RenderBitmapSurfaceImpl(): gl error %d\n", gl_error);
+    if (gl_debug::check_error("OutputSurface::RenderBitmapSurfaceImpl()"))
         return VDP_STATUS_ERROR;
-    }
 
     return VDP_STATUS_OK;
 }
@@ -804,8 +818,34 @@ RenderBitmapSurface(VdpOutputSurface destination_surface, VdpRect const *destina
                     VdpColor const *colors, VdpOutputSurfaceRenderBlendState const *blend_state,
                     uint32_t flags)
 {
-    return check_for_exceptions(RenderBitmapSurfaceImpl, destination_surface, destination_rect,
-                                source_surface, source_rect, colors, blend_state, flags);
+    auto dst_surf = find_with_render_thread<Resource>(destination_surface);
+    if (!dst_surf ||
+        !render_args_valid<vdp::BitmapSurface::Resource>(dst_surf.get(), destination_rect,
+                                                         source_surface, source_rect, blend_state))
+    {
+        // errors are reported by the synchronous path, since a queued call can't return them
+        return call_on_render_thread<Resource>(destination_surface, RenderBitmapSurfaceImpl,
+                                               destination_surface, destination_rect,
+                                               source_surface, source_rect, colors, blend_state,
+                                               flags);
+    }
+
+    auto data = std::make_shared<DeferredData>();
+    const auto dst_rect = data->copy(destination_rect);
+    const auto src_rect = data->copy(source_rect);
+    const auto colors_copy =
+        data->copy(colors, (flags & VDP_OUTPUT_SURFACE_RENDER_COLOR_PER_VERTEX) ? 4 : 1);
+    const auto blend_state_copy = data->copy(blend_state);
+
+    post_call(render_thread_of(dst_surf.get()), "OutputSurface::RenderBitmapSurface",
+              [data, destination_surface, dst_rect, source_surface, src_rect, colors_copy,
+               blend_state_copy, flags] () {
+                  return check_for_exceptions(RenderBitmapSurfaceImpl, destination_surface,
+                                              dst_rect, source_surface, src_rect, colors_copy,
+                                              blend_state_copy, flags);
+              });
+
+    return VDP_STATUS_OK;
 }
 
 VdpStatus
@@ -819,7 +859,14 @@ RenderOutputSurfaceImpl(VdpOutputSurface destination_surface, VdpRect const *des
             return VDP_STATUS_INVALID_VALUE;
     }
 
-    ResourceRef<Resource> dst_surf{destination_surface};
+    ResourceRefSet refs;
+    auto dst_surf = refs.add<Resource>(destination_surface);
+
+    Resource *src_surf = nullptr;
+    if (source_surface != VDP_INVALID_HANDLE)
+        src_surf = refs.add<Resource>(source_surface);
+
+    refs.acquire();
 
     // select blend functions
     struct blend_state_struct bs = vdpBlendStateToGLBlendState(blend_state);
@@ -832,33 +879,30 @@ RenderOutputSurfaceImpl(VdpOutputSurface destination_surface, VdpRect const *des
 
     GLXThreadLocalContext guard{dst_surf->device};
 
-    glBindFramebuffer(GL_FRAMEBUFFER, dst_surf->fbo_id);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(0, dst_surf->width, 0, dst_surf->height, -1.0f, 1.0f);
-    glViewport(0, 0, dst_surf->width, dst_surf->height);
-    glEnable(GL_TEXTURE_2D);
-    glEnable(GL_BLEND);
+    dst_surf->fence.wait();
+    if (src_surf)
+        src_surf->fence.wait();
 
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    gl_state::bind_framebuffer(dst_surf->fbo_id);
+    gl_state::ortho(0, dst_surf->width, 0, dst_surf->height);
+    gl_state::viewport(0, 0, dst_surf->width, dst_surf->height);
+    gl_state::set_blend(true);
 
     VdpRect s_rect = {0, 0, 1, 1};
 
-    if (source_surface != VDP_INVALID_HANDLE) {
-        ResourceRef<vdp::OutputSurface::Resource> src_surf{source_surface};
+    // without source surface, source is treated as opaque white
+    gl_state::use_program(dst_surf->device->shaders[glsl_solid_color].program);
 
+    if (src_surf) {
         if (dst_surf->device->id != src_surf->device->id)
             return VDP_STATUS_HANDLE_DEVICE_MISMATCH;
 
         s_rect.x1 = src_surf->width;
         s_rect.y1 = src_surf->height;
 
-        glBindTexture(GL_TEXTURE_2D, src_surf->tex_id);
-
-        glMatrixMode(GL_TEXTURE);
-        glLoadIdentity();
-        glScalef(1.0f / src_surf->width, 1.0f / src_surf->height, 1.0f);
+        gl_state::bind_texture(src_surf->tex_id);
+        gl_state::texture_scale(1.0f / src_surf->width, 1.0f / src_surf->height);
+        gl_state::use_program(src_surf->device->shaders[glsl_texture_color].program);
     }
 
     VdpRect d_rect = {0, 0, dst_surf->width, dst_surf->height};
@@ -867,14 +911,14 @@ RenderOutputSurfaceImpl(VdpOutputSurface destination_surface, VdpRect const *des
     if (source_rect)
         s_rect = *source_rect;
 
-    compose_surfaces(bs, s_rect, d_rect, colors, flags, source_surface != VDP_INVALID_HANDLE);
-    glFinish();
+    compose_surfaces(bs, s_rect, d_rect, colors, flags);
+
+    dst_surf->fence.set();
+    if (src_surf)
+        src_surf->fence.set();
 
-    const auto gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        traceError("OutputSurface::RenderOutputSurfaceImpl(): gl error %d\n", gl_error);
+    if (gl_debug::check_error("OutputSurface::RenderOutputSurfaceImpl()"))
         return VDP_STATUS_ERROR;
-    }
 
     return VDP_STATUS_OK;
 }
@@ -885,8 +929,33 @@ RenderOutputSurface(VdpOutputSurface destination_surface, VdpRect const *destina
                     VdpColor const *colors, VdpOutputSurfaceRenderBlendState const *blend_state,
                     uint32_t flags)
 {
-    return check_for_exceptions(RenderOutputSurfaceImpl, destination_surface, destination_rect,
-                                source_surface, source_rect, colors, blend_state, flags);
+    auto dst_surf = find_with_render_thread<Resource>(destination_surface);
+    if (!dst_surf || !render_args_valid<Resource>(dst_surf.get(), destination_rect, source_surface,
+                                                  source_rect, blend_state))
+    {
+        // errors are reported by the synchronous path, since a queued call can't return them
+        return call_on_render_thread<Resource>(destination_surface, RenderOutputSurfaceImpl,
+                                               destination_surface, destination_rect,
+                                               source_surface, source_rect, colors, blend_state,
+                                               flags);
+    }
+
+    auto data = std::make_shared<DeferredData>();
+    const auto dst_rect = data->copy(destination_rect);
+    const auto src_rect = data->copy(source_rect);
+    const auto colors_copy =
+        data->copy(colors, (flags & VDP_OUTPUT_SURFACE_RENDER_COLOR_PER_VERTEX) ? 4 : 1);
+    const auto blend_state_copy = data->copy(blend_state);
+
+    post_call(render_thread_of(dst_surf.get()), "OutputSurface::RenderOutputSurface",
+              [data, destination_surface, dst_rect, source_surface, src_rect, colors_copy,
+               blend_state_copy, flags] () {
+                  return check_for_exceptions(RenderOutputSurfaceImpl, destination_surface,
+                                              dst_rect, source_surface, src_rect, colors_copy,
+                                              blend_state_copy, flags);
+              });
+
+    return VDP_STATUS_OK;
 }
 
 } } // namespace vdp::OutputSurface
@@ -25,7 +25,9 @@
 #pragma once
 
 #include "api.hh"
+#include "gl-fence.hh"
 #include <GL/gl.h>
+#include <atomic>
 #include <memory>
 #include <vdpau/vdpau.h>
 
@@ -34,7 +36,7 @@ namespace vdp { namespace OutputSurface {
 
 struct Resource: public vdp::GenericResource
 {
-    Resource(std::shared_ptr<vdp::Device::Resource> a_device, VdpRGBAFormat a_rgba_format,
+    Resource(ResourcePtr<vdp::Device::Resource> a_device, VdpRGBAFormat a_rgba_format,
              uint32_t a_width, uint32_t a_height);
 
     ~Resource();
@@ -42,14 +44,18 @@ struct Resource: public vdp::GenericResource
     VdpRGBAFormat   rgba_format;        ///< RGBA format of data stored
     GLuint          tex_id;             ///< associated GL texture id
     GLuint          fbo_id;             ///< framebuffer object id
+    vdp::GLFence    fence;              ///< completion of the last GL command using surface
     uint32_t        width;
     uint32_t        height;
     GLuint          gl_internal_format; ///< GL texture format: internal format
     GLuint          gl_format;          ///< GL texture format: preferred external format
     GLuint          gl_type;            ///< GL texture format: pixel type
     unsigned int    bytes_per_pixel;    ///< number of bytes per pixel
-    VdpTime         first_presentation_time;    ///< first displayed time in queue
-    VdpPresentationQueueStatus  status; ///< status in presentation queue
+
+    // Presentation state is read without the surface lock. Writers store
+    // first_presentation_time before status, readers load status first.
+    std::atomic<VdpTime>    first_presentation_time;    ///< first displayed time in queue
+    std::atomic<VdpPresentationQueueStatus> status;     ///< status in presentation queue
 };
 
 VdpOutputSurfaceQueryCapabilities                   QueryCapabilities;
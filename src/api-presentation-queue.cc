@@ -25,9 +25,14 @@
 #define GL_GLEXT_PROTOTYPES
 #include "api-output-surface.hh"
 #include "api-presentation-queue.hh"
+#include "egl-context.hh"
+#include "gl-debug.hh"
+#include "gl-state.hh"
 #include "globals.hh"
 #include "glx-context.hh"
 #include "handle-storage.hh"
+#include "lock-stats.hh"
+#include "quad-batch.hh"
 #include "trace.hh"
 #include "watermark.hh"
 #include <GL/gl.h>
@@ -45,8 +50,6 @@
 
 using std::chrono::microseconds;
 using std::chrono::milliseconds;
-using std::make_shared;
-using std::shared_ptr;
 
 namespace {
 
@@ -85,8 +88,8 @@ struct Task
 };
 
 std::queue<Task>        g_task_queue;
-std::mutex              g_task_queue_mtx;
-std::condition_variable g_task_queue_cv;
+vdp::ProfiledMutex<std::mutex>  g_task_queue_mtx{vdp::kLockSiteTaskQueue};
+std::condition_variable_any     g_task_queue_cv;
 
 } // anonymous namespace
 
@@ -183,8 +186,10 @@ void
 do_presentation_queue_display(const Task &task)
 {
     try {
-        ResourceRef<vdp::PresentationQueue::Resource> pq{task.pq_id};
-        ResourceRef<vdp::OutputSurface::Resource> surface{task.surface_id};
+        ResourceRefSet refs;
+        auto pq =      refs.add<vdp::PresentationQueue::Resource>(task.pq_id);
+        auto surface = refs.add<vdp::OutputSurface::Resource>(task.surface_id);
+        refs.acquire();
 
         const uint32_t clip_width = task.clip_width;
         const uint32_t clip_height = task.clip_height;
@@ -193,58 +198,40 @@ do_presentation_queue_display(const Task &task)
 
         pq->target->recreate_pixmaps_if_geometry_changed();
         glXMakeCurrent(pq->device->dpy.get(), pq->target->glx_pixmap, pq->target->glc);
+        vdp::gl_debug::enable_output();
 
         const uint32_t target_width  = (clip_width > 0)  ? clip_width  : surface->width;
         const uint32_t target_height = (clip_height > 0) ? clip_height : surface->height;
 
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        glOrtho(0, target_width, target_height, 0, -1.0, 1.0);
-        glViewport(0, 0, target_width, target_height);
-
-        glMatrixMode(GL_MODELVIEW);
-        glLoadIdentity();
-
-        glMatrixMode(GL_TEXTURE);
-        glLoadIdentity();
-        glScalef(1.0f/surface->width, 1.0f/surface->height, 1.0f);
-
-        glEnable(GL_TEXTURE_2D);
-        glDisable(GL_BLEND);
-        glBindTexture(GL_TEXTURE_2D, surface->tex_id);
-        glColor4f(1, 1, 1, 1);
-        glBegin(GL_QUADS);
-            glTexCoord2i(0, 0);                        glVertex2i(0, 0);
-            glTexCoord2i(target_width, 0);             glVertex2i(target_width, 0);
-            glTexCoord2i(target_width, target_height); glVertex2i(target_width, target_height);
-            glTexCoord2i(0, target_height);            glVertex2i(0, target_height);
-        glEnd();
+        vdp::gl_state::ortho(0, target_width, target_height, 0);
+        vdp::gl_state::viewport(0, 0, target_width, target_height);
+        vdp::gl_state::texture_scale(1.0f/surface->width, 1.0f/surface->height);
 
-        if (global.quirks.show_watermark) {
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-            glBlendEquation(GL_FUNC_ADD);
-            glBindTexture(GL_TEXTURE_2D, pq->device->watermark_tex_id);
-
-            glMatrixMode(GL_TEXTURE);
-            glLoadIdentity();
-
-            glColor4f(1.0, 1.0, 1.0, 0.2);
-            glBegin(GL_QUADS);
-                glTexCoord2i(0, 0);
-                glVertex2i(target_width - watermark_width, target_height - watermark_height);
+        // surface may have been rendered in another context
+        surface->fence.wait();
 
-                glTexCoord2i(1, 0);
-                glVertex2i(target_width, target_height - watermark_height);
+        vdp::gl_state::set_blend(false);
+        vdp::gl_state::bind_texture(surface->tex_id);
+        vdp::gl_state::use_program(pq->device->shaders[glsl_texture_color].program);
 
-                glTexCoord2i(1, 1);
-                glVertex2i(target_width, target_height);
+        vdp::QuadBatch batch;
+        batch.add_rect(0, 0, target_width, target_height, 0, 0, target_width, target_height);
+        batch.draw();
 
-                glTexCoord2i(0, 1);
-                glVertex2i(target_width - watermark_width, target_height);
-            glEnd();
+        if (global.quirks.show_watermark) {
+            vdp::gl_state::set_blend(true);
+            vdp::gl_state::blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA,
+                                      GL_ONE_MINUS_SRC_ALPHA);
+            vdp::gl_state::blend_equation(GL_FUNC_ADD, GL_FUNC_ADD);
+            vdp::gl_state::bind_texture(pq->device->watermark_tex_id);
+            vdp::gl_state::texture_scale(1.0f, 1.0f);
+
+            batch.add_rect(target_width - watermark_width, target_height - watermark_height,
+                           target_width, target_height, 0, 0, 1, 1, 1.0f, 1.0f, 1.0f, 0.2f);
+            batch.draw();
         }
 
+        // X server reads the pixmap, which GL fences don't cover
         glFinish();
 
         x11_push_eh();
@@ -265,11 +252,7 @@ do_presentation_queue_display(const Task &task)
         surface->first_presentation_time = timespec2vdptime(now);
         surface->status = VDP_PRESENTATION_QUEUE_STATUS_IDLE;
 
-        const auto gl_error = glGetError();
-        if (gl_error != GL_NO_ERROR) {
-            traceError("PresentationQueue::do_presentation_queue_display(): gl error %d\n",
-                       gl_error);
-        }
+        vdp::gl_debug::check_error("PresentationQueue::do_presentation_queue_display()");
 
     } catch (const vdp::resource_not_found &) {
         // just ignoring
@@ -347,12 +330,12 @@ BlockUntilSurfaceIdleImpl(VdpPresentationQueue presentation_queue, VdpOutputSurf
 {
     // ensure presentation_queue is valid;
     {
-        ResourceRef<Resource> pq{presentation_queue};
+        SharedResourceRef<Resource> pq{presentation_queue};
     }
 
     // TODO: use locking instead of busy loop
     while (true) {
-        ResourceRef<vdp::OutputSurface::Resource> surface{surface_id};
+        SharedResourceRef<vdp::OutputSurface::Resource> surface{surface_id};
 
         if (surface->status == VDP_PRESENTATION_QUEUE_STATUS_IDLE)
             break;
@@ -361,7 +344,7 @@ BlockUntilSurfaceIdleImpl(VdpPresentationQueue presentation_queue, VdpOutputSurf
     }
 
     if (first_presentation_time) {
-        ResourceRef<vdp::OutputSurface::Resource> surface{surface_id};
+        SharedResourceRef<vdp::OutputSurface::Resource> surface{surface_id};
         *first_presentation_time = surface->first_presentation_time;
     }
 
@@ -372,6 +355,9 @@ VdpStatus
 BlockUntilSurfaceIdle(VdpPresentationQueue presentation_queue, VdpOutputSurface surface_id,
                       VdpTime *first_presentation_time)
 {
+    // make sure surface has reached presentation queue
+    sync_render_thread<vdp::OutputSurface::Resource>(surface_id);
+
     return check_for_exceptions(BlockUntilSurfaceIdleImpl, presentation_queue, surface_id,
                                 first_presentation_time);
 }
@@ -380,8 +366,9 @@ VdpStatus
 QuerySurfaceStatusImpl(VdpPresentationQueue presentation_queue, VdpOutputSurface surface_id,
                        VdpPresentationQueueStatus *status, VdpTime *first_presentation_time)
 {
-    ResourceRef<Resource> pq{presentation_queue};
-    ResourceRef<vdp::OutputSurface::Resource> surface{surface_id};
+    // status is polled often, don't wait for rendering to finish
+    SharedResourceRef<Resource> pq{presentation_queue};
+    SharedResourceRef<vdp::OutputSurface::Resource> surface{surface_id};
 
     if (status)
         *status = surface->status;
@@ -400,7 +387,7 @@ QuerySurfaceStatus(VdpPresentationQueue presentation_queue, VdpOutputSurface sur
                                 first_presentation_time);
 }
 
-TargetResource::TargetResource(std::shared_ptr<vdp::Device::Resource> a_device,
+TargetResource::TargetResource(ResourcePtr<vdp::Device::Resource> a_device,
                                Drawable a_drawable)
 {
     device = a_device;
@@ -437,15 +424,13 @@ TargetResource::~TargetResource()
         // drawable may be destroyed already, so it's a global context that should be activated
         {
             GLXThreadLocalContext guard{device, false}; // keep that context set afterwards
+            gl_state::destroying_context(glc, true);    // thread context shares objects
+            GLXLockGuard          x11_guard;
             glXDestroyContext(device->dpy.get(), glc);  // since previous was just destroyed
+            gl_state::context_destroyed();
             free_glx_pixmaps();
 
-            const auto gl_error = glGetError();
-
-            if (gl_error != GL_NO_ERROR) {
-                traceError("PresentationQueue::TargetResource::~TargetResource(): gl error %d\n",
-                           gl_error);
-            }
+            gl_debug::check_error("PresentationQueue::TargetResource::~TargetResource()");
         }
 
         XFree(xvi);
@@ -499,7 +484,7 @@ TargetResource::recreate_pixmaps_if_geometry_changed()
     }
 }
 
-Resource::Resource(shared_ptr<vdp::Device::Resource> a_device, shared_ptr<TargetResource> a_target)
+Resource::Resource(ResourcePtr<vdp::Device::Resource> a_device, ResourcePtr<TargetResource> a_target)
 {
     device = a_device;
     target = a_target;
@@ -540,7 +525,7 @@ CreateImpl(VdpDevice device_id, VdpPresentationQueueTarget presentation_queue_ta
     ResourceRef<vdp::Device::Resource> device{device_id};
     ResourceRef<TargetResource> target{presentation_queue_target};
 
-    auto data = make_shared<Resource>(device, target);
+    auto data = make_resource<Resource>(device, target);
 
     *presentation_queue = ResourceStorage<Resource>::instance().insert(data);
 
@@ -551,8 +536,9 @@ VdpStatus
 Create(VdpDevice device_id, VdpPresentationQueueTarget presentation_queue_target,
        VdpPresentationQueue *presentation_queue)
 {
-    return check_for_exceptions(CreateImpl, device_id, presentation_queue_target,
-                                presentation_queue);
+    return call_on_render_thread<vdp::Device::Resource>(device_id, CreateImpl, device_id,
+                                                        presentation_queue_target,
+                                                        presentation_queue);
 }
 
 VdpStatus
@@ -567,13 +553,14 @@ DestroyImpl(VdpPresentationQueue presentation_queue)
 VdpStatus
 Destroy(VdpPresentationQueue presentation_queue)
 {
-    return check_for_exceptions(DestroyImpl, presentation_queue);
+    return call_on_render_thread<Resource>(presentation_queue, DestroyImpl, presentation_queue);
 }
 
 VdpStatus
 SetBackgroundColorImpl(VdpPresentationQueue presentation_queue, VdpColor *const background_color)
 {
-    ResourceRef<Resource> pq{presentation_queue};
+    SharedResourceRef<Resource> pq{presentation_queue};
+    std::unique_lock<decltype(pq->bg_color_mtx)> lock{pq->bg_color_mtx};
 
     if (background_color) {
         pq->bg_color = *background_color;
@@ -596,7 +583,8 @@ SetBackgroundColor(VdpPresentationQueue presentation_queue, VdpColor *const back
 VdpStatus
 GetBackgroundColorImpl(VdpPresentationQueue presentation_queue, VdpColor *background_color)
 {
-    ResourceRef<Resource> pq{presentation_queue};
+    SharedResourceRef<Resource> pq{presentation_queue};
+    std::unique_lock<decltype(pq->bg_color_mtx)> lock{pq->bg_color_mtx};
 
     if (background_color)
         *background_color = pq->bg_color;
@@ -626,8 +614,10 @@ VdpStatus
 DisplayImpl(VdpPresentationQueue presentation_queue, VdpOutputSurface surface_id,
             uint32_t clip_width, uint32_t clip_height, VdpTime earliest_presentation_time)
 {
-    ResourceRef<Resource> pq{presentation_queue};
-    ResourceRef<vdp::OutputSurface::Resource> surface{surface_id};
+    ResourceRefSet refs;
+    auto pq =      refs.add<Resource>(presentation_queue);
+    auto surface = refs.add<vdp::OutputSurface::Resource>(surface_id);
+    refs.acquire();
 
     if (pq->device->id != surface->device->id)
         return VDP_STATUS_HANDLE_DEVICE_MISMATCH;
@@ -657,8 +647,30 @@ VdpStatus
 Display(VdpPresentationQueue presentation_queue, VdpOutputSurface surface_id, uint32_t clip_width,
         uint32_t clip_height, VdpTime earliest_presentation_time)
 {
-    return check_for_exceptions(DisplayImpl, presentation_queue, surface_id, clip_width,
-                                clip_height, earliest_presentation_time);
+    auto surface = find_with_render_thread<vdp::OutputSurface::Resource>(surface_id);
+    auto pq = ResourceStorage<Resource>::instance().find(presentation_queue);
+
+    if (!surface || !pq || pq->device->id != surface->device->id) {
+        // errors are reported by the synchronous path, since a queued call can't return them
+        return call_on_render_thread<vdp::OutputSurface::Resource>(
+            surface_id, DisplayImpl, presentation_queue, surface_id, clip_width, clip_height,
+            earliest_presentation_time);
+    }
+
+    // Surface must be queued only after rendering to it completes, so the task is submitted from
+    // the render thread. Status changes right away though, as applications poll it to find out
+    // whether surface can be reused.
+    surface->status = VDP_PRESENTATION_QUEUE_STATUS_QUEUED;
+
+    post_call(render_thread_of(surface.get()), "PresentationQueue::Display",
+              [presentation_queue, surface_id, clip_width, clip_height,
+               earliest_presentation_time] () {
+                  return check_for_exceptions(DisplayImpl, presentation_queue, surface_id,
+                                              clip_width, clip_height,
+                                              earliest_presentation_time);
+              });
+
+    return VDP_STATUS_OK;
 }
 
 VdpStatus
@@ -669,7 +681,12 @@ TargetCreateX11Impl(VdpDevice device_id, Drawable drawable, VdpPresentationQueue
 
     ResourceRef<vdp::Device::Resource> device{device_id};
 
-    auto data = make_shared<TargetResource>(device, drawable);
+    if (egl::enabled()) {
+        traceError("PresentationQueue::TargetCreateX11(): no presentation in EGL mode\n");
+        return VDP_STATUS_ERROR;
+    }
+
+    auto data = make_resource<TargetResource>(device, drawable);
 
     *target = ResourceStorage<TargetResource>::instance().insert(data);
 
@@ -679,7 +696,8 @@ TargetCreateX11Impl(VdpDevice device_id, Drawable drawable, VdpPresentationQueue
 VdpStatus
 TargetCreateX11(VdpDevice device_id, Drawable drawable, VdpPresentationQueueTarget *target)
 {
-    return check_for_exceptions(TargetCreateX11Impl, device_id, drawable, target);
+    return call_on_render_thread<vdp::Device::Resource>(device_id, TargetCreateX11Impl, device_id,
+                                                        drawable, target);
 }
 
 VdpStatus
@@ -694,7 +712,8 @@ TargetDestroyImpl(VdpPresentationQueueTarget presentation_queue_target)
 VdpStatus
 TargetDestroy(VdpPresentationQueueTarget presentation_queue_target)
 {
-    return check_for_exceptions(TargetDestroyImpl, presentation_queue_target);
+    return call_on_render_thread<TargetResource>(presentation_queue_target, TargetDestroyImpl,
+                                                 presentation_queue_target);
 }
 
 } } // namespace vdp::PresentationQueue
@@ -27,6 +27,7 @@
 #include "api.hh"
 #include <GL/glx.h>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <vdpau/vdpau_x11.h>
 
@@ -35,7 +36,7 @@ namespace vdp { namespace PresentationQueue {
 
 struct TargetResource: public vdp::GenericResource
 {
-    TargetResource(std::shared_ptr<vdp::Device::Resource> device, Drawable drawable);
+    TargetResource(ResourcePtr<vdp::Device::Resource> device, Drawable drawable);
 
     ~TargetResource();
 
@@ -76,13 +77,14 @@ private:
 
 struct Resource: public vdp::GenericResource
 {
-    Resource(std::shared_ptr<vdp::Device::Resource> a_device,
-             std::shared_ptr<TargetResource> a_target);
+    Resource(ResourcePtr<vdp::Device::Resource> a_device,
+             ResourcePtr<TargetResource> a_target);
 
     ~Resource();
 
-    std::shared_ptr<TargetResource> target;
+    ResourcePtr<TargetResource> target;
     VdpColor                        bg_color;   ///< background color
+    std::mutex                      bg_color_mtx;   ///< guards bg_color
 
 private:
     PresentationQueueThreadRef      presentation_thread_reference;
@@ -27,18 +27,21 @@
 #include "api-output-surface.hh"
 #include "api-video-mixer.hh"
 #include "api-video-surface.hh"
+#include "gl-debug.hh"
+#include "gl-state.hh"
 #include "glx-context.hh"
 #include "handle-storage.hh"
+#include "quad-batch.hh"
 #include "trace.hh"
 #include <GL/gl.h>
+#include <memory>
 #include <stdlib.h>
 #include <string.h>
 #include <va/va_x11.h>
 #include <vdpau/vdpau.h>
+#include <vector>
 
 
-using std::make_shared;
-using std::shared_ptr;
 
 
 namespace vdp { namespace VideoMixer {
@@ -60,12 +63,18 @@ Resource::free_video_mixer_pixmaps()
 }
 
 void
-render_va_surf_to_texture(shared_ptr<Resource> mixer,
-                          shared_ptr<vdp::VideoSurface::Resource> src_surf)
+render_va_surf_to_texture(Resource *mixer, vdp::VideoSurface::Resource *src_surf)
 {
     auto deviceData = mixer->device;
     Display *dpy = mixer->device->dpy.get();
 
+    // previous frame must be read from pixmap before it gets overwritten
+    mixer->pixmap_fence.client_wait();
+    src_surf->fence.wait();
+
+    // texture-from-pixmap and vaPutSurface talk to X server through the shared connection
+    GLXLockGuard guard;
+
     if (src_surf->width != mixer->pixmap_width || src_surf->height != mixer->pixmap_height) {
         mixer->free_video_mixer_pixmaps();
         mixer->pixmap = XCreatePixmap(dpy, mixer->device->root, src_surf->width, src_surf->height,
@@ -101,40 +110,38 @@ render_va_surf_to_texture(shared_ptr<Resource> mixer,
         mixer->pixmap_height = src_surf->height;
     }
 
-    glBindTexture(GL_TEXTURE_2D, mixer->tex_id);
+    gl_state::bind_texture(mixer->tex_id);
     mixer->device->fn.glXBindTexImageEXT(dpy, mixer->glx_pixmap, GLX_FRONT_EXT, NULL);
     XSync(dpy, False); // TODO: avoid XSync
 
-    vaPutSurface(mixer->device->va_dpy, src_surf->va_surf, mixer->pixmap,
-                 0, 0, src_surf->width, src_surf->height,
-                 0, 0, src_surf->width, src_surf->height,
-                 nullptr, 0, VA_FRAME_PICTURE);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, src_surf->fbo_id);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(0, src_surf->width, 0, src_surf->height, -1.0, 1.0);
-    glViewport(0, 0, src_surf->width, src_surf->height);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    glMatrixMode(GL_TEXTURE);
-    glLoadIdentity();
-
-    glDisable(GL_BLEND);
-
-    glBegin(GL_QUADS);
-        glTexCoord2f(0, 0); glVertex2f(0,               0);
-        glTexCoord2f(1, 0); glVertex2f(src_surf->width, 0);
-        glTexCoord2f(1, 1); glVertex2f(src_surf->width, src_surf->height);
-        glTexCoord2f(0, 1); glVertex2f(0,               src_surf->height);
-    glEnd();
-    glFinish();
+    {
+        // both X11 and VA locks are needed here, in that order
+        std::unique_lock<decltype(mixer->device->va_mtx)> va_lock{mixer->device->va_mtx};
+        vaPutSurface(mixer->device->va_dpy, src_surf->va_surf, mixer->pixmap,
+                     0, 0, src_surf->width, src_surf->height,
+                     0, 0, src_surf->width, src_surf->height,
+                     nullptr, 0, VA_FRAME_PICTURE);
+    }
+
+    src_surf->allocate_rgba();
+    gl_state::bind_framebuffer(src_surf->fbo_id);
+    gl_state::ortho(0, src_surf->width, 0, src_surf->height);
+    gl_state::viewport(0, 0, src_surf->width, src_surf->height);
+    gl_state::texture_scale(1.0f, 1.0f);
+    gl_state::set_blend(false);
+
+    gl_state::use_program(mixer->device->shaders[glsl_texture_color].program);
+
+    QuadBatch batch;
+    batch.add_rect(0, 0, src_surf->width, src_surf->height, 0, 0, 1, 1);
+    batch.draw();
+    mixer->pixmap_fence.set();
+    src_surf->fence.set();
 
     mixer->device->fn.glXReleaseTexImageEXT(dpy, mixer->glx_pixmap, GLX_FRONT_EXT);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-Resource::Resource(shared_ptr<vdp::Device::Resource> a_device, uint32_t a_feature_count,
+Resource::Resource(ResourcePtr<vdp::Device::Resource> a_device, uint32_t a_feature_count,
                    VdpVideoMixerFeature const *a_features, uint32_t a_parameter_count,
                    VdpVideoMixerParameter const *a_parameters,
                    void const *const *a_parameter_values)
@@ -155,36 +162,34 @@ Resource::Resource(shared_ptr<vdp::Device::Resource> a_device, uint32_t a_featur
         GLXThreadLocalContext guard{device};
 
         glGenTextures(1, &tex_id);
-        glBindTexture(GL_TEXTURE_2D, tex_id);
+        gl_state::bind_texture(tex_id);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-        const auto gl_error = glGetError();
-        if (gl_error != GL_NO_ERROR) {
-            traceError("VideoMixer::Resource::Resource(): gl error %d\n", gl_error);
+        if (gl_debug::check_error("VideoMixer::Resource::Resource()"))
             throw vdp::generic_error();
-        }
     }
 }
 
 Resource::~Resource()
 {
     try {
-        {
-            GLXLockGuard guard;
-            free_video_mixer_pixmaps();
-        }
-
         {
             GLXThreadLocalContext guard{device};
 
-            glDeleteTextures(1, &tex_id);
+            // GPU may still read from pixmap
+            pixmap_fence.client_wait();
+            pixmap_fence.release();
+            gl_state::delete_textures(1, &tex_id);
+
+            gl_debug::check_error("VideoMixer::Resource::~Resource()");
+        }
 
-            const auto gl_error = glGetError();
-            if (gl_error != GL_NO_ERROR)
-                traceError("VideoMixer::Resource::~Resource(): gl error %d\n", gl_error);
+        {
+            GLXLockGuard guard;
+            free_video_mixer_pixmaps();
         }
 
     } catch (...) {
@@ -202,7 +207,7 @@ CreateImpl(VdpDevice device_id, uint32_t feature_count, VdpVideoMixerFeature con
 
     ResourceRef<vdp::Device::Resource> device{device_id};
 
-    auto data = make_shared<Resource>(device, feature_count, features, parameter_count,
+    auto data = make_resource<Resource>(device, feature_count, features, parameter_count,
                                       parameters, parameter_values);
 
     *mixer = ResourceStorage<Resource>::instance().insert(data);
@@ -214,8 +219,9 @@ Create(VdpDevice device_id, uint32_t feature_count, VdpVideoMixerFeature const *
        uint32_t parameter_count, VdpVideoMixerParameter const *parameters,
        void const *const *parameter_values, VdpVideoMixer *mixer)
 {
-    return check_for_exceptions(CreateImpl, device_id, feature_count, features, parameter_count,
-                                parameters, parameter_values, mixer);
+    return call_on_render_thread<vdp::Device::Resource>(device_id, CreateImpl, device_id,
+                                                        feature_count, features, parameter_count,
+                                                        parameters, parameter_values, mixer);
 }
 
 VdpStatus
@@ -230,7 +236,7 @@ DestroyImpl(VdpVideoMixer mixer_id)
 VdpStatus
 Destroy(VdpVideoMixer mixer_id)
 {
-    return check_for_exceptions(DestroyImpl, mixer_id);
+    return call_on_render_thread<Resource>(mixer_id, DestroyImpl, mixer_id);
 }
 
 VdpStatus
@@ -417,6 +423,28 @@ QueryParameterValueRange(VdpDevice device, VdpVideoMixerParameter parameter, voi
                                 max_value);
 }
 
+/// Checks handles and rectangles RenderImpl relies on, before the call is queued to the render
+/// thread. Surfaces can still be destroyed meanwhile, that's caught by RenderImpl itself.
+bool
+render_args_valid(Resource *mixer, VdpVideoSurface video_surface_current,
+                  VdpRect const *video_source_rect, VdpOutputSurface destination_surface,
+                  VdpRect const *destination_rect, VdpRect const *destination_video_rect)
+{
+    auto src_surf = ResourceStorage<vdp::VideoSurface::Resource>::instance().find(
+        video_surface_current);
+    auto dst_surf = ResourceStorage<vdp::OutputSurface::Resource>::instance().find(
+        destination_surface);
+
+    if (!src_surf || !dst_surf)
+        return false;
+
+    if (src_surf->device->id != mixer->device->id || dst_surf->device->id != mixer->device->id)
+        return false;
+
+    return rect_is_valid(video_source_rect) && rect_is_valid(destination_rect) &&
+           rect_is_valid(destination_video_rect);
+}
+
 VdpStatus
 RenderImpl(VdpVideoMixer mixer_id, VdpOutputSurface background_surface,
            VdpRect const *background_source_rect,
@@ -431,9 +459,19 @@ RenderImpl(VdpVideoMixer mixer_id, VdpOutputSurface background_surface,
     // TODO: current implementation ignores previous and future surfaces, using only current.
     // Is that acceptable for interlaced video? Will VAAPI handle deinterlacing?
 
-    std::ignore = background_surface;   // TODO: background_surface. Is it safe to just ignore it?
+    // TODO: background_surface. Is it safe to just ignore it?
     std::ignore = background_source_rect;
     std::ignore = current_picture_structure;
+
+    ResourceRefSet refs;
+    auto mixer =    refs.add<Resource>(mixer_id);
+    auto src_surf = refs.add<vdp::VideoSurface::Resource>(video_surface_current);
+    auto dst_surf = refs.add<vdp::OutputSurface::Resource>(destination_surface);
+
+    // Background, past, future and layer surfaces are not used for rendering yet, so they are
+    // not locked. Past and future ones may be written by the decoder meanwhile, and players
+    // often pass stale handles there.
+    std::ignore = background_surface;
     std::ignore = video_surface_past_count;
     std::ignore = video_surface_past;
     std::ignore = video_surface_future_count;
@@ -441,9 +479,7 @@ RenderImpl(VdpVideoMixer mixer_id, VdpOutputSurface background_surface,
     std::ignore = layer_count;
     std::ignore = layers;
 
-    ResourceRef<Resource> mixer{mixer_id};
-    ResourceRef<vdp::VideoSurface::Resource> src_surf{video_surface_current};
-    ResourceRef<vdp::OutputSurface::Resource> dst_surf{destination_surface};
+    refs.acquire();
 
     if (src_surf->device->id != dst_surf->device->id ||
         src_surf->device->id != mixer->device->id)
@@ -471,59 +507,49 @@ RenderImpl(VdpVideoMixer mixer_id, VdpOutputSurface background_surface,
 
     GLXThreadLocalContext guard{mixer->device};
 
+    dst_surf->fence.wait();
+    src_surf->fence.wait();
+
     if (src_surf->sync_va_to_glx) {
         render_va_surf_to_texture(mixer, src_surf);
         src_surf->sync_va_to_glx = false;
     }
 
-    glBindFramebuffer(GL_FRAMEBUFFER, dst_surf->fbo_id);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(0, dst_surf->width, 0, dst_surf->height, -1.0f, 1.0f);
-    glViewport(0, 0, dst_surf->width, dst_surf->height);
-    glDisable(GL_BLEND);
+    if (src_surf->sync_planes_to_glx) {
+        const VdpStatus status = vdp::VideoSurface::convert_staged_planes(src_surf);
+        if (status != VDP_STATUS_OK)
+            return status;
+    }
+
+    // surface may have never been written to
+    src_surf->allocate_rgba();
 
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    gl_state::bind_framebuffer(dst_surf->fbo_id);
+    gl_state::ortho(0, dst_surf->width, 0, dst_surf->height);
+    gl_state::viewport(0, 0, dst_surf->width, dst_surf->height);
+    gl_state::set_blend(false);
+    gl_state::texture_scale(1.0f/src_surf->width, 1.0f/src_surf->height);
 
-    glMatrixMode(GL_TEXTURE);
-    glLoadIdentity();
-    glScalef(1.0f/src_surf->width, 1.0f/src_surf->height, 1.0f);
+    QuadBatch batch;
 
     // Clear dstRect area
-    glDisable(GL_TEXTURE_2D);
-    glColor4f(0, 0, 0, 1);
-    glBegin(GL_QUADS);
-        glVertex2f(dstRect.x0, dstRect.y0);
-        glVertex2f(dstRect.x1, dstRect.y0);
-        glVertex2f(dstRect.x1, dstRect.y1);
-        glVertex2f(dstRect.x0, dstRect.y1);
-    glEnd();
+    gl_state::use_program(mixer->device->shaders[glsl_solid_color].program);
+    batch.add_rect(dstRect.x0, dstRect.y0, dstRect.x1, dstRect.y1, 0, 0, 0, 0,
+                   0.0f, 0.0f, 0.0f, 1.0f);
+    batch.draw();
 
     // Render (maybe scaled) data from video surface
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, src_surf->tex_id);
-    glColor4f(1, 1, 1, 1);
-    glBegin(GL_QUADS);
-        glTexCoord2i(srcVideoRect.x0, srcVideoRect.y0);
-        glVertex2f(dstVideoRect.x0, dstVideoRect.y0);
-
-        glTexCoord2i(srcVideoRect.x1, srcVideoRect.y0);
-        glVertex2f(dstVideoRect.x1, dstVideoRect.y0);
-
-        glTexCoord2i(srcVideoRect.x1, srcVideoRect.y1);
-        glVertex2f(dstVideoRect.x1, dstVideoRect.y1);
-
-        glTexCoord2i(srcVideoRect.x0, srcVideoRect.y1);
-        glVertex2f(dstVideoRect.x0, dstVideoRect.y1);
-    glEnd();
-    glFinish();
-
-    const auto gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        traceError("VideoMixer::RenderImpl(): gl error %d\n", gl_error);
+    gl_state::bind_texture(src_surf->tex_id);
+    gl_state::use_program(mixer->device->shaders[glsl_texture_color].program);
+    batch.add_rect(dstVideoRect.x0, dstVideoRect.y0, dstVideoRect.x1, dstVideoRect.y1,
+                   srcVideoRect.x0, srcVideoRect.y0, srcVideoRect.x1, srcVideoRect.y1);
+    batch.draw();
+
+    dst_surf->fence.set();
+    src_surf->fence.set();
+
+    if (gl_debug::check_error("VideoMixer::RenderImpl()"))
         return VDP_STATUS_ERROR;
-    }
 
     return VDP_STATUS_OK;
 }
@@ -538,12 +564,52 @@ Render(VdpVideoMixer mixer_id, VdpOutputSurface background_surface,
        VdpRect const *destination_rect, VdpRect const *destination_video_rect, uint32_t layer_count,
        VdpLayer const *layers)
 {
-    return check_for_exceptions(RenderImpl, mixer_id, background_surface, background_source_rect,
-                                current_picture_structure, video_surface_past_count,
-                                video_surface_past, video_surface_current,
-                                video_surface_future_count, video_surface_future, video_source_rect,
-                                destination_surface, destination_rect, destination_video_rect,
-                                layer_count, layers);
+    auto mixer = find_with_render_thread<Resource>(mixer_id);
+    if (!mixer || !render_args_valid(mixer.get(), video_surface_current, video_source_rect,
+                                     destination_surface, destination_rect,
+                                     destination_video_rect))
+    {
+        // errors are reported by the synchronous path, since a queued call can't return them
+        return call_on_render_thread<Resource>(mixer_id, RenderImpl, mixer_id, background_surface,
+                                               background_source_rect, current_picture_structure,
+                                               video_surface_past_count, video_surface_past,
+                                               video_surface_current, video_surface_future_count,
+                                               video_surface_future, video_source_rect,
+                                               destination_surface, destination_rect,
+                                               destination_video_rect, layer_count, layers);
+    }
+
+    // copy everything passed by pointer, so the call can return before mixing happens
+    auto data = std::make_shared<DeferredData>();
+    const auto bg_rect =    data->copy(background_source_rect);
+    const auto past =       data->copy(video_surface_past, video_surface_past_count);
+    const auto future =     data->copy(video_surface_future, video_surface_future_count);
+    const auto src_rect =   data->copy(video_source_rect);
+    const auto dst_rect =   data->copy(destination_rect);
+    const auto video_rect = data->copy(destination_video_rect);
+
+    std::vector<VdpLayer> layers_copy(layers ? layer_count : 0);
+    for (uint32_t k = 0; k < layers_copy.size(); k ++) {
+        layers_copy[k] = layers[k];
+        layers_copy[k].source_rect = data->copy(layers[k].source_rect);
+        layers_copy[k].destination_rect = data->copy(layers[k].destination_rect);
+    }
+    const auto layers_ptr = data->copy(layers_copy.data(), layers_copy.size());
+
+    post_call(render_thread_of(mixer.get()), "VideoMixer::Render",
+              [data, mixer_id, background_surface, bg_rect, current_picture_structure,
+               video_surface_past_count, past, video_surface_current,
+               video_surface_future_count, future, src_rect, destination_surface, dst_rect,
+               video_rect, layer_count, layers_ptr] () {
+                  return check_for_exceptions(RenderImpl, mixer_id, background_surface, bg_rect,
+                                              current_picture_structure,
+                                              video_surface_past_count, past,
+                                              video_surface_current, video_surface_future_count,
+                                              future, src_rect, destination_surface, dst_rect,
+                                              video_rect, layer_count, layers_ptr);
+              });
+
+    return VDP_STATUS_OK;
 }
 
 VdpStatus
@@ -25,6 +25,7 @@
 #pragma once
 
 #include "api.hh"
+#include "gl-fence.hh"
 #include <memory>
 
 
@@ -32,7 +33,7 @@ namespace vdp { namespace VideoMixer {
 
 struct Resource: public vdp::GenericResource
 {
-    Resource(std::shared_ptr<vdp::Device::Resource> a_device, uint32_t a_feature_count,
+    Resource(ResourcePtr<vdp::Device::Resource> a_device, uint32_t a_feature_count,
              VdpVideoMixerFeature const *a_features, uint32_t a_parameter_count,
              VdpVideoMixerParameter const *a_parameters, void const *const *a_parameter_values);
 
@@ -46,6 +47,7 @@ struct Resource: public vdp::GenericResource
     Pixmap          pixmap;             ///< target pixmap for vaPutSurface
     GLXPixmap       glx_pixmap;         ///< associated glx pixmap for texture-from-pixmap
     GLuint          tex_id;             ///< texture for texture-from-pixmap
+    vdp::GLFence    pixmap_fence;       ///< completion of the last read from pixmap
 };
 
 VdpVideoMixerQueryFeatureSupport        QueryFeatureSupport;
@@ -25,26 +25,458 @@
 #define GL_GLEXT_PROTOTYPES
 #include "api-video-surface.hh"
 #include "api.hh"
+#include "chroma-deinterleave.hh"
 #include "compat.hh"
+#include "gl-debug.hh"
+#include "gl-state.hh"
 #include "glx-context.hh"
 #include "handle-storage.hh"
+#include "plane-texture.hh"
+#include "quad-batch.hh"
 #include "reverse-constant.hh"
 #include "shaders.h"
 #include "trace.hh"
 #include <GL/gl.h>
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <stdlib.h>
 #include <string.h>
 #include <va/va.h>
 #include <vdpau/vdpau.h>
+#include <vector>
 
 
-using std::make_shared;
-using std::shared_ptr;
 
 
 namespace vdp { namespace VideoSurface {
 
-Resource::Resource(std::shared_ptr<vdp::Device::Resource> a_device, VdpChromaType a_chroma_type,
+namespace {
+
+/// width of RGBA texture which holds rows of packed format, or zero for planar formats
+uint32_t
+packed_texture_width(VdpYCbCrFormat format, uint32_t width)
+{
+    switch (format) {
+    case VDP_YCBCR_FORMAT_UYVY:
+    case VDP_YCBCR_FORMAT_YUYV:
+        return (width + 1) / 2;     // two pixels per texel
+
+    case VDP_YCBCR_FORMAT_Y8U8V8A8:
+    case VDP_YCBCR_FORMAT_V8U8Y8A8:
+        return width;
+
+    default:
+        return 0;
+    }
+}
+
+bool
+is_put_format(VdpYCbCrFormat format)
+{
+    return format <= VDP_YCBCR_FORMAT_V8U8Y8A8;
+}
+
+/// planes of a PutBitsYCbCr call, staged on the caller's thread
+struct StagedPlanes {
+    std::vector<uint8_t>    y;
+    std::vector<uint8_t>    u;
+    std::vector<uint8_t>    v;
+};
+
+void
+copy_plane(std::vector<uint8_t> &dst, const void *src, uint32_t pitch, uint32_t rows,
+           size_t row_bytes)
+{
+    dst.resize(rows * row_bytes);
+
+    if (pitch == row_bytes) {
+        memcpy(dst.data(), src, dst.size());
+        return;
+    }
+
+    for (uint32_t k = 0; k < rows; k ++)
+        memcpy(&dst[k * row_bytes], static_cast<const uint8_t *>(src) + k * pitch, row_bytes);
+}
+
+/// copies source planes into staging buffers with tightly packed rows. NV12 chroma goes to
+/// `u` interleaved, packed formats use `y` only.
+void
+stage_planes(const Resource &surf, VdpYCbCrFormat format, void const *const *source_data,
+             uint32_t const *source_pitches, std::vector<uint8_t> &y, std::vector<uint8_t> &u,
+             std::vector<uint8_t> &v)
+{
+    const uint32_t packed_width = packed_texture_width(format, surf.width);
+
+    if (packed_width > 0) {
+        copy_plane(y, source_data[0], source_pitches[0], surf.height, 4 * packed_width);
+        u.clear();
+        v.clear();
+        return;
+    }
+
+    copy_plane(y, source_data[0], source_pitches[0], surf.height, surf.width);
+
+    if (format == VDP_YCBCR_FORMAT_NV12) {
+        copy_plane(u, source_data[1], source_pitches[1], surf.chroma_height,
+                   2 * surf.chroma_width);
+        v.clear();
+    } else {
+        // YV12 has V plane before U one
+        copy_plane(u, source_data[2], source_pitches[2], surf.chroma_height, surf.chroma_width);
+        copy_plane(v, source_data[1], source_pitches[1], surf.chroma_height, surf.chroma_width);
+    }
+}
+
+/// copies tightly packed rows of `src` to `dst` with rows `pitch` bytes apart
+void
+put_plane(void *dst, uint32_t pitch, const std::vector<uint8_t> &src, uint32_t rows,
+          size_t row_bytes)
+{
+    if (pitch == row_bytes) {
+        memcpy(dst, src.data(), rows * row_bytes);
+        return;
+    }
+
+    for (uint32_t k = 0; k < rows; k ++)
+        memcpy(static_cast<uint8_t *>(dst) + k * pitch, &src[k * row_bytes], row_bytes);
+}
+
+/// Copies staged planes out in `format`, if that doesn't need color conversion: either it's the
+/// staged format, or both are planar and differ in chroma layout only. Returns false otherwise.
+bool
+unstage_planes(const Resource &surf, VdpYCbCrFormat format, void *const *destination_data,
+               uint32_t const *destination_pitches)
+{
+    const VdpYCbCrFormat staged = surf.staged_format;
+    const uint32_t packed_width = packed_texture_width(staged, surf.width);
+
+    if (format != staged &&
+        (packed_width > 0 || packed_texture_width(format, surf.width) > 0))
+    {
+        return false;
+    }
+
+    if (packed_width > 0) {
+        put_plane(destination_data[0], destination_pitches[0], surf.y_plane, surf.height,
+                  4 * packed_width);
+        return true;
+    }
+
+    put_plane(destination_data[0], destination_pitches[0], surf.y_plane, surf.height,
+              surf.width);
+
+    const uint32_t chroma_width = surf.chroma_width;
+    const uint32_t chroma_height = surf.chroma_height;
+
+    // YV12 has V plane before U one
+    if (staged == VDP_YCBCR_FORMAT_NV12 && format == VDP_YCBCR_FORMAT_NV12) {
+        put_plane(destination_data[1], destination_pitches[1], surf.u_plane, chroma_height,
+                  2 * chroma_width);
+
+    } else if (staged == VDP_YCBCR_FORMAT_YV12 && format == VDP_YCBCR_FORMAT_YV12) {
+        put_plane(destination_data[1], destination_pitches[1], surf.v_plane, chroma_height,
+                  chroma_width);
+        put_plane(destination_data[2], destination_pitches[2], surf.u_plane, chroma_height,
+                  chroma_width);
+
+    } else if (staged == VDP_YCBCR_FORMAT_NV12) {
+        vdp::chroma::deinterleave(surf.u_plane.data(), 2 * chroma_width,
+                                  static_cast<uint8_t *>(destination_data[2]),
+                                  destination_pitches[2],
+                                  static_cast<uint8_t *>(destination_data[1]),
+                                  destination_pitches[1], chroma_width, chroma_height);
+
+    } else {
+        for (uint32_t y = 0; y < chroma_height; y ++) {
+            const uint8_t *src_u = &surf.u_plane[y * chroma_width];
+            const uint8_t *src_v = &surf.v_plane[y * chroma_width];
+            uint8_t *dst = static_cast<uint8_t *>(destination_data[1]) +
+                           y * destination_pitches[1];
+
+            for (uint32_t x = 0; x < chroma_width; x ++) {
+                dst[2 * x] = src_u[x];
+                dst[2 * x + 1] = src_v[x];
+            }
+        }
+    }
+
+    return true;
+}
+
+// Handles of video surfaces with RGBA storage, least recently used first. Eviction only
+// drops the GL copy, content is converted again from VA-API or staged planes on next use. All
+// devices share one GL share group, so storage of any of them can be released from any context.
+std::mutex                      g_resident_mtx;
+std::list<uint32_t>             g_resident;
+
+size_t
+rgba_size(const Resource *surf)
+{
+    return static_cast<size_t>(surf->width) * surf->height * 4;
+}
+
+/// adds surface to the end of the list, or moves it there. Surface must be locked.
+void
+mark_resident(Resource *surf)
+{
+    std::unique_lock<std::mutex> lock{g_resident_mtx};
+
+    if (surf->resident) {
+        g_resident.splice(g_resident.end(), g_resident, surf->resident_pos);
+        return;
+    }
+
+    surf->resident_pos = g_resident.insert(g_resident.end(), surf->id);
+    surf->resident = true;
+}
+
+/// removes surface from the list. Surface must be locked.
+void
+forget_resident(Resource *surf)
+{
+    std::unique_lock<std::mutex> lock{g_resident_mtx};
+
+    if (!surf->resident)
+        return;
+
+    g_resident.erase(surf->resident_pos);
+    surf->resident = false;
+}
+
+/// Releases storage of least recently used surfaces other than `keep`, at least `amount` bytes
+/// of it if there is that much. Surfaces which are locked by other threads are skipped, so the
+/// call never blocks on resource locks. Returns false if nothing was released.
+bool
+release_idle_surfaces(uint32_t keep, size_t amount)
+{
+    std::vector<uint32_t> candidates;
+
+    {
+        std::unique_lock<std::mutex> lock{g_resident_mtx};
+        for (const auto handle: g_resident) {
+            if (handle != keep)
+                candidates.push_back(handle);
+        }
+    }
+
+    // victims are unlocked outside of the list mutex, since that may destroy them
+    size_t released = 0;
+    for (const auto handle: candidates) {
+        if (released >= amount)
+            break;
+
+        Resource *victim = ResourceStorage<Resource>::instance().try_lock(handle);
+        if (!victim)
+            continue;
+
+        if (victim->tex_id != 0) {
+            released += rgba_size(victim);
+            victim->release_rgba();
+        }
+
+        unlock_resource(victim);
+    }
+
+    return released > 0;
+}
+
+/// Packs NV12 image of `width`x`height` pixels into `format`, one of packed formats
+/// PutBitsYCbCr accepts. Each chroma sample is repeated for all pixels it covers. If width is
+/// odd, the second half of the last UYVY or YUYV pair repeats the last pixel.
+void
+pack_nv12(const uint8_t *src_y, uint32_t pitch_y, const uint8_t *src_uv, uint32_t pitch_uv,
+          VdpYCbCrFormat format, uint8_t *dst, uint32_t pitch, uint32_t width, uint32_t height)
+{
+    for (uint32_t y = 0; y < height; y ++) {
+        const uint8_t *luma = src_y + static_cast<size_t>(y) * pitch_y;
+        const uint8_t *chroma = src_uv + static_cast<size_t>(y / 2) * pitch_uv;
+        uint8_t *row = dst + static_cast<size_t>(y) * pitch;
+
+        for (uint32_t x = 0; x < width; x += 2) {
+            const uint8_t y_0 = luma[x];
+            const uint8_t y_1 = (x + 1 < width) ? luma[x + 1] : y_0;
+            const uint8_t u = chroma[x];
+            const uint8_t v = chroma[x + 1];
+            uint32_t words[2];
+
+            switch (format) {
+            case VDP_YCBCR_FORMAT_UYVY:
+                row[2 * x + 0] = u;
+                row[2 * x + 1] = y_0;
+                row[2 * x + 2] = v;
+                row[2 * x + 3] = y_1;
+                break;
+
+            case VDP_YCBCR_FORMAT_YUYV:
+                row[2 * x + 0] = y_0;
+                row[2 * x + 1] = u;
+                row[2 * x + 2] = y_1;
+                row[2 * x + 3] = v;
+                break;
+
+            case VDP_YCBCR_FORMAT_Y8U8V8A8:
+                // components are defined by bit positions in 32-bit words
+                words[0] = (0xffu << 24) | (v << 16) | (u << 8) | y_0;
+                words[1] = (0xffu << 24) | (v << 16) | (u << 8) | y_1;
+                memcpy(row + 4 * x, words, (x + 1 < width) ? 8 : 4);
+                break;
+
+            case VDP_YCBCR_FORMAT_V8U8Y8A8:
+                words[0] = (0xffu << 24) | (y_0 << 16) | (u << 8) | v;
+                words[1] = (0xffu << 24) | (y_1 << 16) | (u << 8) | v;
+                memcpy(row + 4 * x, words, (x + 1 < width) ? 8 : 4);
+                break;
+
+            default:
+                return;
+            }
+        }
+    }
+}
+
+/// renders surface content through `shader` into `target`, which gets `width`x`height` texels
+/// of `internal_format`. Texture coordinates span (0, 0) to (`s1`, `t1`). Leaves framebuffer
+/// of plane textures bound, for reading.
+bool
+render_plane(Resource *surf, vdp::PlaneTexture &target, GLenum internal_format, uint32_t width,
+             uint32_t height, GLfloat s1, GLfloat t1, int shader)
+{
+    gl_state::active_texture(GL_TEXTURE0);
+    target.allocate(internal_format, width, height);
+
+    if (surf->plane_fbo == 0)
+        glGenFramebuffers(1, &surf->plane_fbo);
+
+    gl_state::bind_framebuffer(surf->plane_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.id(), 0);
+
+    const auto gl_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (gl_status != GL_FRAMEBUFFER_COMPLETE) {
+        traceError("VideoSurface::render_plane(): framebuffer not ready, %d\n", gl_status);
+        return false;
+    }
+
+    gl_state::bind_texture(surf->tex_id);
+    gl_state::ortho(0, width, 0, height);
+    gl_state::viewport(0, 0, width, height);
+    gl_state::use_program(surf->device->shaders[shader].program);
+
+    QuadBatch batch;
+    batch.add_rect(0, 0, width, height, 0, 0, s1, t1);
+    batch.draw();
+
+    return true;
+}
+
+/// Converts RGBA content of the surface back to any of formats PutBitsYCbCr accepts, and reads
+/// it out. Conversion is done in shaders, so only planes of YCbCr size are transferred.
+VdpStatus
+read_back_rgba(Resource *surf, VdpYCbCrFormat format, void *const *destination_data,
+               uint32_t const *destination_pitches)
+{
+    GLXThreadLocalContext guard{surf->device};
+
+    surf->fence.wait();
+    surf->allocate_rgba();
+
+    const uint32_t width = surf->width;
+    const uint32_t height = surf->height;
+    const uint32_t chroma_width = surf->chroma_width;
+    const uint32_t chroma_height = surf->chroma_height;
+    const uint32_t sub_x = (surf->chroma_type == VDP_CHROMA_TYPE_444) ? 1 : 2;
+    const uint32_t sub_y = (surf->chroma_type == VDP_CHROMA_TYPE_420) ? 2 : 1;
+
+    gl_state::set_blend(false);
+    gl_state::active_texture(GL_TEXTURE0);
+    gl_state::texture_scale(1.0f, 1.0f);
+
+    vdp::PlaneReadback readback;
+    const uint32_t packed_width = packed_texture_width(format, width);
+
+    if (packed_width > 0) {
+        // Each UYVY or YUYV texel covers two pixels. If width is odd, the second half of the
+        // last texel repeats the last pixel. Words are read in the layout PutBitsYCbCr uploads.
+        const GLfloat s_pair = static_cast<GLfloat>(2 * packed_width) / width;
+        int shader = glsl_RGBA_Y8U8V8A8;
+        GLenum type = GL_UNSIGNED_INT_8_8_8_8_REV;
+        GLfloat s1 = 1.0f;
+
+        switch (format) {
+        case VDP_YCBCR_FORMAT_UYVY:
+            shader = glsl_RGBA_UYVY;
+            type = GL_UNSIGNED_BYTE;
+            s1 = s_pair;
+            break;
+        case VDP_YCBCR_FORMAT_YUYV:
+            shader = glsl_RGBA_YUYV;
+            type = GL_UNSIGNED_BYTE;
+            s1 = s_pair;
+            break;
+        case VDP_YCBCR_FORMAT_V8U8Y8A8:
+            shader = glsl_RGBA_V8U8Y8A8;
+            break;
+        default:
+            break;
+        }
+
+        if (!render_plane(surf, surf->plane_tex[0], GL_RGBA8, packed_width, height, s1, 1.0f,
+                          shader))
+        {
+            return VDP_STATUS_ERROR;
+        }
+
+        readback.read(0, 0, packed_width, height, GL_RGBA, destination_data[0],
+                      destination_pitches[0], type);
+        readback.finish();
+
+        if (gl_debug::check_error("VideoSurface::read_back_rgba()"))
+            return VDP_STATUS_ERROR;
+
+        return VDP_STATUS_OK;
+    }
+
+    if (!render_plane(surf, surf->plane_tex[0], GL_R8, width, height, 1.0f, 1.0f,
+                      glsl_RGBA_Y))
+    {
+        return VDP_STATUS_ERROR;
+    }
+
+    readback.read(0, 0, width, height, GL_RED, destination_data[0], destination_pitches[0]);
+
+    // Each chroma sample is centered between the luma ones it covers, so linear filtering of
+    // the surface texture averages them. If luma size is odd, the last chroma column or row
+    // gets clamped.
+    if (!render_plane(surf, surf->plane_tex[1], GL_RG8, chroma_width, chroma_height,
+                      static_cast<GLfloat>(sub_x * chroma_width) / width,
+                      static_cast<GLfloat>(sub_y * chroma_height) / height, glsl_RGBA_UV))
+    {
+        readback.finish();
+        return VDP_STATUS_ERROR;
+    }
+
+    if (format == VDP_YCBCR_FORMAT_NV12) {
+        readback.read(0, 0, chroma_width, chroma_height, GL_RG, destination_data[1],
+                      destination_pitches[1]);
+    } else {
+        readback.read(0, 0, chroma_width, chroma_height, GL_GREEN, destination_data[1],
+                      destination_pitches[1]);
+        readback.read(0, 0, chroma_width, chroma_height, GL_RED, destination_data[2],
+                      destination_pitches[2]);
+    }
+
+    readback.finish();
+
+    if (gl_debug::check_error("VideoSurface::read_back_rgba()"))
+        return VDP_STATUS_ERROR;
+
+    return VDP_STATUS_OK;
+}
+
+} // anonymous namespace
+
+Resource::Resource(ResourcePtr<vdp::Device::Resource> a_device, VdpChromaType a_chroma_type,
                    uint32_t a_width, uint32_t a_height)
     : chroma_type{a_chroma_type}
     , width{a_width}
@@ -82,65 +514,133 @@ Resource::Resource(std::shared_ptr<vdp::Device::Resource> a_device, VdpChromaTyp
 
     chroma_stride = (chroma_width + 0xfu) & (~0xfu);
 
-    va_surf =        VA_INVALID_SURFACE;
-    tex_id =         0;
-    sync_va_to_glx = false;
+    va_surf =            VA_INVALID_SURFACE;
+    tex_id =             0;
+    fbo_id =             0;
+    plane_fbo =          0;
+    resident =           false;
+    sync_va_to_glx =     false;
+    sync_planes_to_glx = false;
+    planes_staged =      false;
+    staged_format =      VDP_YCBCR_FORMAT_NV12;
+
+    // No GL storage here, it's allocated on first use. Also no VA surface creation. Actual
+    // pool of VA surfaces should be allocated already by VdpDecoderCreate. VdpDecoderCreate
+    // will update ->va_surf field as needed.
+}
+
+Resource::~Resource()
+{
+    try {
+        {
+            GLXThreadLocalContext guard{device};
 
-    GLXThreadLocalContext guard{device};
+            fence.release();
+            release_rgba();
+
+            gl_debug::check_error("VideoSurface::Resource::~Resource()");
+        }
+
+        if (device->va_available) {
+            // return VA surface to the free list, decoder owns them
+            if (decoder)
+                decoder->free_list.push_back(rt_idx);
+        }
+
+    } catch (...) {
+        traceError("VideoSurface::Resource::~Resource(): caught exception\n");
+    }
+}
+
+void
+Resource::allocate_rgba()
+{
+    const size_t size = rgba_size(this);
+
+    if (tex_id != 0) {
+        mark_resident(this);
+        return;
+    }
 
     glGenTextures(1, &tex_id);
-    glBindTexture(GL_TEXTURE_2D, tex_id);
+    gl_state::bind_texture(tex_id);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+    const auto alloc = [this] () {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_BGRA, GL_UNSIGNED_BYTE,
+                     nullptr);
+    };
+
+    const char *where = "VideoSurface::Resource::allocate_rgba()";
+    auto status = gl_debug::checked_allocation(where, alloc);
+
+    // Storage is only evicted under real memory pressure. Each round releases twice as much
+    // of least recently used storage, until the texture fits or nothing idle is left.
+    size_t amount = size;
+    while (status == gl_debug::AllocationStatus::kOutOfMemory &&
+           release_idle_surfaces(id, amount))
+    {
+        status = gl_debug::checked_allocation(where, alloc);
+        amount *= 2;
+    }
 
-    glGenFramebuffers(1, &fbo_id);
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo_id);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex_id, 0);
+    if (status != gl_debug::AllocationStatus::kOk) {
+        traceError("VideoSurface::Resource::allocate_rgba(): can't allocate %ux%u texture\n",
+                   width, height);
+        gl_state::delete_textures(1, &tex_id);
+        tex_id = 0;
+
+        if (status == gl_debug::AllocationStatus::kOutOfMemory)
+            throw std::bad_alloc();
 
-    const auto gl_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if (gl_status != GL_FRAMEBUFFER_COMPLETE) {
-        traceError("VideoSurface::Resource::Resource(): framebuffer not ready, %d\n", gl_status);
         throw vdp::generic_error();
     }
 
-    glFinish();
+    glGenFramebuffers(1, &fbo_id);
+    gl_state::bind_framebuffer(fbo_id);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex_id, 0);
 
-    const auto gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        traceError("VideoSurface::Resource::Resource(): gl error %d\n", gl_error);
+    const auto gl_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (gl_status != GL_FRAMEBUFFER_COMPLETE) {
+        traceError("VideoSurface::Resource::allocate_rgba(): framebuffer not ready, %d\n",
+                   gl_status);
+        gl_state::delete_textures(1, &tex_id);
+        gl_state::delete_framebuffers(1, &fbo_id);
+        tex_id = 0;
+        fbo_id = 0;
         throw vdp::generic_error();
     }
 
-    // no VA surface creation here. Actual pool of VA surfaces should be allocated already
-    // by VdpDecoderCreate. VdpDecoderCreate will update ->va_surf field as needed.
+    mark_resident(this);
 }
 
-Resource::~Resource()
+void
+Resource::release_rgba()
 {
-    try {
-        {
-            GLXThreadLocalContext guard{device};
+    plane_tex[0].release();
+    plane_tex[1].release();
 
-            glDeleteTextures(1, &tex_id);
-            glDeleteFramebuffers(1, &fbo_id);
+    if (plane_fbo != 0) {
+        gl_state::delete_framebuffers(1, &plane_fbo);
+        plane_fbo = 0;
+    }
 
-            const auto gl_error = glGetError();
-            if (gl_error != GL_NO_ERROR)
-                traceError("VideoSurface::Resource::~Resource(): gl error %d\n", gl_error);
-        }
+    if (tex_id == 0)
+        return;
 
-        if (device->va_available) {
-            // return VA surface to the free list, decoder owns them
-            if (decoder)
-                decoder->free_list.push_back(rt_idx);
-        }
+    gl_state::delete_textures(1, &tex_id);
+    gl_state::delete_framebuffers(1, &fbo_id);
+    tex_id = 0;
+    fbo_id = 0;
+    forget_resident(this);
 
-    } catch (...) {
-        traceError("VideoSurface::Resource::~Resource(): caught exception\n");
-    }
+    // content gets converted again on next use
+    if (planes_staged)
+        sync_planes_to_glx = true;
+    else if (va_surf != VA_INVALID_SURFACE)
+        sync_va_to_glx = true;
 }
 
 VdpStatus
@@ -152,7 +652,7 @@ CreateImpl(VdpDevice device_id, VdpChromaType chroma_type, uint32_t width, uint3
 
     ResourceRef<vdp::Device::Resource> device{device_id};
 
-    auto data = make_shared<Resource>(device, chroma_type, width, height);
+    auto data = make_resource<Resource>(device, chroma_type, width, height);
 
     *surface = ResourceStorage<Resource>::instance().insert(data);
     return VDP_STATUS_OK;
@@ -162,7 +662,8 @@ VdpStatus
 Create(VdpDevice device_id, VdpChromaType chroma_type, uint32_t width, uint32_t height,
        VdpVideoSurface *surface)
 {
-    return check_for_exceptions(CreateImpl, device_id, chroma_type, width, height, surface);
+    return call_on_render_thread<vdp::Device::Resource>(device_id, CreateImpl, device_id,
+                                                        chroma_type, width, height, surface);
 }
 
 VdpStatus
@@ -177,7 +678,7 @@ DestroyImpl(VdpVideoSurface surface_id)
 VdpStatus
 Destroy(VdpVideoSurface surface_id)
 {
-    return check_for_exceptions(DestroyImpl, surface_id);
+    return call_on_render_thread<Resource>(surface_id, DestroyImpl, surface_id);
 }
 
 VdpStatus
@@ -190,7 +691,36 @@ GetBitsYCbCrImpl(VdpVideoSurface surface_id, VdpYCbCrFormat destination_ycbcr_fo
     ResourceRef<Resource> surf{surface_id};
     VADisplay va_dpy = surf->device->va_dpy;
 
-    if (surf->device->va_available) {
+    if (!surf->device->va_available || surf->planes_staged) {
+        // VA-API surface either doesn't exist or doesn't hold current content
+        if (!is_put_format(destination_ycbcr_format)) {
+            traceError("VideoSurface::GetBitsYCbCrImpl(): not implemented readback to %s\n",
+                       reverse_ycbcr_format(destination_ycbcr_format));
+            return VDP_STATUS_INVALID_Y_CB_CR_FORMAT;
+        }
+
+        // bits that were put are returned as is, whenever possible
+        if (surf->planes_staged &&
+            unstage_planes(*surf.get(), destination_ycbcr_format, destination_data,
+                           destination_pitches))
+        {
+            return VDP_STATUS_OK;
+        }
+
+        if (surf->sync_planes_to_glx) {
+            GLXThreadLocalContext guard{surf->device};
+
+            const VdpStatus status = convert_staged_planes(surf.get());
+            if (status != VDP_STATUS_OK)
+                return status;
+        }
+
+        return read_back_rgba(surf.get(), destination_ycbcr_format, destination_data,
+                              destination_pitches);
+    }
+
+    {
+        std::unique_lock<decltype(surf->device->va_mtx)> va_lock{surf->device->va_mtx};
         VAImage q;
         vaDeriveImage(va_dpy, surf->va_surf, &q);
         if (q.format.fourcc == VA_FOURCC('N', 'V', '1', '2') &&
@@ -241,19 +771,25 @@ GetBitsYCbCrImpl(VdpVideoSurface surface_id, VdpYCbCrFormat destination_ycbcr_fo
                 }
             }
 
-            // unpack mixed UV to separate planes
-            for (unsigned int y = 0; y < q.height/2; y ++) {
-                uint8_t *src = img_data + q.offsets[1] + y * q.pitches[1];
-                uint8_t *dst_u = static_cast<uint8_t *>(destination_data[1]) +
-                                 y * destination_pitches[1];
-                uint8_t *dst_v = static_cast<uint8_t *>(destination_data[2]) +
-                                 y * destination_pitches[2];
-
-                for (unsigned int x = 0; x < q.width/2; x++) {
-                    *dst_v++ = *src++;
-                    *dst_u++ = *src++;
-                }
-            }
+            // unpack mixed UV to separate planes, U goes to the last one
+            vdp::chroma::deinterleave(img_data + q.offsets[1], q.pitches[1],
+                                      static_cast<uint8_t *>(destination_data[2]),
+                                      destination_pitches[2],
+                                      static_cast<uint8_t *>(destination_data[1]),
+                                      destination_pitches[1], q.width / 2, q.height / 2);
+
+            vaUnmapBuffer(va_dpy, q.buf);
+        } else if (q.format.fourcc == VA_FOURCC('N', 'V', '1', '2') &&
+                   packed_texture_width(destination_ycbcr_format, surf->width) > 0)
+        {
+            uint8_t *img_data;
+            vaMapBuffer(va_dpy, q.buf, (void **)&img_data);
+
+            pack_nv12(img_data + q.offsets[0], q.pitches[0], img_data + q.offsets[1],
+                      q.pitches[1], destination_ycbcr_format,
+                      static_cast<uint8_t *>(destination_data[0]), destination_pitches[0],
+                      std::min<uint32_t>(surf->width, q.width),
+                      std::min<uint32_t>(surf->height, q.height));
 
             vaUnmapBuffer(va_dpy, q.buf);
         } else {
@@ -266,10 +802,6 @@ GetBitsYCbCrImpl(VdpVideoSurface surface_id, VdpYCbCrFormat destination_ycbcr_fo
         }
 
         vaDestroyImage(va_dpy, q.image_id);
-    } else {
-        // software fallback
-        traceError("VideoSurface::GetBitsYCbCrImpl(): not implemented software fallback\n");
-        return VDP_STATUS_ERROR;
     }
 
     return VDP_STATUS_OK;
@@ -279,15 +811,17 @@ VdpStatus
 GetBitsYCbCr(VdpVideoSurface surface_id, VdpYCbCrFormat destination_ycbcr_format,
              void *const *destination_data, uint32_t const *destination_pitches)
 {
-    return check_for_exceptions(GetBitsYCbCrImpl, surface_id, destination_ycbcr_format,
-                                destination_data, destination_pitches);
+    return call_on_render_thread<Resource>(surface_id, GetBitsYCbCrImpl, surface_id,
+                                           destination_ycbcr_format, destination_data,
+                                           destination_pitches);
 }
 
 VdpStatus
 GetParametersImpl(VdpVideoSurface surface_id, VdpChromaType *chroma_type, uint32_t *width,
                   uint32_t *height)
 {
-    ResourceRef<Resource> surf{surface_id};
+    // all parameters are immutable, no need to lock
+    SharedResourceRef<Resource> surf{surface_id};
 
     if (chroma_type)
         *chroma_type = surf->chroma_type;
@@ -309,144 +843,122 @@ GetParameters(VdpVideoSurface surface_id, VdpChromaType *chroma_type, uint32_t *
 }
 
 VdpStatus
-PutBitsYCbCr_swscale(VdpVideoSurface surface_id, VdpYCbCrFormat source_ycbcr_format,
-                     void const *const *source_data, uint32_t const *source_pitches)
-{
-    // TODO: implement this
-    return VDP_STATUS_OK;
-}
-
-VdpStatus
-PutBitsYCbCr_glsl(VdpVideoSurface surface_id, VdpYCbCrFormat source_ycbcr_format,
-                  void const *const *source_data, uint32_t const *source_pitches)
+convert_staged_planes(Resource *surf)
 {
-    if (!source_data || !source_pitches)
-        return VDP_STATUS_INVALID_POINTER;
-
-    // TODO: implement VDP_YCBCR_FORMAT_UYVY
-    // TODO: implement VDP_YCBCR_FORMAT_YUYV
-    // TODO: implement VDP_YCBCR_FORMAT_Y8U8V8A8
-    // TODO: implement VDP_YCBCR_FORMAT_V8U8Y8A8
+    const VdpYCbCrFormat format = surf->staged_format;
 
-    ResourceRef<Resource> surf{surface_id};
-
-    switch (source_ycbcr_format) {
+    int shader;
+    switch (format) {
     case VDP_YCBCR_FORMAT_NV12:
+        shader = glsl_NV12_RGBA;
+        break;
     case VDP_YCBCR_FORMAT_YV12:
-        /* do nothing */
+        shader = glsl_YV12_RGBA;
         break;
     case VDP_YCBCR_FORMAT_UYVY:
+        shader = glsl_UYVY_RGBA;
+        break;
     case VDP_YCBCR_FORMAT_YUYV:
+        shader = glsl_YUYV_RGBA;
+        break;
     case VDP_YCBCR_FORMAT_Y8U8V8A8:
+        shader = glsl_Y8U8V8A8_RGBA;
+        break;
     case VDP_YCBCR_FORMAT_V8U8Y8A8:
+        shader = glsl_V8U8Y8A8_RGBA;
+        break;
     default:
-        traceError("VideoSurface::PutBitsYCbCr_glsl(): not implemented source YCbCr format '%s'\n",
-                   reverse_ycbcr_format(source_ycbcr_format));
+        // PutBitsYCbCr doesn't stage anything else
         return VDP_STATUS_INVALID_Y_CB_CR_FORMAT;
     }
 
-    GLXThreadLocalContext guard{surf->device};
-
-    glBindFramebuffer(GL_FRAMEBUFFER, surf->fbo_id);
+    surf->fence.wait();
+    surf->allocate_rgba();
+    gl_state::bind_framebuffer(surf->fbo_id);
 
-    GLuint tex_id[2];
-    glGenTextures(2, tex_id);
-    glEnable(GL_TEXTURE_2D);
+    const uint32_t width = surf->width;
+    const uint32_t height = surf->height;
+    const uint32_t chroma_width = surf->chroma_width;
+    const uint32_t chroma_height = surf->chroma_height;
+    const uint32_t packed_width = packed_texture_width(format, width);
+    GLfloat s1 = 1.0f;
 
-    switch (source_ycbcr_format) {
+    // staged rows are tightly packed
+    switch (format) {
     case VDP_YCBCR_FORMAT_NV12:
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, tex_id[1]);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
         // UV plane
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, source_pitches[1]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surf->width/2, surf->height/2, 0,
-                     GL_RG, GL_UNSIGNED_BYTE, source_data[1]);
-
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, tex_id[0]);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        // Y plane
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, source_pitches[0]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surf->width, surf->height, 0, GL_RED,
-                     GL_UNSIGNED_BYTE, source_data[0]);
+        gl_state::active_texture(GL_TEXTURE1);
+        surf->plane_tex[1].allocate(GL_RG8, chroma_width, chroma_height);
+        surf->plane_tex[1].upload(0, 0, chroma_width, chroma_height, GL_RG,
+                                  surf->u_plane.data(), 2 * chroma_width);
         break;
 
     case VDP_YCBCR_FORMAT_YV12:
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, tex_id[1]);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surf->width/2, surf->height, 0,
-                     GL_RED, GL_UNSIGNED_BYTE, NULL);
-        // U plane
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, source_pitches[2]);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, surf->width/2, surf->height/2, GL_RED,
-                        GL_UNSIGNED_BYTE, source_data[2]);
-        // V plane
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, source_pitches[1]);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, surf->height/2, surf->width/2,
-                        surf->height/2, GL_RED, GL_UNSIGNED_BYTE, source_data[1]);
-
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, tex_id[0]);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        // Y plane
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, source_pitches[0]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, surf->width, surf->height, 0, GL_RED,
-                     GL_UNSIGNED_BYTE, source_data[0]);
+        // U plane on top of V plane
+        gl_state::active_texture(GL_TEXTURE1);
+        surf->plane_tex[1].allocate(GL_R8, chroma_width, 2 * chroma_height);
+        surf->plane_tex[1].upload(0, 0, chroma_width, chroma_height, GL_RED,
+                                  surf->u_plane.data(), chroma_width);
+        surf->plane_tex[1].upload(0, chroma_height, chroma_width, chroma_height, GL_RED,
+                                  surf->v_plane.data(), chroma_width);
         break;
-    }
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(0, surf->width, 0, surf->height, -1.0f, 1.0f);
-    glViewport(0, 0, surf->width, surf->height);
 
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    case VDP_YCBCR_FORMAT_UYVY:
+    case VDP_YCBCR_FORMAT_YUYV:
+        // byte order is fixed. If width is odd, the last texel holds one pixel only.
+        gl_state::active_texture(GL_TEXTURE0);
+        surf->plane_tex[0].allocate(GL_RGBA8, packed_width, height);
+        surf->plane_tex[0].upload(0, 0, packed_width, height, GL_RGBA, surf->y_plane.data(),
+                                  4 * packed_width);
+        s1 = static_cast<GLfloat>(width) / (2 * packed_width);
+        break;
 
-    glMatrixMode(GL_TEXTURE);
-    glLoadIdentity();
+    case VDP_YCBCR_FORMAT_Y8U8V8A8:
+    case VDP_YCBCR_FORMAT_V8U8Y8A8:
+        // components are defined by bit positions in 32-bit words, not by byte order
+        gl_state::active_texture(GL_TEXTURE0);
+        surf->plane_tex[0].allocate(GL_RGBA8, packed_width, height);
+        surf->plane_tex[0].upload(0, 0, packed_width, height, GL_RGBA, surf->y_plane.data(),
+                                  4 * packed_width, GL_UNSIGNED_INT_8_8_8_8_REV);
+        break;
+    }
 
-    glDisable(GL_BLEND);
+    if (packed_width > 0) {
+        // chroma is in the same texture
+        surf->plane_tex[1].release();
+    } else {
+        // Chroma texture coordinates come from the texture matrix of unit 1. Each chroma
+        // sample covers two luma ones in subsampled directions, so if luma size is odd, the
+        // last chroma column or row is only half-used.
+        const uint32_t sub_x = (surf->chroma_type == VDP_CHROMA_TYPE_444) ? 1 : 2;
+        const uint32_t sub_y = (surf->chroma_type == VDP_CHROMA_TYPE_420) ? 2 : 1;
 
-    switch (source_ycbcr_format) {
-    case VDP_YCBCR_FORMAT_NV12:
-        glUseProgram(surf->device->shaders[glsl_NV12_RGBA].program);
-        glUniform1i(surf->device->shaders[glsl_NV12_RGBA].uniform.tex_0, 0);
-        glUniform1i(surf->device->shaders[glsl_NV12_RGBA].uniform.tex_1, 1);
-        break;
+        gl_state::texture_scale(static_cast<GLfloat>(width) / (sub_x * chroma_width),
+                                static_cast<GLfloat>(height) / (sub_y * chroma_height));
 
-    case VDP_YCBCR_FORMAT_YV12:
-        glUseProgram(surf->device->shaders[glsl_YV12_RGBA].program);
-        glUniform1i(surf->device->shaders[glsl_YV12_RGBA].uniform.tex_0, 0);
-        glUniform1i(surf->device->shaders[glsl_YV12_RGBA].uniform.tex_1, 1);
-        break;
+        // Y plane
+        gl_state::active_texture(GL_TEXTURE0);
+        surf->plane_tex[0].allocate(GL_R8, width, height);
+        surf->plane_tex[0].upload(0, 0, width, height, GL_RED, surf->y_plane.data(), width);
     }
 
-    glBegin(GL_QUADS);
-        glTexCoord2f(0, 0); glVertex2f(0,           0);
-        glTexCoord2f(1, 0); glVertex2f(surf->width, 0);
-        glTexCoord2f(1, 1); glVertex2f(surf->width, surf->height);
-        glTexCoord2f(0, 1); glVertex2f(0,           surf->height);
-    glEnd();
+    gl_state::ortho(0, surf->width, 0, surf->height);
+    gl_state::viewport(0, 0, surf->width, surf->height);
+    gl_state::texture_scale(1.0f, 1.0f);
+    gl_state::set_blend(false);
+    gl_state::use_program(surf->device->shaders[shader].program);
 
-    glUseProgram(0);
-    glFinish();
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glDeleteTextures(2, tex_id);
+    QuadBatch batch;
+    batch.add_rect(0, 0, surf->width, surf->height, 0, 0, s1, 1);
+    batch.draw();
 
-    const auto gl_error = glGetError();
-    if (gl_error != GL_NO_ERROR) {
-        traceError("VideoSurface::PutBitsYCbCr_glsl(): gl error %d\n", gl_error);
+    surf->fence.set();
+
+    if (gl_debug::check_error("VideoSurface::convert_staged_planes()"))
         return VDP_STATUS_ERROR;
-    }
 
+    // staged planes stay pending if anything above failed, so the next call retries
+    surf->sync_planes_to_glx = false;
     return VDP_STATUS_OK;
 }
 
@@ -454,25 +966,69 @@ VdpStatus
 PutBitsYCbCrImpl(VdpVideoSurface surface, VdpYCbCrFormat source_ycbcr_format,
                  void const *const *source_data, uint32_t const *source_pitches)
 {
-    int using_glsl = 1;
-    VdpStatus ret;
+    if (!source_data || !source_pitches)
+        return VDP_STATUS_INVALID_POINTER;
 
-    if (using_glsl) {
-        ret = PutBitsYCbCr_glsl(surface, source_ycbcr_format, source_data, source_pitches);
-    } else {
-        ret = PutBitsYCbCr_swscale(surface, source_ycbcr_format, source_data,
-                                                  source_pitches);
+    if (!is_put_format(source_ycbcr_format)) {
+        traceError("VideoSurface::PutBitsYCbCrImpl(): not implemented source YCbCr format "
+                   "'%s'\n", reverse_ycbcr_format(source_ycbcr_format));
+        return VDP_STATUS_INVALID_Y_CB_CR_FORMAT;
     }
 
-    return ret;
+    ResourceRef<Resource> surf{surface};
+
+    stage_planes(*surf.get(), source_ycbcr_format, source_data, source_pitches, surf->y_plane,
+                 surf->u_plane, surf->v_plane);
+
+    surf->staged_format = source_ycbcr_format;
+    surf->planes_staged = true;
+    surf->sync_planes_to_glx = true;
+    surf->sync_va_to_glx = false;
+
+    return VDP_STATUS_OK;
+}
+
+VdpStatus
+PutStagedPlanesImpl(VdpVideoSurface surface, VdpYCbCrFormat source_ycbcr_format,
+                    StagedPlanes *planes)
+{
+    ResourceRef<Resource> surf{surface};
+
+    // staging buffers are swapped, so both sides keep their allocations
+    surf->y_plane.swap(planes->y);
+    surf->u_plane.swap(planes->u);
+    surf->v_plane.swap(planes->v);
+
+    surf->staged_format = source_ycbcr_format;
+    surf->planes_staged = true;
+    surf->sync_planes_to_glx = true;
+    surf->sync_va_to_glx = false;
+
+    return VDP_STATUS_OK;
 }
 
 VdpStatus
 PutBitsYCbCr(VdpVideoSurface surface, VdpYCbCrFormat source_ycbcr_format,
              void const *const *source_data, uint32_t const *source_pitches)
 {
-    return check_for_exceptions(PutBitsYCbCrImpl, surface, source_ycbcr_format, source_data,
-                                source_pitches);
+    auto surf = find_with_render_thread<Resource>(surface);
+    if (!surf || !source_data || !source_pitches || !is_put_format(source_ycbcr_format))
+        return call_on_render_thread<Resource>(surface, PutBitsYCbCrImpl, surface,
+                                               source_ycbcr_format, source_data, source_pitches);
+
+    // stage source planes right away, so the call can return before the render thread
+    // picks them up. Surface dimensions are immutable and need no lock.
+    auto planes = std::make_shared<StagedPlanes>();
+    stage_planes(*surf, source_ycbcr_format, source_data, source_pitches, planes->y, planes->u,
+                 planes->v);
+
+    post_call(render_thread_of(surf.get()), "VideoSurface::PutBitsYCbCr",
+              [surface, source_ycbcr_format, planes] () {
+                  return check_for_exceptions(PutStagedPlanesImpl, surface, source_ycbcr_format,
+                                              planes.get());
+              });
+
+    return VDP_STATUS_OK;
 }
 
 VdpStatus
@@ -510,12 +1066,34 @@ QueryGetPutBitsYCbCrCapabilitiesImpl(VdpDevice device, VdpChromaType surface_chr
 {
     // TODO: don't ignore
     std::ignore = device;
-    std::ignore = surface_chroma_type;
-    std::ignore = bits_ycbcr_format;
 
-    // TODO: implement
-    if (is_supported)
+    if (!is_supported)
+        return VDP_STATUS_INVALID_POINTER;
+
+    if (surface_chroma_type != VDP_CHROMA_TYPE_420 &&
+        surface_chroma_type != VDP_CHROMA_TYPE_422 &&
+        surface_chroma_type != VDP_CHROMA_TYPE_444)
+    {
+        *is_supported = 0;
+        return VDP_STATUS_OK;
+    }
+
+    // Formats both PutBitsYCbCr and GetBitsYCbCr accept. Surfaces are stored as RGBA, so packed
+    // formats fit any of them. Planar formats take chroma plane sizes from surface chroma type.
+    switch (bits_ycbcr_format) {
+    case VDP_YCBCR_FORMAT_NV12:
+    case VDP_YCBCR_FORMAT_YV12:
+    case VDP_YCBCR_FORMAT_UYVY:
+    case VDP_YCBCR_FORMAT_YUYV:
+    case VDP_YCBCR_FORMAT_Y8U8V8A8:
+    case VDP_YCBCR_FORMAT_V8U8Y8A8:
         *is_supported = 1;
+        break;
+
+    default:
+        *is_supported = 0;
+        break;
+    }
 
     return VDP_STATUS_OK;
 }
@@ -26,7 +26,10 @@
 
 #include "api-decoder.hh"
 #include "api.hh"
+#include "gl-fence.hh"
+#include "plane-texture.hh"
 #include <GL/gl.h>
+#include <list>
 #include <memory>
 
 
@@ -34,11 +37,21 @@ namespace vdp { namespace VideoSurface {
 
 struct Resource: public vdp::GenericResource
 {
-    Resource(std::shared_ptr<vdp::Device::Resource> a_device, VdpChromaType a_chroma_type,
+    Resource(ResourcePtr<vdp::Device::Resource> a_device, VdpChromaType a_chroma_type,
              uint32_t a_width, uint32_t a_height);
 
     ~Resource();
 
+    /// makes sure RGBA texture and framebuffer exist, and marks them as recently used. If GL
+    /// runs out of memory, storage of idle surfaces gets released. Needs current GL context.
+    void
+    allocate_rgba();
+
+    /// releases GL storage. It's rebuilt from staged planes or VA surface on next use.
+    /// Needs current GL context.
+    void
+    release_rgba();
+
     VdpChromaType   chroma_type;    ///< video chroma type
     uint32_t        width;
     uint32_t        height;
@@ -48,16 +61,33 @@ struct Resource: public vdp::GenericResource
     uint32_t        chroma_stride;
     VASurfaceID     va_surf;        ///< VA-API surface
     bool            sync_va_to_glx; ///< whenever VA-API surface should be converted to GL texture
-    GLuint          tex_id;         ///< GL texture id (RGBA)
-    GLuint          fbo_id;         ///< framebuffer object id
+    bool            sync_planes_to_glx; ///< whenever staged planes should be converted to GL
+                                        ///< texture
+    VdpYCbCrFormat  staged_format;  ///< format of staged planes
+    bool            planes_staged;  ///< current content is in staged planes rather than in
+                                    ///< VA-API surface
+    GLuint          tex_id;         ///< GL texture id (RGBA), zero until first use
+    GLuint          fbo_id;         ///< framebuffer object id, zero until first use
+    GLuint          plane_fbo;      ///< framebuffer for rendering into plane textures on
+                                    ///< readback, zero until first use
+    bool            resident;       ///< whether RGBA storage is in the resident surface list
+    std::list<uint32_t>::iterator resident_pos; ///< position in that list, if resident
+    vdp::GLFence    fence;          ///< completion of the last GL command using surface
+    vdp::PlaneTexture plane_tex[2]; ///< luma and chroma planes of the last PutBitsYCbCr
+                                    ///< or readback, kept for reuse
     int32_t         rt_idx;         ///< index in VdpDecoder's render_targets
-    std::vector<uint8_t>    y_plane;
-    std::vector<uint8_t>    u_plane;
-    std::vector<uint8_t>    v_plane;
+    std::vector<uint8_t>    y_plane;    ///< planes of the last PutBitsYCbCr, with tightly
+    std::vector<uint8_t>    u_plane;    ///< packed rows. Packed formats use y_plane only,
+    std::vector<uint8_t>    v_plane;    ///< NV12 keeps interleaved chroma in u_plane
 
-    std::shared_ptr<vdp::Decoder::Resource> decoder;        ///< associated VdpDecoder
+    ResourcePtr<vdp::Decoder::Resource> decoder;        ///< associated VdpDecoder
 };
 
+/// converts planes staged by PutBitsYCbCr to RGBA texture and, on success, clears
+/// sync_planes_to_glx. Surface must be locked, and GL context of its device must be current.
+VdpStatus
+convert_staged_planes(Resource *surf);
+
 VdpVideoSurfaceQueryCapabilities                QueryCapabilities;
 VdpVideoSurfaceQueryGetPutBitsYCbCrCapabilities QueryGetPutBitsYCbCrCapabilities;
 VdpVideoSurfaceCreate                           Create;
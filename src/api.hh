@@ -24,8 +24,14 @@
 
 #pragma once
 
-#include <memory>
+#include "resource-lock.hh"
+#include "resource-pool.hh"
+#include <atomic>
 #include <mutex>
+#include <new>
+#include <stdint.h>
+#include <utility>
+#include <vector>
 
 
 namespace vdp {
@@ -37,11 +43,212 @@ namespace Device {
 struct Resource;
 } // namespace Device
 
+struct GenericResource;
+
+void
+resource_add_ref(GenericResource *res);
+
+void
+resource_release(GenericResource *res);
+
+/// Owning pointer to a resource, using the reference counter embedded in GenericResource.
+/// Code that only needs a resource for the duration of a call should borrow a plain pointer
+/// instead (see ResourceRef), which doesn't touch the counter at all.
+template <class T>
+class ResourcePtr
+{
+public:
+    ResourcePtr()
+        : res_{nullptr}
+    {}
+
+    ResourcePtr(std::nullptr_t)
+        : res_{nullptr}
+    {}
+
+    explicit
+    ResourcePtr(T *res)
+        : res_{res}
+    {
+        if (res_)
+            resource_add_ref(res_);
+    }
+
+    ResourcePtr(const ResourcePtr &other)
+        : res_{other.res_}
+    {
+        if (res_)
+            resource_add_ref(res_);
+    }
+
+    ResourcePtr(ResourcePtr &&other)
+        : res_{other.res_}
+    {
+        other.res_ = nullptr;
+    }
+
+    ~ResourcePtr()
+    {
+        if (res_)
+            resource_release(res_);
+    }
+
+    ResourcePtr &
+    operator=(ResourcePtr other)
+    {
+        std::swap(res_, other.res_);
+        return *this;
+    }
+
+    T *
+    get() const { return static_cast<T *>(res_); }
+
+    T *
+    operator->() const { return get(); }
+
+    T &
+    operator*() const { return *get(); }
+
+    explicit operator bool() const { return res_ != nullptr; }
+
+    /// gives up ownership without decrementing the counter
+    T *
+    detach()
+    {
+        T *res = get();
+        res_ = nullptr;
+        return res;
+    }
+
+private:
+    GenericResource    *res_;
+};
+
 struct GenericResource
 {
+    GenericResource()
+        : ref_count{0}
+        , release_on_unlock{false}
+        , destroy_fn{nullptr}
+    {}
+
     uint32_t    id;
-    std::shared_ptr<vdp::Device::Resource> device;
-    std::recursive_mutex                   mtx;
+    ResourcePtr<vdp::Device::Resource>     device;
+    vdp::ResourceLock                      mtx;
+
+    // links in the owning device's ResourceRegistry
+    GenericResource                       *registry_prev = nullptr;
+    GenericResource                       *registry_next = nullptr;
+
+    std::atomic<uint32_t>   ref_count;          ///< number of ResourcePtr owners
+    bool                    release_on_unlock;  ///< storage reference is to be released on final
+                                                ///< unlock, guarded by mtx
+    void                  (*destroy_fn)(GenericResource *res);  ///< set by make_resource()
+};
+
+inline void
+resource_add_ref(GenericResource *res)
+{
+    res->ref_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void
+resource_release(GenericResource *res)
+{
+    if (res->ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        res->destroy_fn(res);
+}
+
+/// unlocks resource, releasing the storage reference if resource was dropped while locked
+inline void
+unlock_resource(GenericResource *res)
+{
+    const bool release = res->release_on_unlock && res->mtx.is_last_level();
+
+    if (release)
+        res->release_on_unlock = false;
+
+    res->mtx.unlock();
+
+    if (release)
+        resource_release(res);
+}
+
+/// creates resource in memory taken from per-type pool
+template <class T, class... Args>
+ResourcePtr<T>
+make_resource(Args &&... args)
+{
+    auto &pool = ResourcePool<T>::instance();
+    void *mem = pool.allocate();
+
+    T *res;
+    try {
+        res = new (mem) T(std::forward<Args>(args)...);
+    } catch (...) {
+        pool.deallocate(mem);
+        throw;
+    }
+
+    res->destroy_fn = [](GenericResource *ptr) {
+        T *obj = static_cast<T *>(ptr);
+        obj->~T();
+        ResourcePool<T>::instance().deallocate(obj);
+    };
+
+    return ResourcePtr<T>(res);
+}
+
+/// Intrusive list of resources that belong to a single device. Resources are added and removed
+/// by ResourceStorage, so device teardown visits only its own children.
+class ResourceRegistry
+{
+public:
+    void
+    add(GenericResource *res)
+    {
+        std::unique_lock<decltype(mtx_)> lock(mtx_);
+
+        res->registry_prev = nullptr;
+        res->registry_next = head_;
+        if (head_)
+            head_->registry_prev = res;
+        head_ = res;
+    }
+
+    void
+    remove(GenericResource *res)
+    {
+        std::unique_lock<decltype(mtx_)> lock(mtx_);
+
+        if (res->registry_prev)
+            res->registry_prev->registry_next = res->registry_next;
+        else if (head_ == res)
+            head_ = res->registry_next;
+
+        if (res->registry_next)
+            res->registry_next->registry_prev = res->registry_prev;
+
+        res->registry_prev = nullptr;
+        res->registry_next = nullptr;
+    }
+
+    /// handles of all registered resources
+    std::vector<uint32_t>
+    snapshot()
+    {
+        std::unique_lock<decltype(mtx_)> lock(mtx_);
+        std::vector<uint32_t> v;
+
+        for (GenericResource *res = head_; res; res = res->registry_next)
+            v.push_back(res->id);
+
+        return v;
+    }
+
+private:
+    std::mutex          mtx_;
+    GenericResource    *head_ = nullptr;
 };
 
 } // namespace vdp
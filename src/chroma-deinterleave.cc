@@ -0,0 +1,322 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "chroma-deinterleave.hh"
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stddef.h>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VDP_CHROMA_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VDP_CHROMA_NEON 1
+#endif
+
+
+namespace vdp {
+namespace chroma {
+
+namespace {
+
+// Below this many bytes per thread, waking workers costs more than it saves. A 4K NV12 chroma
+// plane is about 4 MiB and gets split in four.
+const size_t kMinBytesPerThread = 1024 * 1024;
+const uint32_t kMaxThreads = 4;
+
+void
+row_scalar(const uint8_t *src, uint8_t *dst_0, uint8_t *dst_1, uint32_t count)
+{
+    for (uint32_t k = 0; k < count; k ++) {
+        dst_0[k] = src[2 * k];
+        dst_1[k] = src[2 * k + 1];
+    }
+}
+
+#if VDP_CHROMA_X86
+
+__attribute__((target("sse2")))
+void
+row_sse2(const uint8_t *src, uint8_t *dst_0, uint8_t *dst_1, uint32_t count)
+{
+    const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+    uint32_t k = 0;
+
+    for (; k + 16 <= count; k += 16) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * k));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * k + 16));
+
+        const __m128i even = _mm_packus_epi16(_mm_and_si128(a, low_bytes),
+                                              _mm_and_si128(b, low_bytes));
+        const __m128i odd = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst_0 + k), even);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst_1 + k), odd);
+    }
+
+    row_scalar(src + 2 * k, dst_0 + k, dst_1 + k, count - k);
+}
+
+__attribute__((target("avx2")))
+void
+row_avx2(const uint8_t *src, uint8_t *dst_0, uint8_t *dst_1, uint32_t count)
+{
+    const __m256i low_bytes = _mm256_set1_epi16(0x00ff);
+    uint32_t k = 0;
+
+    for (; k + 32 <= count; k += 32) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * k));
+        const __m256i b = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(src + 2 * k + 32));
+
+        // packing works within 128-bit lanes, so 64-bit quarters end up as a0 b0 a1 b1
+        const __m256i even = _mm256_packus_epi16(_mm256_and_si256(a, low_bytes),
+                                                 _mm256_and_si256(b, low_bytes));
+        const __m256i odd = _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+                                                _mm256_srli_epi16(b, 8));
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst_0 + k),
+                            _mm256_permute4x64_epi64(even, 0xd8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst_1 + k),
+                            _mm256_permute4x64_epi64(odd, 0xd8));
+    }
+
+    row_sse2(src + 2 * k, dst_0 + k, dst_1 + k, count - k);
+}
+
+#endif // VDP_CHROMA_X86
+
+#if VDP_CHROMA_NEON
+
+void
+row_neon(const uint8_t *src, uint8_t *dst_0, uint8_t *dst_1, uint32_t count)
+{
+    uint32_t k = 0;
+
+    for (; k + 16 <= count; k += 16) {
+        const uint8x16x2_t pairs = vld2q_u8(src + 2 * k);
+        vst1q_u8(dst_0 + k, pairs.val[0]);
+        vst1q_u8(dst_1 + k, pairs.val[1]);
+    }
+
+    row_scalar(src + 2 * k, dst_0 + k, dst_1 + k, count - k);
+}
+
+#endif // VDP_CHROMA_NEON
+
+std::vector<DeinterleaveKernel>
+detect_kernels()
+{
+    std::vector<DeinterleaveKernel> kernels;
+
+    kernels.push_back(DeinterleaveKernel{"scalar", row_scalar});
+
+#if VDP_CHROMA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels.push_back(DeinterleaveKernel{"sse2", row_sse2});
+
+    // also checks that OS saves AVX state
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back(DeinterleaveKernel{"avx2", row_avx2});
+#endif
+
+#if VDP_CHROMA_NEON
+    kernels.push_back(DeinterleaveKernel{"neon", row_neon});
+#endif
+
+    return kernels;
+}
+
+void
+deinterleave_rows(DeinterleaveRowFunc row, const uint8_t *src, uint32_t src_pitch,
+                  uint8_t *dst_0, uint32_t pitch_0, uint8_t *dst_1, uint32_t pitch_1,
+                  uint32_t width, uint32_t first, uint32_t last)
+{
+    for (uint32_t y = first; y < last; y ++) {
+        row(src + static_cast<size_t>(y) * src_pitch, dst_0 + static_cast<size_t>(y) * pitch_0,
+            dst_1 + static_cast<size_t>(y) * pitch_1, width);
+    }
+}
+
+/// Workers which take parts of large planes. They are started on first use and kept, since
+/// starting threads for every frame would eat much of the gain.
+class WorkerPool
+{
+public:
+    typedef std::function<void(uint32_t part, uint32_t part_count)> Job;
+
+    WorkerPool()
+        : job_{nullptr}
+        , part_count_{0}
+        , generation_{0}
+        , pending_{0}
+        , stop_{false}
+    {}
+
+    ~WorkerPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock{mtx_};
+            stop_ = true;
+        }
+
+        work_cv_.notify_all();
+        for (auto &t: threads_)
+            t.join();
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+
+    WorkerPool &
+    operator=(const WorkerPool &) = delete;
+
+    /// Runs `job` split in up to `part_count` parts, part 0 on the calling thread and the rest
+    /// on workers. Part count may end up lower if workers can't be started. If the pool is busy
+    /// with another caller, the whole job runs on the calling thread.
+    void
+    run(uint32_t part_count, const Job &job)
+    {
+        std::unique_lock<std::mutex> run_lock{run_mtx_, std::try_to_lock};
+        if (!run_lock.owns_lock()) {
+            job(0, 1);
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock{mtx_};
+
+            while (threads_.size() + 1 < part_count) {
+                try {
+                    threads_.emplace_back(&WorkerPool::worker_main, this,
+                                          static_cast<uint32_t>(threads_.size() + 1));
+                } catch (const std::system_error &) {
+                    // out of threads, make do with those already running
+                    part_count = threads_.size() + 1;
+                }
+            }
+
+            job_ = &job;
+            part_count_ = part_count;
+            pending_ = part_count - 1;
+            generation_ += 1;
+        }
+
+        work_cv_.notify_all();
+        job(0, part_count);
+
+        std::unique_lock<std::mutex> lock{mtx_};
+        done_cv_.wait(lock, [this] { return pending_ == 0; });
+        job_ = nullptr;
+    }
+
+private:
+    void
+    worker_main(uint32_t part)
+    {
+        uint64_t seen_generation = 0;
+        std::unique_lock<std::mutex> lock{mtx_};
+
+        while (true) {
+            work_cv_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+            if (stop_)
+                return;
+
+            seen_generation = generation_;
+            if (part >= part_count_)
+                continue;
+
+            const Job *job = job_;
+            const uint32_t part_count = part_count_;
+            lock.unlock();
+            (*job)(part, part_count);
+            lock.lock();
+
+            pending_ -= 1;
+            if (pending_ == 0)
+                done_cv_.notify_one();
+        }
+    }
+
+    std::mutex                  run_mtx_;       ///< admits one caller at a time
+    std::mutex                  mtx_;
+    std::condition_variable     work_cv_;
+    std::condition_variable     done_cv_;
+    std::vector<std::thread>    threads_;       ///< worker k takes part k + 1
+    const Job                  *job_;           ///< guarded by mtx_
+    uint32_t                    part_count_;    ///< guarded by mtx_
+    uint64_t                    generation_;    ///< bumped for each job, guarded by mtx_
+    uint32_t                    pending_;       ///< parts not done by workers, guarded by mtx_
+    bool                        stop_;          ///< guarded by mtx_
+};
+
+WorkerPool &
+worker_pool()
+{
+    // joined on exit or library unload
+    static WorkerPool pool;
+    return pool;
+}
+
+} // anonymous namespace
+
+const std::vector<DeinterleaveKernel> &
+deinterleave_kernels()
+{
+    static const std::vector<DeinterleaveKernel> kernels = detect_kernels();
+    return kernels;
+}
+
+void
+deinterleave(const uint8_t *src, uint32_t src_pitch, uint8_t *dst_0, uint32_t pitch_0,
+             uint8_t *dst_1, uint32_t pitch_1, uint32_t width, uint32_t height)
+{
+    const DeinterleaveRowFunc row = deinterleave_kernels().back().row;
+
+    const size_t size = 2 * static_cast<size_t>(width) * height;
+    const uint32_t hw_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    const uint32_t thread_count = std::min<size_t>(
+        {size / kMinBytesPerThread, kMaxThreads, hw_threads, height});
+
+    if (thread_count <= 1) {
+        deinterleave_rows(row, src, src_pitch, dst_0, pitch_0, dst_1, pitch_1, width, 0,
+                          height);
+        return;
+    }
+
+    worker_pool().run(thread_count, [&] (uint32_t part, uint32_t part_count) {
+        const uint32_t first = static_cast<uint64_t>(height) * part / part_count;
+        const uint32_t last = static_cast<uint64_t>(height) * (part + 1) / part_count;
+        deinterleave_rows(row, src, src_pitch, dst_0, pitch_0, dst_1, pitch_1, width, first,
+                          last);
+    });
+}
+
+} } // namespace vdp::chroma
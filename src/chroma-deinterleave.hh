@@ -0,0 +1,54 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+
+namespace vdp {
+namespace chroma {
+
+/// splits `count` interleaved pairs of `src` into `dst_0` (even bytes) and `dst_1` (odd bytes)
+typedef void (*DeinterleaveRowFunc)(const uint8_t *src, uint8_t *dst_0, uint8_t *dst_1,
+                                    uint32_t count);
+
+struct DeinterleaveKernel {
+    const char             *name;
+    DeinterleaveRowFunc     row;
+};
+
+/// kernels runnable on this CPU, from slowest to fastest. The last one is used by
+/// deinterleave(). Exposed for tests and benchmarks.
+const std::vector<DeinterleaveKernel> &
+deinterleave_kernels();
+
+/// Splits interleaved plane of `width` pairs by `height` rows, such as NV12 chroma, into two
+/// planes. Large planes get their rows split across several threads.
+void
+deinterleave(const uint8_t *src, uint32_t src_pitch, uint8_t *dst_0, uint32_t pitch_0,
+             uint8_t *dst_1, uint32_t pitch_1, uint32_t width, uint32_t height);
+
+} } // namespace vdp::chroma
@@ -24,12 +24,18 @@
 
 #pragma once
 
+#include <climits>
 #include <signal.h>
+#include <stdint.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
-#ifdef __FreeBSD__
+#if defined(__linux__)
+#include <linux/futex.h>
+#elif defined(__FreeBSD__)
 #include <sys/thr.h>
+#include <sys/types.h>
+#include <sys/umtx.h>
 #endif
 
 
@@ -49,6 +55,19 @@ thread_is_alive(thread_id_t tid)
     return kill(tid, 0) == 0;
 }
 
+// sleep while 32-bit word at |addr| still equals |val|
+static inline void
+futex_wait(void *addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, nullptr, nullptr, 0);
+}
+
+static inline void
+futex_wake_all(void *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
 #elif defined(__FreeBSD__)
 
 typedef long thread_id_t;
@@ -67,6 +86,18 @@ thread_is_alive(thread_id_t tid)
     return thr_kill(tid, 0) == 0;
 }
 
+static inline void
+futex_wait(void *addr, uint32_t val)
+{
+    _umtx_op(addr, UMTX_OP_WAIT_UINT_PRIVATE, val, nullptr, nullptr);
+}
+
+static inline void
+futex_wake_all(void *addr)
+{
+    _umtx_op(addr, UMTX_OP_WAKE_PRIVATE, INT_MAX, nullptr, nullptr);
+}
+
 #else
 #error Unknown OS
 #endif
@@ -0,0 +1,266 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "egl-context.hh"
+#include "exceptions.hh"
+#include "globals.hh"
+#include "trace.hh"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <string.h>
+
+
+namespace vdp { namespace egl {
+
+namespace {
+
+// backend choice, changed only while g_backend_refs is zero. Both guarded by g_backend_mtx.
+std::mutex          g_backend_mtx;
+int                 g_backend_refs = 0;
+std::atomic<bool>   g_enabled{false};
+
+// set up by initialize(), which is serialized by the caller and happens before any context
+// gets created
+EGLDisplay      g_dpy = EGL_NO_DISPLAY;
+EGLConfig       g_config = nullptr;
+EGLSurface      g_surface = EGL_NO_SURFACE;     ///< 1x1 pbuffer, if surfaceless isn't supported
+EGLContext      g_root = EGL_NO_CONTEXT;
+
+bool
+has_extension(const char *extensions, const char *name)
+{
+    if (!extensions)
+        return false;
+
+    const size_t len = strlen(name);
+    for (const char *p = strstr(extensions, name); p; p = strstr(p + len, name)) {
+        if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0'))
+            return true;
+    }
+
+    return false;
+}
+
+EGLDisplay
+open_display()
+{
+    const char *client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+
+    if (has_extension(client_extensions, "EGL_MESA_platform_surfaceless")) {
+        const auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+            eglGetProcAddress("eglGetPlatformDisplayEXT"));
+
+        if (get_platform_display) {
+            EGLDisplay dpy = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                                  EGL_DEFAULT_DISPLAY, nullptr);
+            if (dpy != EGL_NO_DISPLAY)
+                return dpy;
+        }
+    }
+
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+} // anonymous namespace
+
+bool
+enabled()
+{
+    return g_enabled.load(std::memory_order_acquire);
+}
+
+BackendRef::BackendRef(bool have_display)
+{
+    std::unique_lock<std::mutex> lock{g_backend_mtx};
+
+    const bool use_egl = global.quirks.egl || !have_display;
+
+    if (g_backend_refs == 0) {
+        g_enabled.store(use_egl, std::memory_order_release);
+    } else if (use_egl != g_enabled.load(std::memory_order_relaxed)) {
+        traceError("egl::BackendRef::BackendRef(): existing devices use %s, can't use %s\n",
+                   use_egl ? "GLX" : "EGL", use_egl ? "EGL" : "GLX");
+        throw vdp::generic_error();
+    }
+
+    g_backend_refs += 1;
+}
+
+BackendRef::~BackendRef()
+{
+    std::unique_lock<std::mutex> lock{g_backend_mtx};
+    g_backend_refs -= 1;
+}
+
+Binding
+current_binding()
+{
+    Binding binding;
+
+    binding.api = eglQueryAPI();
+    eglBindAPI(EGL_OPENGL_API);
+
+    binding.dpy =  eglGetCurrentDisplay();
+    binding.draw = eglGetCurrentSurface(EGL_DRAW);
+    binding.read = eglGetCurrentSurface(EGL_READ);
+    binding.ctx =  eglGetCurrentContext();
+
+    return binding;
+}
+
+void
+make_current(EGLContext ctx)
+{
+    eglBindAPI(EGL_OPENGL_API);
+    if (!eglMakeCurrent(g_dpy, g_surface, g_surface, ctx))
+        traceError("egl::make_current(): eglMakeCurrent failed, %#x\n", eglGetError());
+}
+
+void
+restore(const Binding &binding)
+{
+    eglBindAPI(EGL_OPENGL_API);
+
+    if (binding.ctx == EGL_NO_CONTEXT)
+        eglMakeCurrent(g_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    else
+        eglMakeCurrent(binding.dpy, binding.draw, binding.read, binding.ctx);
+
+    eglBindAPI(binding.api);
+}
+
+void
+release()
+{
+    eglBindAPI(EGL_OPENGL_API);
+    eglMakeCurrent(g_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+void
+initialize()
+{
+    g_dpy = open_display();
+    if (g_dpy == EGL_NO_DISPLAY || !eglInitialize(g_dpy, nullptr, nullptr)) {
+        traceError("egl::initialize(): can't initialize EGL display\n");
+        throw std::bad_alloc();
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        traceError("egl::initialize(): desktop OpenGL is not supported\n");
+        eglTerminate(g_dpy);
+        throw std::bad_alloc();
+    }
+
+    const bool surfaceless =
+        has_extension(eglQueryString(g_dpy, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context");
+
+    // rendering goes to framebuffer objects only, so the config doesn't matter much
+    const EGLint config_attrs[] = {
+        EGL_SURFACE_TYPE,       surfaceless ? 0 : EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE,    EGL_OPENGL_BIT,
+        EGL_RED_SIZE,           8,
+        EGL_GREEN_SIZE,         8,
+        EGL_BLUE_SIZE,          8,
+        EGL_ALPHA_SIZE,         8,
+        EGL_NONE
+    };
+
+    EGLint config_count = 0;
+    if (!eglChooseConfig(g_dpy, config_attrs, &g_config, 1, &config_count) ||
+        config_count < 1)
+    {
+        traceError("egl::initialize(): no suitable EGL config\n");
+        eglTerminate(g_dpy);
+        throw std::bad_alloc();
+    }
+
+    if (!surfaceless) {
+        const EGLint pbuffer_attrs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+
+        g_surface = eglCreatePbufferSurface(g_dpy, g_config, pbuffer_attrs);
+        if (g_surface == EGL_NO_SURFACE) {
+            traceError("egl::initialize(): can't create pbuffer\n");
+            eglTerminate(g_dpy);
+            throw std::bad_alloc();
+        }
+    }
+
+    g_root = eglCreateContext(g_dpy, g_config, EGL_NO_CONTEXT, nullptr);
+    if (g_root == EGL_NO_CONTEXT) {
+        traceError("egl::initialize(): can't create root context\n");
+        eglTerminate(g_dpy);
+        throw std::bad_alloc();
+    }
+}
+
+void
+terminate()
+{
+    release();
+    eglDestroyContext(g_dpy, g_root);
+    if (g_surface != EGL_NO_SURFACE)
+        eglDestroySurface(g_dpy, g_surface);
+
+    eglTerminate(g_dpy);
+
+    g_root = EGL_NO_CONTEXT;
+    g_surface = EGL_NO_SURFACE;
+    g_dpy = EGL_NO_DISPLAY;
+}
+
+EGLContext
+create_context()
+{
+    const EGLenum api = eglQueryAPI();
+
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext ctx = eglCreateContext(g_dpy, g_config, g_root, nullptr);
+    eglBindAPI(api);
+
+    return ctx;
+}
+
+void
+destroy_context(EGLContext ctx)
+{
+    const EGLenum api = eglQueryAPI();
+
+    eglBindAPI(EGL_OPENGL_API);
+    if (eglGetCurrentContext() == ctx)
+        eglMakeCurrent(g_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+    eglDestroyContext(g_dpy, ctx);
+    eglBindAPI(api);
+}
+
+void *
+get_proc_address(const char *name)
+{
+    return reinterpret_cast<void *>(eglGetProcAddress(name));
+}
+
+} } // namespace vdp::egl
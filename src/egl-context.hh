@@ -0,0 +1,99 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <EGL/egl.h>
+
+
+namespace vdp { namespace egl {
+
+/// Whether GL contexts come from EGL instead of GLX. Chosen by BackendRef when the first
+/// device is created. With EGL all rendering goes to offscreen surfaces, and neither VA-API nor
+/// presentation queues are available.
+bool
+enabled();
+
+/// Holds the backend choice while a device exists. The first device picks the backend: EGL if
+/// EGL quirk is set or the application passed no X display, GLX otherwise. Devices created
+/// while others exist must fit that choice, otherwise constructor throws generic_error.
+class BackendRef
+{
+public:
+    explicit
+    BackendRef(bool have_display);
+
+    ~BackendRef();
+
+    BackendRef(const BackendRef &) = delete;
+
+    BackendRef &
+    operator=(const BackendRef &) = delete;
+};
+
+/// context binding of the calling thread
+struct Binding {
+    EGLenum     api;
+    EGLDisplay  dpy;
+    EGLSurface  draw;
+    EGLSurface  read;
+    EGLContext  ctx;
+};
+
+/// returns desktop GL binding of the calling thread. `api` is the rendering API that was
+/// bound before, the call leaves desktop GL bound.
+Binding
+current_binding();
+
+/// makes `ctx` current with no surface, or with a dummy pbuffer if surfaceless contexts aren't
+/// supported
+void
+make_current(EGLContext ctx);
+
+void
+restore(const Binding &binding);
+
+/// unbinds desktop GL context of the calling thread
+void
+release();
+
+/// sets up EGL display and root context, which all other contexts share objects with.
+/// Throws on failure.
+void
+initialize();
+
+void
+terminate();
+
+/// creates context sharing objects with the root one
+EGLContext
+create_context();
+
+void
+destroy_context(EGLContext ctx);
+
+void *
+get_proc_address(const char *name);
+
+} } // namespace vdp::egl
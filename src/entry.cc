@@ -27,6 +27,7 @@
 #include "compat.hh"
 #include "globals.hh"
 #include "handle-storage.hh"
+#include "lock-stats.hh"
 #include "trace.hh"
 #include <ctype.h>
 #include <stdio.h>
@@ -43,6 +44,9 @@ initialize_quirks()
     global.quirks.buggy_XCloseDisplay = 0;
     global.quirks.show_watermark = 0;
     global.quirks.avoid_va = 0;
+    global.quirks.lock_stats = 0;
+    global.quirks.restore_context = 0;
+    global.quirks.render_thread = 0;
 
     const char *value = getenv("VDPAU_QUIRKS");
     if (!value)
@@ -72,6 +76,24 @@ initialize_quirks()
             } else
             if (!strcmp("avoidva", item_start)) {
                 global.quirks.avoid_va = 1;
+            } else
+            if (!strcmp("lockstats", item_start)) {
+                global.quirks.lock_stats = 1;
+            } else
+            if (!strcmp("restorecontext", item_start)) {
+                global.quirks.restore_context = 1;
+            } else
+            if (!strcmp("renderthread", item_start)) {
+                global.quirks.render_thread = 1;
+            } else
+            if (!strcmp("verifyglstate", item_start)) {
+                global.quirks.verify_gl_state = 1;
+            } else
+            if (!strcmp("checkglerrors", item_start)) {
+                global.quirks.check_gl_errors = 1;
+            } else
+            if (!strcmp("egl", item_start)) {
+                global.quirks.egl = 1;
             }
 
             item_start = ptr + 1;
@@ -90,6 +112,17 @@ va_gl_library_constructor()
 {
     // Initialize global data
     initialize_quirks();
+
+    if (global.quirks.lock_stats)
+        vdp::lock_stats::initialize();
+}
+
+__attribute__((destructor))
+void
+va_gl_library_destructor()
+{
+    if (global.quirks.lock_stats)
+        vdp::lock_stats::finalize();
 }
 
 extern "C"
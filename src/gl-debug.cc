@@ -0,0 +1,262 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define GL_GLEXT_PROTOTYPES
+#include "gl-debug.hh"
+#include "gl-state.hh"
+#include "globals.hh"
+#include "glx-context.hh"
+#include "trace.hh"
+#include <GL/gl.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <tuple>
+#include <vector>
+
+
+namespace vdp { namespace gl_debug {
+
+namespace {
+
+struct Message {
+    const void     *ctx;    ///< context the message came from
+    std::string     text;
+};
+
+const size_t kMaxMessages = 64;
+
+std::mutex          g_messages_mutex;
+std::deque<Message> g_messages;                 ///< undelivered error messages
+std::atomic<int>    g_message_count{0};         ///< size of g_messages, readable without lock
+
+/// context debug output was last enabled for, by the current thread
+thread_local const void *t_enabled_ctx = nullptr;
+thread_local uint32_t   t_enabled_ctx_epoch = 0;
+thread_local bool       t_output_active = false;    ///< debug output works in t_enabled_ctx
+
+/// While set, messages of synchronous debug output are collected here instead of the queue.
+/// Synchronous output calls back on the thread which made the failing call.
+thread_local std::vector<std::string> *t_captured = nullptr;
+
+bool
+polling()
+{
+#ifndef NDEBUG
+    return true;
+#else
+    return global.quirks.check_gl_errors;
+#endif
+}
+
+void GLAPIENTRY
+debug_callback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length,
+               const GLchar *message, const void *user_param)
+{
+    std::ignore = source;
+    std::ignore = id;
+    std::ignore = severity;
+
+    if (type != GL_DEBUG_TYPE_ERROR)
+        return;
+
+    if (t_captured) {
+        t_captured->push_back(std::string(message, length >= 0 ? length : strlen(message)));
+        return;
+    }
+
+    // the callback may run on a driver thread, so messages are matched by context, which was
+    // passed as user parameter
+    std::unique_lock<std::mutex> lock{g_messages_mutex};
+
+    if (g_messages.size() >= kMaxMessages) {
+        traceError("gl_debug: unclaimed gl error, %s\n", g_messages.front().text.c_str());
+        g_messages.pop_front();
+    }
+
+    g_messages.push_back(Message{user_param, std::string(message, length >= 0 ? length
+                                                                            : strlen(message))});
+    g_message_count = g_messages.size();
+}
+
+bool
+supported()
+{
+    int major = 0;
+    int minor = 0;
+    const char *version = reinterpret_cast<const char *>(glGetString(GL_VERSION));
+    if (version)
+        sscanf(version, "%d.%d", &major, &minor);
+
+    if (major > 4 || (major == 4 && minor >= 3))
+        return true;
+
+    const char *ext = reinterpret_cast<const char *>(glGetString(GL_EXTENSIONS));
+    return ext && strstr(ext, "GL_KHR_debug");
+}
+
+bool
+report_messages(const char *where)
+{
+    if (g_message_count.load(std::memory_order_relaxed) == 0)
+        return false;
+
+    const void *ctx = current_gl_context();
+    bool found = false;
+
+    std::unique_lock<std::mutex> lock{g_messages_mutex};
+
+    for (auto it = g_messages.begin(); it != g_messages.end(); ) {
+        if (it->ctx != ctx) {
+            ++ it;
+            continue;
+        }
+
+        traceError("%s: gl error, %s\n", where, it->text.c_str());
+        it = g_messages.erase(it);
+        found = true;
+    }
+
+    g_message_count = g_messages.size();
+    return found;
+}
+
+} // anonymous namespace
+
+void
+enable_output()
+{
+    const void *ctx = current_gl_context();
+    const uint32_t ctx_epoch = gl_state::context_epoch();
+
+    // errors are polled anyway, avoid reporting them twice
+    if (polling())
+        return;
+
+    if (!ctx || (ctx == t_enabled_ctx && ctx_epoch == t_enabled_ctx_epoch))
+        return;
+
+    t_enabled_ctx = ctx;
+    t_enabled_ctx_epoch = ctx_epoch;
+    t_output_active = false;
+
+    if (!supported())
+        return;
+
+    const auto debug_message_callback = reinterpret_cast<PFNGLDEBUGMESSAGECALLBACKPROC>(
+        get_gl_proc_address("glDebugMessageCallback"));
+    const auto debug_message_control = reinterpret_cast<PFNGLDEBUGMESSAGECONTROLPROC>(
+        get_gl_proc_address("glDebugMessageControl"));
+
+    if (!debug_message_callback || !debug_message_control)
+        return;
+
+    // only errors are interesting
+    debug_message_control(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, GL_FALSE);
+    debug_message_control(GL_DONT_CARE, GL_DEBUG_TYPE_ERROR, GL_DONT_CARE, 0, nullptr, GL_TRUE);
+    debug_message_callback(debug_callback, ctx);
+    glEnable(GL_DEBUG_OUTPUT);
+    t_output_active = true;
+}
+
+bool
+check_error(const char *where)
+{
+    if (!polling())
+        return report_messages(where);
+
+    bool found = false;
+    GLenum gl_error;
+    while ((gl_error = glGetError()) != GL_NO_ERROR) {
+        traceError("%s: gl error %d\n", where, gl_error);
+        found = true;
+    }
+
+    return found;
+}
+
+AllocationStatus
+checked_allocation(const char *where, const std::function<void()> &alloc)
+{
+    check_error(where);
+
+    if (polling()) {
+        alloc();
+
+        AllocationStatus status = AllocationStatus::kOk;
+        GLenum gl_error;
+        while ((gl_error = glGetError()) != GL_NO_ERROR) {
+            if (gl_error == GL_OUT_OF_MEMORY) {
+                if (status == AllocationStatus::kOk)
+                    status = AllocationStatus::kOutOfMemory;
+            } else {
+                traceError("%s: gl error %d\n", where, gl_error);
+                status = AllocationStatus::kError;
+            }
+        }
+
+        return status;
+    }
+
+    const bool output_active = t_output_active && t_enabled_ctx == current_gl_context() &&
+                               t_enabled_ctx_epoch == gl_state::context_epoch();
+    if (!output_active) {
+        alloc();
+        return AllocationStatus::kOk;
+    }
+
+    std::vector<std::string> captured;
+
+    glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+    t_captured = &captured;
+    alloc();
+    t_captured = nullptr;
+    glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+
+    if (captured.empty())
+        return AllocationStatus::kOk;
+
+    // Messages don't carry error codes, so flags are queried on this rare path only. They may
+    // also hold errors of earlier calls, since nothing polls them in release builds.
+    bool out_of_memory = false;
+    GLenum gl_error;
+    while ((gl_error = glGetError()) != GL_NO_ERROR) {
+        if (gl_error == GL_OUT_OF_MEMORY)
+            out_of_memory = true;
+    }
+
+    if (out_of_memory)
+        return AllocationStatus::kOutOfMemory;
+
+    for (const auto &text: captured)
+        traceError("%s: gl error, %s\n", where, text.c_str());
+
+    return AllocationStatus::kError;
+}
+
+} } // namespace vdp::gl_debug
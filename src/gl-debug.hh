@@ -0,0 +1,64 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <functional>
+
+namespace vdp { namespace gl_debug {
+
+/// Enables GL_KHR_debug output in current context, if supported, so GL errors are reported by
+/// a callback instead of being polled. Does nothing if already done for the context, or if
+/// errors are polled.
+void
+enable_output();
+
+/// Reports GL errors which happened in current context since previous check, tracing them
+/// along with `where`. Returns true if there were any.
+///
+/// In debug builds or with CheckGLErrors quirk, errors are polled with glGetError(), which
+/// may stall until GL catches up. Otherwise only errors delivered by debug output callback
+/// are reported. Delivery is asynchronous, so an error may be attributed to the next checked
+/// call in the same context. Without debug output support release builds don't check at all.
+bool
+check_error(const char *where);
+
+enum class AllocationStatus {
+    kOk,
+    kOutOfMemory,
+    kError,
+};
+
+/// Runs `alloc`, which allocates GL storage, and reports result of that call alone. Errors of
+/// earlier calls are reported under `where` beforehand, so they are neither lost nor blamed on
+/// the allocation. Errors of the allocation are not left for check_error(), so a failed
+/// allocation may be retried. Out of memory is not traced, other errors are.
+///
+/// Polling works as in check_error(). With debug output, the callback is made synchronous for
+/// the duration of the call, so a successful allocation costs no round trip. Without debug
+/// output support release builds assume success.
+AllocationStatus
+checked_allocation(const char *where, const std::function<void()> &alloc);
+
+} } // namespace vdp::gl_debug
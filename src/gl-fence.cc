@@ -0,0 +1,108 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define GL_GLEXT_PROTOTYPES
+#include "gl-fence.hh"
+#include <GL/gl.h>
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+
+
+namespace vdp {
+
+namespace {
+
+std::atomic<bool> g_sync_supported{false};
+
+} // anonymous namespace
+
+void
+GLFence::detect_support()
+{
+    int major = 0;
+    int minor = 0;
+    const char *version = reinterpret_cast<const char *>(glGetString(GL_VERSION));
+    if (version)
+        sscanf(version, "%d.%d", &major, &minor);
+
+    bool supported = major > 3 || (major == 3 && minor >= 2);
+    if (!supported) {
+        const char *ext = reinterpret_cast<const char *>(glGetString(GL_EXTENSIONS));
+        supported = ext && strstr(ext, "GL_ARB_sync");
+    }
+
+    g_sync_supported = supported;
+}
+
+void
+GLFence::set()
+{
+    if (!g_sync_supported) {
+        glFinish();
+        return;
+    }
+
+    release();
+    sync_ = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    // other contexts can wait on the fence only after it was flushed
+    glFlush();
+}
+
+void
+GLFence::wait()
+{
+    if (sync_)
+        glWaitSync(sync_, 0, GL_TIMEOUT_IGNORED);
+}
+
+void
+GLFence::client_wait()
+{
+    if (!sync_)
+        return;
+
+    const GLuint64 timeout_ns = 100 * 1000 * 1000;
+    while (true) {
+        const GLenum res = glClientWaitSync(sync_, GL_SYNC_FLUSH_COMMANDS_BIT, timeout_ns);
+        if (res != GL_TIMEOUT_EXPIRED)
+            break;
+    }
+
+    // once signaled, fence will never block again
+    release();
+}
+
+void
+GLFence::release()
+{
+    if (!sync_)
+        return;
+
+    glDeleteSync(sync_);
+    sync_ = nullptr;
+}
+
+} // namespace vdp
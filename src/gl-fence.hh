@@ -0,0 +1,75 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <GL/gl.h>
+
+
+namespace vdp {
+
+/// Completion marker for GL commands that wrote a resource. Writers set it instead of calling
+/// glFinish(); readers wait on it only when they depend on the result. Waits from another
+/// context are server-side and don't stall the caller. If sync objects are unavailable, set()
+/// falls back to glFinish() and waits do nothing.
+///
+/// Object is protected by the lock of the resource it belongs to. All calls need a current GL
+/// context in the device's share group.
+class GLFence
+{
+public:
+    GLFence()
+        : sync_{nullptr}
+    {}
+
+    GLFence(const GLFence &) = delete;
+
+    GLFence &
+    operator=(const GLFence &) = delete;
+
+    /// marks completion of all commands issued so far in current context
+    void
+    set();
+
+    /// makes current context wait for the marked commands before executing further ones
+    void
+    wait();
+
+    /// blocks calling thread until the marked commands complete
+    void
+    client_wait();
+
+    /// deletes sync object. Must be called before the owner is destroyed.
+    void
+    release();
+
+    /// checks whether sync objects are supported by current context
+    static void
+    detect_support();
+
+private:
+    GLsync  sync_;
+};
+
+} // namespace vdp
@@ -0,0 +1,594 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define GL_GLEXT_PROTOTYPES
+#include "gl-state.hh"
+#include "globals.hh"
+#include "glx-context.hh"
+#include "trace.hh"
+#include <GL/gl.h>
+#include <atomic>
+#include <map>
+#include <math.h>
+#include <mutex>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+
+namespace vdp { namespace gl_state {
+
+namespace {
+
+const int kTextureUnits = 4;
+const GLuint kUnknown = ~0u;
+
+struct State {
+    const void *ctx = nullptr;
+    uint32_t    epoch = 0;
+
+    GLuint      framebuffer;
+    GLuint      array_buffer;
+    GLuint      program;
+    GLenum      active_texture;
+    GLuint      texture[kTextureUnits];
+    int         blend;                          ///< -1 if unknown
+    bool        blend_func_known;
+    GLenum      blend_func[4];
+    bool        blend_equation_known;
+    GLenum      blend_equation[2];
+    bool        viewport_known;
+    GLint       viewport[4];
+    GLenum      matrix_mode;
+    bool        ortho_known;                    ///< also covers identity modelview
+    GLdouble    ortho[4];
+    bool        texture_scale_known[kTextureUnits];
+    GLfloat     texture_scale[kTextureUnits][2];
+
+    void
+    reset()
+    {
+        framebuffer = kUnknown;
+        array_buffer = kUnknown;
+        program = kUnknown;
+        active_texture = kUnknown;
+        for (int k = 0; k < kTextureUnits; k ++) {
+            texture[k] = kUnknown;
+            texture_scale_known[k] = false;
+        }
+        blend = -1;
+        blend_func_known = false;
+        blend_equation_known = false;
+        viewport_known = false;
+        matrix_mode = kUnknown;
+        ortho_known = false;
+    }
+
+    /// index of active texture unit, or -1 if it's unknown or isn't tracked
+    int
+    unit() const
+    {
+        const int idx = static_cast<int>(active_texture - GL_TEXTURE0);
+        return (active_texture != kUnknown && idx >= 0 && idx < kTextureUnits) ? idx : -1;
+    }
+};
+
+std::atomic<uint32_t> g_epoch{0};
+std::atomic<uint32_t> g_context_epoch{0};
+
+// at_context_destroy() callbacks by context, and buffers which couldn't be deleted when their
+// context was destroyed. Both guarded by g_destroy_mtx.
+std::mutex g_destroy_mtx;
+std::map<const void *, std::vector<std::function<void()>>> g_destroy_callbacks;
+std::vector<GLuint> g_pending_buffers;
+std::atomic<bool> g_have_pending_buffers{false};
+
+// set while destroying_context() runs callbacks without a driver context current
+thread_local bool t_postpone_deletes = false;
+
+thread_local State t_state;
+
+void
+delete_pending_buffers()
+{
+    std::vector<GLuint> buffers;
+    {
+        std::unique_lock<std::mutex> lock{g_destroy_mtx};
+        buffers.swap(g_pending_buffers);
+        g_have_pending_buffers.store(false, std::memory_order_relaxed);
+    }
+
+    if (!buffers.empty()) {
+        glDeleteBuffers(static_cast<GLsizei>(buffers.size()), buffers.data());
+        invalidate();
+    }
+}
+
+State &
+current()
+{
+    const void *ctx = current_gl_context();
+    const uint32_t epoch = g_epoch.load(std::memory_order_acquire);
+
+    if (t_state.ctx != ctx || t_state.epoch != epoch) {
+        // deletions are postponed only around context destruction, which also changes epoch,
+        // so it's enough to look for them here. Only driver contexts get here.
+        if (ctx && g_have_pending_buffers.load(std::memory_order_acquire))
+            delete_pending_buffers();
+
+        t_state.reset();
+        t_state.ctx = ctx;
+        t_state.epoch = g_epoch.load(std::memory_order_acquire);
+
+        // make texture unit known so texture bindings can be cached right away
+        if (ctx) {
+            glActiveTexture(GL_TEXTURE0);
+            t_state.active_texture = GL_TEXTURE0;
+        }
+    }
+
+    return t_state;
+}
+
+bool
+verifying()
+{
+    return global.quirks.verify_gl_state;
+}
+
+GLint
+get_integer(GLenum pname)
+{
+    GLint value = 0;
+    glGetIntegerv(pname, &value);
+    return value;
+}
+
+/// traces mismatch between cached and actual values. Returns true if they match.
+bool
+matches(const char *what, long cached, long actual)
+{
+    if (cached == actual)
+        return true;
+
+    traceError("gl_state: cached %s is %ld, but GL reports %ld\n", what, cached, actual);
+    return false;
+}
+
+bool
+matrix_matches(const char *what, GLenum pname, const GLdouble expected[16])
+{
+    GLdouble m[16];
+    glGetDoublev(pname, m);
+
+    for (int k = 0; k < 16; k ++) {
+        if (fabs(m[k] - expected[k]) > 1e-6 * (1.0 + fabs(expected[k]))) {
+            traceError("gl_state: cached %s differs from GL at element %d: %g vs %g\n", what,
+                       k, expected[k], m[k]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+set_matrix_mode(State &s, GLenum mode)
+{
+    if (verifying() && s.matrix_mode != kUnknown &&
+        !matches("matrix mode", s.matrix_mode, get_integer(GL_MATRIX_MODE)))
+    {
+        s.matrix_mode = kUnknown;
+    }
+
+    if (s.matrix_mode == mode)
+        return;
+
+    glMatrixMode(mode);
+    s.matrix_mode = mode;
+}
+
+void
+verify_matrices(State &s)
+{
+    if (s.ortho_known) {
+        const GLdouble l = s.ortho[0], r = s.ortho[1], b = s.ortho[2], t = s.ortho[3];
+        const GLdouble projection[16] = {
+            2 / (r - l),        0,                  0,  0,
+            0,                  2 / (t - b),        0,  0,
+            0,                  0,                 -1,  0,
+            -(r + l) / (r - l), -(t + b) / (t - b), 0,  1,
+        };
+        const GLdouble identity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+
+        if (!matrix_matches("projection matrix", GL_PROJECTION_MATRIX, projection) ||
+            !matrix_matches("modelview matrix", GL_MODELVIEW_MATRIX, identity))
+        {
+            s.ortho_known = false;
+        }
+    }
+
+    const int unit = s.unit();
+    if (unit >= 0 && s.texture_scale_known[unit]) {
+        const GLdouble scale[16] = {
+            s.texture_scale[unit][0], 0, 0, 0,
+            0, s.texture_scale[unit][1], 0, 0,
+            0, 0, 1, 0,
+            0, 0, 0, 1,
+        };
+
+        if (!matrix_matches("texture matrix", GL_TEXTURE_MATRIX, scale))
+            s.texture_scale_known[unit] = false;
+    }
+}
+
+} // anonymous namespace
+
+void
+invalidate()
+{
+    g_epoch.fetch_add(1, std::memory_order_acq_rel);
+}
+
+void
+context_destroyed()
+{
+    g_context_epoch.fetch_add(1, std::memory_order_acq_rel);
+    invalidate();
+}
+
+uint32_t
+context_epoch()
+{
+    return g_context_epoch.load(std::memory_order_acquire);
+}
+
+void
+at_context_destroy(const void *ctx, std::function<void()> fn)
+{
+    std::unique_lock<std::mutex> lock{g_destroy_mtx};
+    g_destroy_callbacks[ctx].push_back(std::move(fn));
+}
+
+void
+destroying_context(const void *ctx, bool objects_reachable)
+{
+    std::vector<std::function<void()>> callbacks;
+    {
+        std::unique_lock<std::mutex> lock{g_destroy_mtx};
+        auto it = g_destroy_callbacks.find(ctx);
+        if (it == g_destroy_callbacks.end())
+            return;
+
+        callbacks.swap(it->second);
+        g_destroy_callbacks.erase(it);
+    }
+
+    t_postpone_deletes = !objects_reachable;
+    try {
+        for (auto &fn: callbacks)
+            fn();
+    } catch (...) {
+        t_postpone_deletes = false;
+        throw;
+    }
+    t_postpone_deletes = false;
+}
+
+void
+share_group_destroyed()
+{
+    std::unique_lock<std::mutex> lock{g_destroy_mtx};
+    g_pending_buffers.clear();
+    g_have_pending_buffers.store(false, std::memory_order_relaxed);
+}
+
+void
+bind_framebuffer(GLuint fbo)
+{
+    State &s = current();
+
+    if (verifying() && s.framebuffer != kUnknown &&
+        !matches("framebuffer binding", s.framebuffer, get_integer(GL_FRAMEBUFFER_BINDING)))
+    {
+        s.framebuffer = kUnknown;
+    }
+
+    if (s.framebuffer == fbo)
+        return;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    s.framebuffer = fbo;
+}
+
+void
+bind_array_buffer(GLuint buffer)
+{
+    State &s = current();
+
+    if (verifying() && s.array_buffer != kUnknown &&
+        !matches("array buffer binding", s.array_buffer, get_integer(GL_ARRAY_BUFFER_BINDING)))
+    {
+        s.array_buffer = kUnknown;
+    }
+
+    if (s.array_buffer == buffer)
+        return;
+
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    s.array_buffer = buffer;
+}
+
+void
+use_program(GLuint program)
+{
+    State &s = current();
+
+    if (verifying() && s.program != kUnknown &&
+        !matches("program", s.program, get_integer(GL_CURRENT_PROGRAM)))
+    {
+        s.program = kUnknown;
+    }
+
+    if (s.program == program)
+        return;
+
+    glUseProgram(program);
+    s.program = program;
+}
+
+void
+active_texture(GLenum unit)
+{
+    State &s = current();
+
+    if (verifying() && s.active_texture != kUnknown &&
+        !matches("active texture", s.active_texture, get_integer(GL_ACTIVE_TEXTURE)))
+    {
+        s.active_texture = kUnknown;
+    }
+
+    if (s.active_texture == unit)
+        return;
+
+    glActiveTexture(unit);
+    s.active_texture = unit;
+}
+
+void
+bind_texture(GLuint tex)
+{
+    State &s = current();
+    const int unit = s.unit();
+
+    if (unit < 0) {
+        glBindTexture(GL_TEXTURE_2D, tex);
+        return;
+    }
+
+    if (verifying() && s.texture[unit] != kUnknown &&
+        !matches("texture binding", s.texture[unit], get_integer(GL_TEXTURE_BINDING_2D)))
+    {
+        s.texture[unit] = kUnknown;
+    }
+
+    if (s.texture[unit] == tex)
+        return;
+
+    glBindTexture(GL_TEXTURE_2D, tex);
+    s.texture[unit] = tex;
+}
+
+void
+set_blend(bool enabled)
+{
+    State &s = current();
+
+    if (verifying() && s.blend != -1 &&
+        !matches("GL_BLEND enable", s.blend, glIsEnabled(GL_BLEND)))
+    {
+        s.blend = -1;
+    }
+
+    if (s.blend == static_cast<int>(enabled))
+        return;
+
+    if (enabled)
+        glEnable(GL_BLEND);
+    else
+        glDisable(GL_BLEND);
+
+    s.blend = enabled;
+}
+
+void
+blend_func(GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha)
+{
+    State &s = current();
+
+    if (verifying() && s.blend_func_known) {
+        s.blend_func_known =
+            matches("blend src rgb", s.blend_func[0], get_integer(GL_BLEND_SRC_RGB)) &&
+            matches("blend dst rgb", s.blend_func[1], get_integer(GL_BLEND_DST_RGB)) &&
+            matches("blend src alpha", s.blend_func[2], get_integer(GL_BLEND_SRC_ALPHA)) &&
+            matches("blend dst alpha", s.blend_func[3], get_integer(GL_BLEND_DST_ALPHA));
+    }
+
+    if (s.blend_func_known && s.blend_func[0] == src_rgb && s.blend_func[1] == dst_rgb &&
+        s.blend_func[2] == src_alpha && s.blend_func[3] == dst_alpha)
+    {
+        return;
+    }
+
+    glBlendFuncSeparate(src_rgb, dst_rgb, src_alpha, dst_alpha);
+    s.blend_func[0] = src_rgb;
+    s.blend_func[1] = dst_rgb;
+    s.blend_func[2] = src_alpha;
+    s.blend_func[3] = dst_alpha;
+    s.blend_func_known = true;
+}
+
+void
+blend_equation(GLenum mode_rgb, GLenum mode_alpha)
+{
+    State &s = current();
+
+    if (verifying() && s.blend_equation_known) {
+        s.blend_equation_known =
+            matches("blend equation rgb", s.blend_equation[0],
+                    get_integer(GL_BLEND_EQUATION_RGB)) &&
+            matches("blend equation alpha", s.blend_equation[1],
+                    get_integer(GL_BLEND_EQUATION_ALPHA));
+    }
+
+    if (s.blend_equation_known && s.blend_equation[0] == mode_rgb &&
+        s.blend_equation[1] == mode_alpha)
+    {
+        return;
+    }
+
+    glBlendEquationSeparate(mode_rgb, mode_alpha);
+    s.blend_equation[0] = mode_rgb;
+    s.blend_equation[1] = mode_alpha;
+    s.blend_equation_known = true;
+}
+
+void
+viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    State &s = current();
+
+    if (verifying() && s.viewport_known) {
+        GLint actual[4];
+        glGetIntegerv(GL_VIEWPORT, actual);
+        for (int k = 0; k < 4 && s.viewport_known; k ++)
+            s.viewport_known = matches("viewport", s.viewport[k], actual[k]);
+    }
+
+    if (s.viewport_known && s.viewport[0] == x && s.viewport[1] == y &&
+        s.viewport[2] == width && s.viewport[3] == height)
+    {
+        return;
+    }
+
+    glViewport(x, y, width, height);
+    s.viewport[0] = x;
+    s.viewport[1] = y;
+    s.viewport[2] = width;
+    s.viewport[3] = height;
+    s.viewport_known = true;
+}
+
+void
+ortho(GLdouble left, GLdouble right, GLdouble bottom, GLdouble top)
+{
+    State &s = current();
+
+    if (verifying())
+        verify_matrices(s);
+
+    if (s.ortho_known && s.ortho[0] == left && s.ortho[1] == right && s.ortho[2] == bottom &&
+        s.ortho[3] == top)
+    {
+        return;
+    }
+
+    set_matrix_mode(s, GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(left, right, bottom, top, -1.0, 1.0);
+
+    set_matrix_mode(s, GL_MODELVIEW);
+    glLoadIdentity();
+
+    s.ortho[0] = left;
+    s.ortho[1] = right;
+    s.ortho[2] = bottom;
+    s.ortho[3] = top;
+    s.ortho_known = true;
+}
+
+void
+texture_scale(GLfloat sx, GLfloat sy)
+{
+    State &s = current();
+
+    if (verifying())
+        verify_matrices(s);
+
+    // texture matrix belongs to the active texture unit
+    const int unit = s.unit();
+    if (unit >= 0 && s.texture_scale_known[unit] && s.texture_scale[unit][0] == sx &&
+        s.texture_scale[unit][1] == sy)
+    {
+        return;
+    }
+
+    set_matrix_mode(s, GL_TEXTURE);
+    glLoadIdentity();
+    if (sx != 1.0f || sy != 1.0f)
+        glScalef(sx, sy, 1.0f);
+
+    if (unit >= 0) {
+        s.texture_scale[unit][0] = sx;
+        s.texture_scale[unit][1] = sy;
+        s.texture_scale_known[unit] = true;
+    }
+}
+
+void
+delete_textures(GLsizei n, const GLuint *textures)
+{
+    glDeleteTextures(n, textures);
+    invalidate();
+}
+
+void
+delete_framebuffers(GLsizei n, const GLuint *framebuffers)
+{
+    glDeleteFramebuffers(n, framebuffers);
+    invalidate();
+}
+
+void
+delete_program(GLuint program)
+{
+    glDeleteProgram(program);
+    invalidate();
+}
+
+void
+delete_buffers(GLsizei n, const GLuint *buffers)
+{
+    if (t_postpone_deletes) {
+        std::unique_lock<std::mutex> lock{g_destroy_mtx};
+        g_pending_buffers.insert(g_pending_buffers.end(), buffers, buffers + n);
+        g_have_pending_buffers.store(true, std::memory_order_release);
+        return;
+    }
+
+    glDeleteBuffers(n, buffers);
+    invalidate();
+}
+
+} } // namespace vdp::gl_state
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <GL/gl.h>
+#include <functional>
+#include <stdint.h>
+
+
+namespace vdp {
+
+/// Cache of the GL state the driver changes on each call: framebuffer, array buffer and program
+/// bindings, 2D texture bindings per texture unit, blending, viewport and fixed-function
+/// matrices. Setters skip GL calls which wouldn't change anything. The cache belongs to the
+/// calling thread and is dropped when thread's current context changes.
+///
+/// All state changes of these kinds must go through here, otherwise cache goes stale. With
+/// VerifyGLState quirk enabled, each setter compares cached value with the one GL reports and
+/// traces mismatches.
+namespace gl_state {
+
+/// drops cached state of all threads. Deleting GL objects or contexts makes names reusable,
+/// so it's called by the delete_* functions below and after destroying a context.
+void
+invalidate();
+
+/// same as invalidate(), and also advances context_epoch(). Called after destroying a context.
+void
+context_destroyed();
+
+/// changes whenever any GL context gets destroyed. Lets per-context data kept elsewhere notice
+/// that its context pointer may have been reused.
+uint32_t
+context_epoch();
+
+/// calls `fn` right before context `ctx` gets destroyed. Lets per-context data release its GL
+/// objects while they are still reachable. Objects must be released with the delete_*
+/// functions below.
+void
+at_context_destroy(const void *ctx, std::function<void()> fn);
+
+/// runs and forgets at_context_destroy() callbacks of `ctx`. Called before destroying any
+/// context the driver made current. `objects_reachable` tells whether a context sharing objects
+/// with `ctx` is current on the calling thread; if not, buffer deletions are postponed until
+/// a driver context becomes current on some thread.
+void
+destroying_context(const void *ctx, bool objects_reachable);
+
+/// forgets postponed deletions. Called after destroying the root context, since its objects
+/// went away along with it.
+void
+share_group_destroyed();
+
+void
+bind_framebuffer(GLuint fbo);
+
+void
+bind_array_buffer(GLuint buffer);
+
+void
+use_program(GLuint program);
+
+/// selects texture unit, `unit` is GL_TEXTURE0 + n
+void
+active_texture(GLenum unit);
+
+/// binds 2D texture to the active texture unit
+void
+bind_texture(GLuint tex);
+
+void
+set_blend(bool enabled);
+
+void
+blend_func(GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha);
+
+void
+blend_equation(GLenum mode_rgb, GLenum mode_alpha);
+
+void
+viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+
+/// sets projection to glOrtho(left, right, bottom, top, -1, 1) and modelview to identity
+void
+ortho(GLdouble left, GLdouble right, GLdouble bottom, GLdouble top);
+
+/// sets texture matrix of the active texture unit to scaling by (sx, sy, 1)
+void
+texture_scale(GLfloat sx, GLfloat sy);
+
+void
+delete_textures(GLsizei n, const GLuint *textures);
+
+void
+delete_framebuffers(GLsizei n, const GLuint *framebuffers);
+
+void
+delete_program(GLuint program);
+
+void
+delete_buffers(GLsizei n, const GLuint *buffers);
+
+} } // namespace vdp::gl_state
@@ -33,6 +33,14 @@ struct global_data {
         int show_watermark;         ///< show picture over output
         int avoid_va;               ///< do not use VA-API video decoding acceleration even if
                                     ///< available
+        int lock_stats;             ///< collect lock wait/hold time statistics
+        int restore_context;        ///< always restore previous GL context, even if there was
+                                    ///< none
+        int render_thread;          ///< execute GL work on per-device render threads
+        int verify_gl_state;        ///< compare cached GL state with the actual one
+        int check_gl_errors;        ///< poll glGetError() after each call, even in release
+                                    ///< builds
+        int egl;                    ///< use EGL instead of GLX, without X display
     } quirks;
 };
 
@@ -28,10 +28,15 @@
 
 #include "api-device.hh"
 #include "compat.hh"
+#include "egl-context.hh"
+#include "gl-debug.hh"
+#include "gl-state.hh"
 #include "globals.hh"
 #include "glx-context.hh"
+#include "lock-stats.hh"
 #include "trace.hh"
 #include <assert.h>
+#include <atomic>
 #include <map>
 #include <mutex>
 #include <stdlib.h>
@@ -44,8 +49,50 @@ using std::vector;
 
 namespace {
 
+// per-thread contexts, guarded by g_glc_map_mutex. That mutex is never held while calling
+// into Xlib or GLX, so it doesn't nest with g_x11_mutex. The map owns contexts, so they all
+// can be destroyed along with the root context; threads find their own through t_glc.
 std::map<thread_id_t, vdp::GLXManagedContext> g_glc_map;
-std::recursive_mutex    g_glc_mutex;
+std::mutex              g_glc_map_mutex;
+
+// incremented each time g_glc_map is cleared, invalidating contexts cached in t_glc
+std::atomic<uint32_t>   g_glc_epoch{0};
+
+/// Context of the current thread. Destroyed at thread exit.
+struct ThreadContext {
+    GLXContext  glc = nullptr;
+    EGLContext  egl_ctx = EGL_NO_CONTEXT;   ///< used instead of glc with EGL backend
+    uint32_t    epoch = 0;
+
+    ~ThreadContext()
+    {
+        if (!glc && egl_ctx == EGL_NO_CONTEXT)
+            return;
+
+        // context is moved out and destroyed after the map mutex is released
+        vector<vdp::GLXManagedContext> ctx;
+        {
+            std::unique_lock<std::mutex> map_lock{g_glc_map_mutex};
+
+            // context was destroyed already, along with the root one
+            if (epoch != g_glc_epoch.load(std::memory_order_relaxed))
+                return;
+
+            auto it = g_glc_map.find(get_current_thread_id());
+            if (it == g_glc_map.end())
+                return;
+
+            ctx.push_back(std::move(it->second));
+            g_glc_map.erase(it);
+        }
+    }
+};
+
+thread_local ThreadContext t_glc;
+
+// serializes Xlib and GLX calls that go through the shared display connection. Also guards
+// root context state below. GL commands themselves are issued without it.
+vdp::ProfiledMutex<std::recursive_mutex> g_x11_mutex{vdp::kLockSiteGLX};
 GLXContext              g_root_glc;
 int                     g_root_glc_refcnt;
 XVisualInfo            *g_root_vi;
@@ -64,6 +111,8 @@ GLXManagedContext::operator=(GLXManagedContext &&that)
 
     glc_ = that.glc_;
     that.glc_ = nullptr;
+    egl_ctx_ = that.egl_ctx_;
+    that.egl_ctx_ = EGL_NO_CONTEXT;
 
     return *this;
 }
@@ -71,25 +120,41 @@ GLXManagedContext::operator=(GLXManagedContext &&that)
 GLXManagedContext::GLXManagedContext(GLXManagedContext &&other)
     : dpy_{}
     , glc_{other.glc_}
+    , egl_ctx_{other.egl_ctx_}
 {
     other.glc_ = nullptr;
+    other.egl_ctx_ = EGL_NO_CONTEXT;
 }
 
 void
 GLXManagedContext::destroy()
 {
+    if (egl_ctx_ != EGL_NO_CONTEXT) {
+        gl_state::destroying_context(egl_ctx_, egl_ctx_ == eglGetCurrentContext());
+        egl::destroy_context(egl_ctx_);
+        gl_state::context_destroyed();
+        egl_ctx_ = EGL_NO_CONTEXT;
+        return;
+    }
+
     if (glc_ == nullptr)
         return;
 
+    // per-context data goes first, while its objects can still be reached through glc_
+    gl_state::destroying_context(glc_, glc_ == glXGetCurrentContext());
+
+    GLXLockGuard guard;
+
     if (glc_ == glXGetCurrentContext())
         glXMakeCurrent(dpy_.get(), None, nullptr);
 
     glXDestroyContext(dpy_.get(), glc_);
+    gl_state::context_destroyed();
 
     glc_ = nullptr;
 }
 
-GLXThreadLocalContext::GLXThreadLocalContext(std::shared_ptr<vdp::Device::Resource> device,
+GLXThreadLocalContext::GLXThreadLocalContext(const ResourcePtr<vdp::Device::Resource> &device,
                                              bool restore_previous_context)
     : GLXThreadLocalContext(device->root, restore_previous_context)
 {
@@ -98,12 +163,16 @@ GLXThreadLocalContext::GLXThreadLocalContext(std::shared_ptr<vdp::Device::Resour
 GLXThreadLocalContext::GLXThreadLocalContext(Window wnd, bool restore_previous_context)
     : restore_previous_context_(restore_previous_context)
 {
-    g_glc_mutex.lock();
+    if (egl::enabled()) {
+        make_current_egl();
+        return;
+    }
 
     XDisplayRef       dpy_ref{};
     Display *const    dpy = dpy_ref.get();
     const thread_id_t thread_id = get_current_thread_id();
 
+    // current context is a per-thread property, no locking needed to query it
     prev_dpy_ = glXGetCurrentDisplay();
     if (!prev_dpy_)
         prev_dpy_ = dpy;
@@ -111,60 +180,141 @@ GLXThreadLocalContext::GLXThreadLocalContext(Window wnd, bool restore_previous_c
     prev_wnd_ = glXGetCurrentDrawable();
     prev_glc_ = glXGetCurrentContext();
 
-    GLXContext glc;
-    auto val = g_glc_map.find(thread_id);
-    if (val == g_glc_map.end()) {
-        glc = glXCreateContext(dpy, g_root_vi, g_root_glc, GL_TRUE);
-        assert(glc);
+    const uint32_t epoch = g_glc_epoch.load(std::memory_order_acquire);
+    GLXContext     glc = (t_glc.epoch == epoch) ? t_glc.glc : nullptr;
+    const bool     created = !glc;
 
-        g_glc_map.emplace(thread_id, GLXManagedContext(glc));
+    if (!glc) {
+        {
+            GLXLockGuard guard;
 
-        // find which threads are not alive already
-        vector<thread_id_t> dead_threads;
-        for (const auto &it: g_glc_map)
-            if (not thread_is_alive(it.first))
-                dead_threads.push_back(it.first);
+            glc = glXCreateContext(dpy, g_root_vi, g_root_glc, GL_TRUE);
+            assert(glc);
+        }
 
-        // and delete every context associated with them
-        for (const auto &it: dead_threads)
-            g_glc_map.erase(it);
+        std::unique_lock<std::mutex> map_lock{g_glc_map_mutex};
+
+        g_glc_map.emplace(thread_id, GLXManagedContext(glc));
+        t_glc.glc = glc;
+        t_glc.epoch = g_glc_epoch.load(std::memory_order_relaxed);
+    }
 
-    } else {
-        glc = val->second.get();
+    // glXMakeCurrent is expensive even when nothing changes, skip it if the thread already has
+    // the right context bound to the right drawable
+    switched_ = prev_glc_ != glc || prev_wnd_ != wnd || prev_dpy_ != dpy;
+    if (switched_) {
+        GLXLockGuard guard;
+        glXMakeCurrent(dpy, wnd, glc);
     }
 
-    glXMakeCurrent(dpy, wnd, glc);
+    if (created)
+        gl_debug::enable_output();
 }
 
 GLXThreadLocalContext::~GLXThreadLocalContext()
 {
-    if (restore_previous_context_)
-        glXMakeCurrent(prev_dpy_, prev_wnd_, prev_glc_);
-    else
+    if (egl::enabled()) {
+        restore_egl();
+        return;
+    }
+
+    if (!restore_previous_context_) {
+        GLXLockGuard guard;
         glXMakeCurrent(prev_dpy_, None, nullptr);
+        return;
+    }
+
+    if (!switched_)
+        return;
+
+    // If thread had no context before, leave ours bound, so the next call on this thread
+    // doesn't have to switch again. Applications that expect to find no context current
+    // can ask for exact restoration with a quirk.
+    if (!prev_glc_ && !global.quirks.restore_context)
+        return;
+
+    GLXLockGuard guard;
+    glXMakeCurrent(prev_dpy_, prev_wnd_, prev_glc_);
+}
+
+void
+GLXThreadLocalContext::make_current_egl()
+{
+    prev_egl_ = egl::current_binding();
 
-    g_glc_mutex.unlock();
+    const uint32_t epoch = g_glc_epoch.load(std::memory_order_acquire);
+    EGLContext     ctx = (t_glc.epoch == epoch) ? t_glc.egl_ctx : EGL_NO_CONTEXT;
+    const bool     created = (ctx == EGL_NO_CONTEXT);
+
+    if (created) {
+        ctx = egl::create_context();
+        if (ctx == EGL_NO_CONTEXT) {
+            traceError("GLXThreadLocalContext::make_current_egl(): can't create context\n");
+            throw std::bad_alloc();
+        }
+
+        std::unique_lock<std::mutex> map_lock{g_glc_map_mutex};
+
+        g_glc_map.emplace(get_current_thread_id(), GLXManagedContext(ctx));
+        t_glc.egl_ctx = ctx;
+        t_glc.epoch = g_glc_epoch.load(std::memory_order_relaxed);
+    }
+
+    // all contexts use the same surface, so only the context itself can differ
+    switched_ = prev_egl_.ctx != ctx;
+    if (switched_)
+        egl::make_current(ctx);
+
+    if (created)
+        gl_debug::enable_output();
+}
+
+void
+GLXThreadLocalContext::restore_egl()
+{
+    if (!restore_previous_context_) {
+        egl::release();
+        return;
+    }
+
+    if (!switched_)
+        return;
+
+    if (prev_egl_.ctx == EGL_NO_CONTEXT && !global.quirks.restore_context)
+        return;
+
+    egl::restore(prev_egl_);
 }
 
 GLXLockGuard::GLXLockGuard()
 {
-    g_glc_mutex.lock();
+    g_x11_mutex.lock();
 }
 
 GLXLockGuard::~GLXLockGuard()
 {
-    g_glc_mutex.unlock();
+    g_x11_mutex.unlock();
 }
 
 GLXGlobalContext::GLXGlobalContext(Display *dpy, int screen)
     : dpy_{dpy}
 {
-    std::unique_lock<decltype(g_glc_mutex)> lock{g_glc_mutex};
+    GLXLockGuard guard;
 
     g_root_glc_refcnt += 1;
     if (g_root_glc_refcnt > 1)
         return;
 
+    if (egl::enabled()) {
+        try {
+            egl::initialize();
+        } catch (...) {
+            g_root_glc_refcnt -= 1;
+            throw;
+        }
+        return;
+    }
+
     GLint att[] = { GLX_RGBA, GLX_DEPTH_SIZE, 24, GLX_DOUBLEBUFFER, None };
 
     g_root_vi = glXChooseVisual(dpy, screen, att);
@@ -181,20 +331,49 @@ GLXGlobalContext::GLXGlobalContext(Display *dpy, int screen)
 GLXGlobalContext::~GLXGlobalContext()
 {
     try {
-        std::unique_lock<decltype(g_glc_mutex)> lock{g_glc_mutex};
-
-        g_root_glc_refcnt -= 1;
+        {
+            GLXLockGuard guard;
+
+            g_root_glc_refcnt -= 1;
+            if (g_root_glc_refcnt > 0)
+                return;
+
+            if (egl::enabled()) {
+                // EGL display owns all the contexts, so it goes after them. Kept under the
+                // lock, so a new device can't initialize EGL in between.
+                {
+                    std::map<thread_id_t, GLXManagedContext> contexts;
+                    {
+                        std::unique_lock<std::mutex> map_lock{g_glc_map_mutex};
+                        contexts.swap(g_glc_map);
+                        g_glc_epoch.fetch_add(1, std::memory_order_release);
+                    }
+                }
+
+                egl::terminate();
+                gl_state::context_destroyed();
+                gl_state::share_group_destroyed();
+                return;
+            }
 
-        if (g_root_glc_refcnt <= 0) {
             // destroying global GL context
             glXMakeCurrent(dpy_, None, nullptr);
             glXDestroyContext(dpy_, g_root_glc);
+            gl_state::context_destroyed();
             XFree(g_root_vi);
+        }
 
-            // destroying all per-thread GL contexts
-            g_glc_map.clear();
+        // destroying all per-thread GL contexts, outside of the map mutex
+        std::map<thread_id_t, GLXManagedContext> contexts;
+        {
+            std::unique_lock<std::mutex> map_lock{g_glc_map_mutex};
+            contexts.swap(g_glc_map);
+            g_glc_epoch.fetch_add(1, std::memory_order_release);
         }
 
+        contexts.clear();
+        gl_state::share_group_destroyed();
+
     } catch (...) {
         traceError("GLXGlobalContext::~GLXGlobalContext(): caught exception\n");
     }
@@ -203,7 +382,7 @@ GLXGlobalContext::~GLXGlobalContext()
 GLXContext
 GLXGlobalContext::get() const
 {
-    std::unique_lock<decltype(g_glc_mutex)> lock{g_glc_mutex};
+    GLXLockGuard guard;
 
     if (g_root_glc_refcnt > 0)
         return g_root_glc;
@@ -211,6 +390,37 @@ GLXGlobalContext::get() const
         return nullptr;
 }
 
+const void *
+current_gl_context()
+{
+    if (egl::enabled())
+        return eglGetCurrentContext();
+
+    return glXGetCurrentContext();
+}
+
+void
+release_current_gl_context()
+{
+    if (egl::enabled()) {
+        egl::release();
+        return;
+    }
+
+    GLXLockGuard guard;
+    XDisplayRef  dpy_ref{};
+    glXMakeCurrent(dpy_ref.get(), None, nullptr);
+}
+
+void *
+get_gl_proc_address(const char *name)
+{
+    if (egl::enabled())
+        return egl::get_proc_address(name);
+
+    return reinterpret_cast<void *>(glXGetProcAddress(reinterpret_cast<const GLubyte *>(name)));
+}
+
 } // namespace vdp
 
 static
@@ -24,7 +24,10 @@
 
 #pragma once
 
+#include "api.hh"
+#include "egl-context.hh"
 #include "x-display-ref.hh"
+#include <EGL/egl.h>
 #include <GL/glx.h>
 #include <X11/Xlib.h>
 #include <memory>
@@ -38,6 +41,7 @@ struct Resource;
 
 } // namespace Device
 
+/// Owns a per-thread context, either GLX or EGL one, depending on the backend.
 class GLXManagedContext
 {
 public:
@@ -45,6 +49,14 @@ public:
     GLXManagedContext(GLXContext glc)
         : dpy_{}
         , glc_{glc}
+        , egl_ctx_{EGL_NO_CONTEXT}
+    {}
+
+    explicit
+    GLXManagedContext(EGLContext egl_ctx)
+        : dpy_{}
+        , glc_{nullptr}
+        , egl_ctx_{egl_ctx}
     {}
 
     GLXManagedContext(GLXManagedContext &&other);
@@ -63,6 +75,7 @@ public:
 private:
     XDisplayRef dpy_;
     GLXContext  glc_;
+    EGLContext  egl_ctx_;
 
     void
     destroy();
@@ -75,7 +88,7 @@ public:
     GLXThreadLocalContext(Window wnd, bool restore_previous_context = true);
 
     explicit
-    GLXThreadLocalContext(std::shared_ptr<vdp::Device::Resource> device,
+    GLXThreadLocalContext(const ResourcePtr<vdp::Device::Resource> &device,
                           bool restore_previous_context = true);
 
     ~GLXThreadLocalContext();
@@ -89,9 +102,19 @@ private:
     Display   *prev_dpy_;
     Window     prev_wnd_;
     GLXContext prev_glc_;
+    egl::Binding prev_egl_; ///< previous binding, if EGL backend is used
     bool       restore_previous_context_;
+    bool       switched_;   ///< whether constructor had to call glXMakeCurrent
+
+    void
+    make_current_egl();
+
+    void
+    restore_egl();
 };
 
+/// Serializes Xlib and GLX calls made through the shared display connection. GL commands
+/// issued in per-thread contexts don't need it.
 class GLXLockGuard
 {
 public:
@@ -116,6 +139,18 @@ private:
     Display    *dpy_;
 };
 
+/// current context of the calling thread, from whichever backend is in use. Only meant for
+/// comparisons, identifies contexts for per-context caches.
+const void *
+current_gl_context();
+
+/// releases current context of the calling thread
+void
+release_current_gl_context();
+
+void *
+get_gl_proc_address(const char *name);
+
 } // namespace vdp
 
 void
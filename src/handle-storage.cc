@@ -30,22 +30,26 @@
 #include "api-video-surface.hh"
 #include "api.hh"
 #include "handle-storage.hh"
-#include <atomic>
 
 
 namespace {
 
 struct {
-    vdp::ResourceStorage<vdp::BitmapSurface::Resource>  bitmap_surface;
-    vdp::ResourceStorage<vdp::Device::Resource>         device;
-
-    vdp::ResourceStorage<vdp::OutputSurface::Resource>           output_surface;
-    vdp::ResourceStorage<vdp::PresentationQueue::Resource>       presentation_queue;
-    vdp::ResourceStorage<vdp::PresentationQueue::TargetResource> presentation_queue_target;
-
-    vdp::ResourceStorage<vdp::Decoder::Resource>      video_decoder;
-    vdp::ResourceStorage<vdp::VideoMixer::Resource>   video_mixer;
-    vdp::ResourceStorage<vdp::VideoSurface::Resource> video_surface;
+    vdp::ResourceStorage<vdp::BitmapSurface::Resource>  bitmap_surface{
+        vdp::kResourceTypeBitmapSurface};
+    vdp::ResourceStorage<vdp::Device::Resource>         device{vdp::kResourceTypeDevice};
+
+    vdp::ResourceStorage<vdp::OutputSurface::Resource>           output_surface{
+        vdp::kResourceTypeOutputSurface};
+    vdp::ResourceStorage<vdp::PresentationQueue::Resource>       presentation_queue{
+        vdp::kResourceTypePresentationQueue};
+    vdp::ResourceStorage<vdp::PresentationQueue::TargetResource> presentation_queue_target{
+        vdp::kResourceTypePresentationQueueTarget};
+
+    vdp::ResourceStorage<vdp::Decoder::Resource>      video_decoder{vdp::kResourceTypeDecoder};
+    vdp::ResourceStorage<vdp::VideoMixer::Resource>   video_mixer{vdp::kResourceTypeVideoMixer};
+    vdp::ResourceStorage<vdp::VideoSurface::Resource> video_surface{
+        vdp::kResourceTypeVideoSurface};
 } storage;
 
 } // anonymous namespace
@@ -53,13 +57,6 @@ struct {
 
 namespace vdp {
 
-uint32_t
-get_resource_id()
-{
-    static std::atomic<uint32_t> id{300000};
-    return ++id;
-}
-
 template<>
 vdp::ResourceStorage<vdp::BitmapSurface::Resource> &
 vdp::ResourceStorage<vdp::BitmapSurface::Resource>::instance()
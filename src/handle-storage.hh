@@ -26,10 +26,14 @@
 
 #include "api-device.hh"
 #include "exceptions.hh"
-#include <map>
+#include "lock-stats.hh"
+#include "trace.hh"
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <memory>
 #include <mutex>
-#include <unistd.h>
+#include <thread>
 #include <vdpau/vdpau.h>
 #include <vector>
 
@@ -69,95 +73,557 @@ check_for_exceptions(callable fwd, Args... args)
     }
 }
 
-// TODO: what to do when it flips over uint32_t limit?
-uint32_t
-get_resource_id();
+/// Resource type tags, stored in the upper bits of every handle. Zero is never used, so neither
+/// 0 nor VDP_INVALID_HANDLE can ever be produced by ResourceStorage.
+enum ResourceType: uint32_t {
+    kResourceTypeDevice = 1,
+    kResourceTypeBitmapSurface,
+    kResourceTypeDecoder,
+    kResourceTypeOutputSurface,
+    kResourceTypePresentationQueue,
+    kResourceTypePresentationQueueTarget,
+    kResourceTypeVideoMixer,
+    kResourceTypeVideoSurface,
+};
+
+// Handle layout: [31..28] type tag, [27..12] slot index, [11..0] slot generation.
+//
+// Handles are 32-bit, so each resource type gets 2^16 slots of 4095 generations, about 268M
+// handles in total, before a stale handle can match a live one. After that, slots which used up
+// their generations are recycled, oldest first, and aliasing becomes possible again.
+const uint32_t kHandleGenerationBits = 12;
+const uint32_t kHandleIndexBits =      16;
+const uint32_t kHandleGenerationMask = (1u << kHandleGenerationBits) - 1;
+const uint32_t kHandleIndexMask =      (1u << kHandleIndexBits) - 1;
+const uint32_t kHandleTagShift =       kHandleGenerationBits + kHandleIndexBits;
+
+inline uint32_t
+handle_type(uint32_t handle)
+{
+    return handle >> kHandleTagShift;
+}
 
+/// Handle table. Every handle refers to a slot in a chunked array; slot generation is bumped on
+/// each reuse, so stale handles do not match anything. Slots are retired once their generation
+/// runs out, and recycled only when no other slot is left. Lookups do not take any locks, they
+/// only pin the slot for the time needed to copy the pointer out. insert() and drop() serialize on
+/// a mutex.
+///
+/// Storage holds one reference to each resource. While a resource is locked, that reference is
+/// not released even if the resource is dropped, so lock holders may use plain pointers.
 template <class T>
 class ResourceStorage
 {
 public:
+    explicit
+    ResourceStorage(ResourceType type)
+        : type_{type}
+        , slot_count_{0}
+        , wrapped_{false}
+    {
+        for (auto &chunk: chunks_)
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~ResourceStorage()
+    {
+        for (auto &chunk: chunks_)
+            delete[] chunk.load(std::memory_order_relaxed);
+    }
+
+    ResourceStorage(const ResourceStorage &) = delete;
+
+    ResourceStorage &
+    operator=(const ResourceStorage &) = delete;
+
     uint32_t
-    insert(std::shared_ptr<T> res)
+    insert(ResourcePtr<T> res)
     {
         std::unique_lock<decltype(mtx_)> lock(mtx_);
-        auto id = get_resource_id();
-        res->id = id;
-        map_.insert(std::make_pair(id, res));
-        return id;
+
+        uint32_t idx;
+        if (!free_.empty()) {
+            // reuse the slot that was freed longest ago, so slots run out of generations evenly
+            idx = free_.front();
+            free_.pop_front();
+
+        } else if (slot_count_ > kHandleIndexMask) {
+            if (retired_.empty())
+                throw std::bad_alloc();
+
+            if (!wrapped_) {
+                traceError("ResourceStorage::insert(): handle space of type %u exhausted, "
+                           "recycling handles\n", static_cast<uint32_t>(type_));
+                wrapped_ = true;
+            }
+
+            idx = retired_.front();
+            retired_.pop_front();
+            slot_at(idx).generation = 0;
+
+        } else {
+            idx = slot_count_;
+            if (idx % kChunkSize == 0)
+                chunks_[idx / kChunkSize].store(new Slot[kChunkSize], std::memory_order_release);
+
+            slot_count_ += 1;
+        }
+
+        Slot &slot = slot_at(idx);
+
+        // starts from 1, exhausted slots are retired rather than wrapped
+        slot.generation += 1;
+
+        const uint32_t handle = (static_cast<uint32_t>(type_) << kHandleTagShift) |
+                                (idx << kHandleGenerationBits) | slot.generation;
+        res->id = handle;
+
+        // registry lock nests inside the storage lock, never the other way around
+        if (res->device)
+            res->device->children.add(res.get());
+
+        slot.res = std::move(res);
+        slot.state.store(static_cast<uint64_t>(handle) << 32, std::memory_order_release);
+
+        return handle;
     }
 
-    std::shared_ptr<T>
+    /// returns nullptr for unknown and stale handles
+    ResourcePtr<T>
     find(uint32_t handle)
     {
-        std::unique_lock<decltype(mtx_)> lock(mtx_);
+        Slot *slot = lookup_slot(handle);
+        if (!slot || !pin(slot, handle))
+            return nullptr;
 
-        auto res = map_.find(handle);
-        if (res == map_.end())
-            throw vdp::resource_not_found();
+        ResourcePtr<T> res = slot->res;
+        unpin(slot);
 
-        return res->second;
+        return res;
     }
 
+    /// Locks resource if its lock is free, without taking a reference. Returns nullptr if
+    /// handle is invalid or lock is busy. Resource stays valid until it's unlocked.
+    T *
+    try_lock(uint32_t handle)
+    {
+        Slot *slot = lookup_slot(handle);
+        if (!slot || !pin(slot, handle))
+            return nullptr;
+
+        // drop() waits for pins to go away, so the pointer can't be released meanwhile
+        T *res = slot->res.get();
+        const bool locked = res->mtx.try_lock();
+        unpin(slot);
+
+        return locked ? res : nullptr;
+    }
+
+    bool
+    is_live(uint32_t handle)
+    {
+        Slot *slot = lookup_slot(handle);
+        if (!slot)
+            return false;
+
+        return (slot->state.load(std::memory_order_acquire) >> 32) == handle;
+    }
+
+    /// Removes resource from the storage. Storage reference is released when the resource gets
+    /// unlocked, since other code (including the caller) may still use borrowed pointers.
     void
     drop(uint32_t handle)
     {
-        std::unique_lock<decltype(mtx_)> lock(mtx_);
-        map_.erase(handle);
+        ResourcePtr<T> res;
+
+        {
+            std::unique_lock<decltype(mtx_)> lock(mtx_);
+
+            Slot *slot = lookup_slot(handle);
+            if (!slot)
+                return;
+
+            uint64_t state = slot->state.load(std::memory_order_relaxed);
+            do {
+                if ((state >> 32) != handle)
+                    return;
+            } while (!slot->state.compare_exchange_weak(state, state & kPinMask,
+                                                        std::memory_order_acq_rel,
+                                                        std::memory_order_relaxed));
+
+            // no new pins are possible now, wait for find() calls that are copying the pointer
+            while ((slot->state.load(std::memory_order_acquire) & kPinMask) != 0)
+                std::this_thread::yield();
+
+            res = std::move(slot->res);
+            if (res->device)
+                res->device->children.remove(res.get());
+
+            // A slot that used up all generations is retired, and only gets reused once the
+            // whole handle space is exhausted.
+            const uint32_t idx = (handle >> kHandleGenerationBits) & kHandleIndexMask;
+            if (slot->generation != kHandleGenerationMask)
+                free_.push_back(idx);
+            else
+                retired_.push_back(idx);
+        }
+
+        // Lock is recursive, and it's usually already held by the caller. Release happens outside
+        // of the storage lock, since destructors may be heavy and may need the storage themselves.
+        res->mtx.lock();
+        res->release_on_unlock = true;
+        unlock_resource(res.detach());
     }
 
     std::vector<uint32_t>
     enumerate()
     {
+        std::unique_lock<decltype(mtx_)> lock(mtx_);
         std::vector<uint32_t> v;
-        for (const auto &it: map_)
-            v.push_back(it.first);
+
+        for (uint32_t idx = 0; idx < slot_count_; idx ++) {
+            const uint64_t state = slot_at(idx).state.load(std::memory_order_relaxed);
+            if ((state >> 32) != 0)
+                v.push_back(state >> 32);
+        }
+
         return v;
     }
 
+    ResourceType
+    type() const { return type_; }
+
     static ResourceStorage<T> &
     instance();
 
 private:
-    std::recursive_mutex                    mtx_;
-    std::map<uint32_t, std::shared_ptr<T>>  map_;
+    static const uint32_t kChunkSize =  256;
+    static const uint32_t kChunkCount = (kHandleIndexMask + 1) / kChunkSize;
+    static const uint64_t kPinMask =    0xffffffffu;
+
+    struct Slot
+    {
+        Slot()
+            : state{0}
+            , generation{0}
+        {}
+
+        std::atomic<uint64_t>   state;      ///< live handle in upper half, pin count in lower
+        ResourcePtr<T>          res;
+        uint32_t                generation; ///< last generation, guarded by mtx_
+    };
+
+    static bool
+    pin(Slot *slot, uint32_t handle)
+    {
+        uint64_t state = slot->state.load(std::memory_order_acquire);
+        do {
+            if ((state >> 32) != handle)
+                return false;
+        } while (!slot->state.compare_exchange_weak(state, state + 1, std::memory_order_acquire,
+                                                    std::memory_order_acquire));
+
+        return true;
+    }
+
+    static void
+    unpin(Slot *slot)
+    {
+        slot->state.fetch_sub(1, std::memory_order_release);
+    }
+
+    Slot &
+    slot_at(uint32_t idx)
+    {
+        return chunks_[idx / kChunkSize].load(std::memory_order_acquire)[idx % kChunkSize];
+    }
+
+    Slot *
+    lookup_slot(uint32_t handle)
+    {
+        if (handle_type(handle) != type_)
+            return nullptr;
+
+        const uint32_t idx = (handle >> kHandleGenerationBits) & kHandleIndexMask;
+        Slot *chunk = chunks_[idx / kChunkSize].load(std::memory_order_acquire);
+        if (!chunk)
+            return nullptr;
+
+        return &chunk[idx % kChunkSize];
+    }
+
+    const ResourceType      type_;
+    std::mutex              mtx_;
+    std::atomic<Slot *>     chunks_[kChunkCount];
+    uint32_t                slot_count_;    ///< slots ever allocated, guarded by mtx_
+    std::deque<uint32_t>    free_;          ///< indices of free slots, guarded by mtx_
+    std::deque<uint32_t>    retired_;       ///< free slots out of generations, guarded by mtx_
+    bool                    wrapped_;       ///< retired slots were reused, guarded by mtx_
 };
 
+static_assert(kLockSiteVideoSurface == kResourceTypeVideoSurface - kResourceTypeDevice,
+              "resource lock sites must follow ResourceType order");
+
+/// Locked reference to a resource. If the lock is free, the resource is borrowed without touching
+/// its reference counter. Otherwise a reference is held while waiting for the lock.
 template<class T>
 class ResourceRef
 {
 public:
     explicit ResourceRef(uint32_t handle)
+        : locked_at_{0}
     {
         auto &storage = ResourceStorage<T>::instance();
-        while (true) {
-            auto res = storage.find(handle);
-            if (res->mtx.try_lock()) {
-                res_ = res;
-                return;
+        const uint64_t t0 = lock_stats::enabled() ? lock_stats::now_ns() : 0;
+
+        res_ = storage.try_lock(handle);
+        if (!res_) {
+            ResourcePtr<T> res = storage.find(handle);
+            if (!res)
+                throw vdp::resource_not_found();
+
+            res->mtx.lock();
+
+            // resource could have been destroyed while we were waiting for the lock
+            if (!storage.is_live(handle)) {
+                unlock_resource(res.get());
+                throw vdp::resource_not_found();
             }
-            usleep(1);
+
+            // from now on storage reference keeps it alive
+            res_ = res.get();
+        }
+
+        if (t0 != 0) {
+            locked_at_ = lock_stats::now_ns();
+            lock_stats::record_wait(lock_site(), locked_at_ - t0);
         }
     }
 
     ~ResourceRef()
     {
-        res_->mtx.unlock();
+        if (locked_at_ != 0)
+            lock_stats::record_hold(lock_site(), lock_stats::now_ns() - locked_at_);
+
+        unlock_resource(res_);
     }
 
+    ResourceRef(const ResourceRef &) = delete;
+
     ResourceRef &
     operator=(const ResourceRef &) = delete;
 
-    std::shared_ptr<T>
+    /// returns owning pointer, for storing resource elsewhere
+    ResourcePtr<T>
+    get_ref() const { return ResourcePtr<T>(res_); }
+
+    T *
+    get() const { return res_; }
+
+    T *
+    operator->() const { return res_; }
+
+    operator ResourcePtr<T>() const { return get_ref(); }
+
+private:
+    static LockSite
+    lock_site()
+    {
+        return static_cast<LockSite>(ResourceStorage<T>::instance().type() - kResourceTypeDevice);
+    }
+
+    T          *res_;
+    uint64_t    locked_at_; ///< lock acquisition time, if lock stats are enabled
+};
+
+/// Locks several resources at once. Resources are looked up by add() and then locked by
+/// acquire() in ascending handle order, so concurrent calls working on overlapping sets of
+/// resources can't deadlock each other. Duplicate handles are locked only once.
+class ResourceRefSet
+{
+public:
+    ResourceRefSet()
+        : locked_{false}
+    {}
+
+    ~ResourceRefSet()
+    {
+        release();
+    }
+
+    ResourceRefSet(const ResourceRefSet &) = delete;
+
+    ResourceRefSet &
+    operator=(const ResourceRefSet &) = delete;
+
+    /// Looks up resource, throws resource_not_found if there is none. Must be called before
+    /// acquire(). Returned pointer is valid while the set exists.
+    template<class T>
+    T *
+    add(uint32_t handle)
+    {
+        for (const auto &entry: entries_)
+            if (entry.handle == handle)
+                return static_cast<T *>(entry.res.get());
+
+        ResourcePtr<T> res = ResourceStorage<T>::instance().find(handle);
+        if (!res)
+            throw vdp::resource_not_found();
+
+        entries_.push_back(Entry{handle, ResourcePtr<GenericResource>(res.get()), &is_live<T>, 0});
+        return res.get();
+    }
+
+    /// locks all added resources, throws resource_not_found if any of them was destroyed
+    /// meanwhile
+    void
+    acquire()
+    {
+        std::sort(entries_.begin(), entries_.end(),
+                  [](const Entry &a, const Entry &b) { return a.handle < b.handle; });
+
+        for (auto &entry: entries_) {
+            if (lock_stats::enabled()) {
+                const uint64_t t0 = lock_stats::now_ns();
+                entry.res->mtx.lock();
+                entry.locked_at = lock_stats::now_ns();
+                lock_stats::record_wait(lock_site(entry.handle), entry.locked_at - t0);
+            } else {
+                entry.res->mtx.lock();
+            }
+        }
+
+        locked_ = true;
+
+        for (const auto &entry: entries_) {
+            if (!entry.is_live(entry.handle)) {
+                release();
+                throw vdp::resource_not_found();
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        uint32_t                            handle;
+        ResourcePtr<GenericResource>        res;
+        bool                              (*is_live)(uint32_t handle);
+        uint64_t                            locked_at;  ///< for lock stats
+    };
+
+    template<class T>
+    static bool
+    is_live(uint32_t handle)
+    {
+        return ResourceStorage<T>::instance().is_live(handle);
+    }
+
+    static LockSite
+    lock_site(uint32_t handle)
+    {
+        return static_cast<LockSite>(handle_type(handle) - kResourceTypeDevice);
+    }
+
+    void
+    release()
+    {
+        if (!locked_)
+            return;
+
+        for (auto it = entries_.rbegin(); it != entries_.rend(); ++ it) {
+            if (it->locked_at != 0)
+                lock_stats::record_hold(lock_site(it->handle),
+                                        lock_stats::now_ns() - it->locked_at);
+
+            unlock_resource(it->res.get());
+        }
+
+        locked_ = false;
+    }
+
+    std::vector<Entry>  entries_;
+    bool                locked_;
+};
+
+/// Reference to a resource that does not take its lock. Use only for reading fields that never
+/// change after creation, or that are synchronized by other means (atomics, dedicated mutexes).
+template<class T>
+class SharedResourceRef
+{
+public:
+    explicit SharedResourceRef(uint32_t handle)
+        : res_{ResourceStorage<T>::instance().find(handle)}
+    {
+        if (!res_)
+            throw vdp::resource_not_found();
+    }
+
+    SharedResourceRef &
+    operator=(const SharedResourceRef &) = delete;
+
+    ResourcePtr<T>
     get_ref() const { return res_; }
 
     T *
     operator->() const { return res_.get(); }
 
-    operator std::shared_ptr<T>() const { return res_; }
-
 private:
-    std::shared_ptr<T> res_;
+    ResourcePtr<T> res_;
 };
 
+template <class T>
+RenderThread *
+render_thread_of(T *res)
+{
+    return res->device->render_thread.get();
+}
+
+inline RenderThread *
+render_thread_of(Device::Resource *res)
+{
+    return res->render_thread.get();
+}
+
+/// Finds resource, but only if its device has a render thread. Returns null otherwise, and also
+/// without any lookup if RenderThread quirk is off.
+template <class T>
+ResourcePtr<T>
+find_with_render_thread(uint32_t handle)
+{
+    if (!global.quirks.render_thread)
+        return nullptr;
+
+    auto res = ResourceStorage<T>::instance().find(handle);
+    if (!res || !render_thread_of(res.get()))
+        return nullptr;
+
+    return res;
+}
+
+/// Calls API implementation on the render thread of the device that owns resource, waiting for
+/// the result. Without a render thread, calls it directly. No locks must be held by the caller.
+template <class T, class callable, typename... Args>
+VdpStatus
+call_on_render_thread(uint32_t handle, callable fwd, Args... args)
+{
+    if (auto res = find_with_render_thread<T>(handle)) {
+        VdpStatus status = VDP_STATUS_ERROR;
+        render_thread_of(res.get())->run([&] () {
+            status = check_for_exceptions(fwd, args...);
+        });
+        return status;
+    }
+
+    return check_for_exceptions(fwd, args...);
+}
+
+/// waits for completion of commands queued on the render thread of resource's device
+template <class T>
+void
+sync_render_thread(uint32_t handle)
+{
+    if (auto res = find_with_render_thread<T>(handle))
+        render_thread_of(res.get())->sync();
+}
+
 } // namespace vdp
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "lock-stats.hh"
+#include "trace.hh"
+#include <atomic>
+#include <signal.h>
+#include <time.h>
+
+
+namespace {
+
+// bucket k counts durations in [2^(k-1), 2^k) ns, bucket 0 counts zero durations
+const int kBucketCount = 40;
+
+struct Histogram {
+    std::atomic<uint64_t>   count;
+    std::atomic<uint64_t>   total_ns;
+    std::atomic<uint64_t>   max_ns;
+    std::atomic<uint64_t>   buckets[kBucketCount];
+};
+
+struct SiteStats {
+    Histogram   wait;
+    Histogram   hold;
+};
+
+// zero-initialized, since it has static storage duration
+SiteStats g_site_stats[vdp::kLockSiteCount];
+
+std::atomic<bool> g_dump_requested{false};
+
+const char *site_names[vdp::kLockSiteCount] = {
+    "Device",
+    "BitmapSurface",
+    "Decoder",
+    "OutputSurface",
+    "PresentationQueue",
+    "PresentationQueueTarget",
+    "VideoMixer",
+    "VideoSurface",
+    "GLX",
+    "VA",
+    "TaskQueue",
+};
+
+int
+bucket_index(uint64_t ns)
+{
+    const int idx = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+    return (idx < kBucketCount) ? idx : kBucketCount - 1;
+}
+
+void
+record(Histogram &h, uint64_t ns)
+{
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    h.buckets[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t prev_max = h.max_ns.load(std::memory_order_relaxed);
+    while (prev_max < ns &&
+           !h.max_ns.compare_exchange_weak(prev_max, ns, std::memory_order_relaxed))
+    {
+    }
+}
+
+void
+dump_histogram(const char *site_name, const char *kind, const Histogram &h)
+{
+    const uint64_t count = h.count.load(std::memory_order_relaxed);
+    if (count == 0)
+        return;
+
+    traceError("lock stats: %s %s: count %llu, avg %llu ns, max %llu ns\n", site_name, kind,
+               (unsigned long long)count,
+               (unsigned long long)(h.total_ns.load(std::memory_order_relaxed) / count),
+               (unsigned long long)h.max_ns.load(std::memory_order_relaxed));
+
+    for (int k = 0; k < kBucketCount; k ++) {
+        const uint64_t n = h.buckets[k].load(std::memory_order_relaxed);
+        if (n == 0)
+            continue;
+
+        traceError("lock stats:   < %llu ns: %llu\n", 1ull << k, (unsigned long long)n);
+    }
+}
+
+void
+dump_stats()
+{
+    for (int k = 0; k < vdp::kLockSiteCount; k ++) {
+        dump_histogram(site_names[k], "wait", g_site_stats[k].wait);
+        dump_histogram(site_names[k], "hold", g_site_stats[k].hold);
+    }
+}
+
+void
+check_dump_request()
+{
+    // dumping from signal handler is not safe, so it's deferred to the next lock operation
+    if (g_dump_requested.load(std::memory_order_relaxed) && g_dump_requested.exchange(false))
+        dump_stats();
+}
+
+// handler which was installed before ours, guarded by g_handler_installed
+struct sigaction g_previous_sigusr2;
+bool g_handler_installed = false;
+
+void
+sigusr2_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    g_dump_requested.store(true, std::memory_order_relaxed);
+
+    // host application may rely on the signal too. Default action would kill the process, so
+    // it's not chained.
+    const struct sigaction &prev = g_previous_sigusr2;
+    if (prev.sa_flags & SA_SIGINFO) {
+        if (prev.sa_sigaction)
+            prev.sa_sigaction(sig, info, ucontext);
+    } else if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN) {
+        prev.sa_handler(sig);
+    }
+}
+
+} // anonymous namespace
+
+namespace vdp { namespace lock_stats {
+
+void
+initialize()
+{
+    struct sigaction sa = {};
+    sa.sa_sigaction = sigusr2_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    g_handler_installed = (sigaction(SIGUSR2, &sa, &g_previous_sigusr2) == 0);
+}
+
+void
+finalize()
+{
+    dump_stats();
+
+    if (!g_handler_installed)
+        return;
+
+    // handler code goes away with the library. If someone replaced it meanwhile, their handler
+    // is left alone.
+    struct sigaction current;
+    if (sigaction(SIGUSR2, nullptr, &current) == 0 && (current.sa_flags & SA_SIGINFO) &&
+        current.sa_sigaction == sigusr2_handler)
+    {
+        sigaction(SIGUSR2, &g_previous_sigusr2, nullptr);
+    }
+
+    g_handler_installed = false;
+}
+
+uint64_t
+now_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+void
+record_wait(LockSite site, uint64_t ns)
+{
+    record(g_site_stats[site].wait, ns);
+    check_dump_request();
+}
+
+void
+record_hold(LockSite site, uint64_t ns)
+{
+    record(g_site_stats[site].hold, ns);
+}
+
+} } // namespace vdp::lock_stats
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "globals.hh"
+#include <stdint.h>
+
+
+namespace vdp {
+
+/// Places where lock contention is measured. Resource sites follow ResourceType order.
+enum LockSite {
+    kLockSiteDevice = 0,
+    kLockSiteBitmapSurface,
+    kLockSiteDecoder,
+    kLockSiteOutputSurface,
+    kLockSitePresentationQueue,
+    kLockSitePresentationQueueTarget,
+    kLockSiteVideoMixer,
+    kLockSiteVideoSurface,
+    kLockSiteGLX,
+    kLockSiteVA,
+    kLockSiteTaskQueue,
+    kLockSiteCount,
+};
+
+namespace lock_stats {
+
+/// install SIGUSR2 handler which dumps collected statistics. Previous handler is still called.
+void
+initialize();
+
+/// dump collected statistics and restore previous SIGUSR2 handler, on library unload or exit
+void
+finalize();
+
+uint64_t
+now_ns();
+
+void
+record_wait(LockSite site, uint64_t ns);
+
+void
+record_hold(LockSite site, uint64_t ns);
+
+inline bool
+enabled()
+{
+    return global.quirks.lock_stats;
+}
+
+} // namespace lock_stats
+
+/// Wraps a mutex (possibly recursive) to record wait and hold times of outermost lock
+/// acquisitions. When statistics are disabled it only costs one branch per call.
+template <class Mutex>
+class ProfiledMutex
+{
+public:
+    explicit
+    ProfiledMutex(LockSite site)
+        : site_{site}
+        , depth_{0}
+        , locked_at_{0}
+    {}
+
+    ProfiledMutex(const ProfiledMutex &) = delete;
+
+    ProfiledMutex &
+    operator=(const ProfiledMutex &) = delete;
+
+    void
+    lock()
+    {
+        if (!lock_stats::enabled()) {
+            mtx_.lock();
+            return;
+        }
+
+        const uint64_t t0 = lock_stats::now_ns();
+        mtx_.lock();
+        acquired(t0);
+    }
+
+    bool
+    try_lock()
+    {
+        if (!lock_stats::enabled())
+            return mtx_.try_lock();
+
+        const uint64_t t0 = lock_stats::now_ns();
+        if (!mtx_.try_lock())
+            return false;
+
+        acquired(t0);
+        return true;
+    }
+
+    void
+    unlock()
+    {
+        if (lock_stats::enabled()) {
+            depth_ -= 1;
+            if (depth_ == 0)
+                lock_stats::record_hold(site_, lock_stats::now_ns() - locked_at_);
+        }
+
+        mtx_.unlock();
+    }
+
+private:
+    void
+    acquired(uint64_t t0)
+    {
+        depth_ += 1;
+        if (depth_ == 1) {
+            locked_at_ = lock_stats::now_ns();
+            lock_stats::record_wait(site_, locked_at_ - t0);
+        }
+    }
+
+    Mutex           mtx_;
+    const LockSite  site_;
+    uint32_t        depth_;     ///< guarded by mtx_
+    uint64_t        locked_at_; ///< guarded by mtx_
+};
+
+} // namespace vdp
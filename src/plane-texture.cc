@@ -0,0 +1,392 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define GL_GLEXT_PROTOTYPES
+#include "gl-state.hh"
+#include "glx-context.hh"
+#include "plane-texture.hh"
+#include <GL/gl.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+
+namespace vdp {
+
+namespace {
+
+const size_t kMinStreamSize = 4 * 1024 * 1024;
+
+// entry points are context-independent, so they are looked up once
+std::atomic<PFNGLTEXSTORAGE2DPROC>      g_tex_storage_2d{nullptr};
+std::atomic<PFNGLMAPBUFFERRANGEPROC>    g_map_buffer_range{nullptr};
+
+struct Stream {
+    GLuint      buffer = 0;
+    size_t      size = 0;
+    size_t      offset = 0;
+};
+
+struct ContextStreams {
+    Stream      unpack;
+    Stream      pack;
+};
+
+// pixel buffer streams by context, guarded by g_streams_mtx. Kept the same way as QuadBatch
+// streams: buffers are deleted right before their context is destroyed.
+std::map<const void *, ContextStreams>  g_streams;
+std::mutex                              g_streams_mtx;
+
+/// streams the current thread used last, valid while context epoch stays the same
+struct StreamsCache {
+    const void     *ctx = nullptr;
+    uint32_t        context_epoch = 0;
+    ContextStreams *streams = nullptr;
+};
+
+thread_local StreamsCache t_streams;
+
+void
+drop_streams(const void *ctx)
+{
+    std::unique_lock<std::mutex> lock{g_streams_mtx};
+
+    auto it = g_streams.find(ctx);
+    if (it == g_streams.end())
+        return;
+
+    // zero names, of streams never used, are ignored
+    const GLuint buffers[2] = {it->second.unpack.buffer, it->second.pack.buffer};
+    gl_state::delete_buffers(2, buffers);
+
+    g_streams.erase(it);
+}
+
+/// returns stream for GL_PIXEL_UNPACK_BUFFER or GL_PIXEL_PACK_BUFFER `target`
+Stream &
+current_stream(GLenum target)
+{
+    const void    *ctx = current_gl_context();
+    const uint32_t context_epoch = gl_state::context_epoch();
+    if (!t_streams.streams || t_streams.ctx != ctx || t_streams.context_epoch != context_epoch) {
+        bool created;
+        {
+            std::unique_lock<std::mutex> lock{g_streams_mtx};
+            auto res = g_streams.emplace(ctx, ContextStreams{});
+            t_streams.streams = &res.first->second;
+            created = res.second;
+        }
+
+        t_streams.ctx = ctx;
+        t_streams.context_epoch = context_epoch;
+
+        if (created)
+            gl_state::at_context_destroy(ctx, [ctx] () { drop_streams(ctx); });
+    }
+
+    ContextStreams &streams = *t_streams.streams;
+    Stream &stream = (target == GL_PIXEL_PACK_BUFFER) ? streams.pack : streams.unpack;
+    if (stream.buffer == 0)
+        glGenBuffers(1, &stream.buffer);
+
+    return stream;
+}
+
+GLsizei
+texel_size(GLenum format)
+{
+    switch (format) {
+    case GL_RG:
+        return 2;
+    case GL_RGBA:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+GLenum
+base_format(GLenum internal_format)
+{
+    switch (internal_format) {
+    case GL_RG8:
+        return GL_RG;
+    case GL_RGBA8:
+        return GL_RGBA;
+    default:
+        return GL_RED;
+    }
+}
+
+bool
+has_extension(const char *name)
+{
+    const char *ext = reinterpret_cast<const char *>(glGetString(GL_EXTENSIONS));
+    return ext && strstr(ext, name);
+}
+
+void
+upload_direct(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type,
+              const uint8_t *data, uint32_t pitch)
+{
+    const GLsizei texel = texel_size(format);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (pitch % texel == 0) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch / texel);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, format, type, data);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    } else {
+        for (GLsizei k = 0; k < height; k ++) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, x, y + k, width, 1, format, type, data + k * pitch);
+        }
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+void
+read_direct(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type,
+            uint8_t *dst, uint32_t pitch)
+{
+    const GLsizei texel = texel_size(format);
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    if (pitch % texel == 0) {
+        glPixelStorei(GL_PACK_ROW_LENGTH, pitch / texel);
+        glReadPixels(x, y, width, height, format, type, dst);
+        glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    } else {
+        for (GLsizei k = 0; k < height; k ++)
+            glReadPixels(x, y + k, width, 1, format, type, dst + k * pitch);
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+}
+
+} // anonymous namespace
+
+void
+PlaneTexture::allocate(GLenum internal_format, GLsizei width, GLsizei height)
+{
+    if (id_ != 0 && internal_format_ == internal_format && width_ == width &&
+        height_ == height)
+    {
+        gl_state::bind_texture(id_);
+        return;
+    }
+
+    // immutable storage can't be resized, so texture is recreated on any layout change
+    release();
+
+    glGenTextures(1, &id_);
+    gl_state::bind_texture(id_);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    const auto tex_storage_2d = g_tex_storage_2d.load(std::memory_order_relaxed);
+    if (tex_storage_2d) {
+        tex_storage_2d(GL_TEXTURE_2D, 1, internal_format, width, height);
+    } else {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0,
+                     base_format(internal_format), GL_UNSIGNED_BYTE, nullptr);
+    }
+
+    internal_format_ = internal_format;
+    width_ = width;
+    height_ = height;
+}
+
+void
+PlaneTexture::upload(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format,
+                     const void *data, uint32_t pitch, GLenum type)
+{
+    const uint8_t *src = static_cast<const uint8_t *>(data);
+
+    if (width <= 0 || height <= 0)
+        return;
+
+    gl_state::bind_texture(id_);
+
+    const auto map_buffer_range = g_map_buffer_range.load(std::memory_order_relaxed);
+    if (!map_buffer_range) {
+        upload_direct(x, y, width, height, format, type, src, pitch);
+        return;
+    }
+
+    // rows are staged at default unpack alignment
+    const size_t row_size = static_cast<size_t>(width) * texel_size(format);
+    const size_t staged_pitch = (row_size + 3) & ~static_cast<size_t>(3);
+    const size_t size = staged_pitch * height;
+
+    Stream &stream = current_stream(GL_PIXEL_UNPACK_BUFFER);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream.buffer);
+
+    if (stream.offset + size > stream.size) {
+        // orphan the storage, pending uploads keep reading the old one
+        stream.size = std::max(stream.size, std::max(size, kMinStreamSize));
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, stream.size, nullptr, GL_STREAM_DRAW);
+        stream.offset = 0;
+    }
+
+    // range wasn't used since the storage was orphaned, so there is nothing to wait for
+    auto *dst = static_cast<uint8_t *>(
+        map_buffer_range(GL_PIXEL_UNPACK_BUFFER, stream.offset, size,
+                         GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+                         GL_MAP_UNSYNCHRONIZED_BIT));
+
+    bool staged = false;
+    if (dst) {
+        for (GLsizei k = 0; k < height; k ++)
+            memcpy(dst + k * staged_pitch, src + k * pitch, row_size);
+
+        // unmapping fails if buffer contents got lost in the meantime
+        staged = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+    }
+
+    if (staged) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, format, type,
+                        reinterpret_cast<const void *>(stream.offset));
+        stream.offset += (size + 15) & ~static_cast<size_t>(15);
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (!staged)
+        upload_direct(x, y, width, height, format, type, src, pitch);
+}
+
+void
+PlaneTexture::release()
+{
+    if (id_ == 0)
+        return;
+
+    gl_state::delete_textures(1, &id_);
+    id_ = 0;
+    internal_format_ = 0;
+    width_ = 0;
+    height_ = 0;
+}
+
+void
+PlaneReadback::read(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, void *dst,
+                    uint32_t pitch, GLenum type)
+{
+    if (width <= 0 || height <= 0)
+        return;
+
+    if (!g_map_buffer_range.load(std::memory_order_relaxed)) {
+        read_direct(x, y, width, height, format, type, static_cast<uint8_t *>(dst), pitch);
+        return;
+    }
+
+    // rows are stored at default pack alignment
+    const size_t row_size = static_cast<size_t>(width) * texel_size(format);
+    const size_t staged_pitch = (row_size + 3) & ~static_cast<size_t>(3);
+    const size_t offset = (size_ + 15) & ~static_cast<size_t>(15);
+    const size_t size = staged_pitch * height;
+
+    Stream &stream = current_stream(GL_PIXEL_PACK_BUFFER);
+
+    if (offset + size > stream.size) {
+        // storage can't grow while queued reads live there
+        finish();
+        stream.size = std::max(stream.size, std::max(size, kMinStreamSize));
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, stream.buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, stream.size, nullptr, GL_STREAM_READ);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        read(x, y, width, height, format, dst, pitch, type);
+        return;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, stream.buffer);
+    glReadPixels(x, y, width, height, format, type, reinterpret_cast<void *>(offset));
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    reads_.push_back(Read{offset, staged_pitch, row_size, height, static_cast<uint8_t *>(dst),
+                          pitch});
+    size_ = offset + size;
+}
+
+void
+PlaneReadback::finish()
+{
+    if (reads_.empty())
+        return;
+
+    Stream &stream = current_stream(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, stream.buffer);
+
+    // mapping waits for the reads to complete
+    const auto map_buffer_range = g_map_buffer_range.load(std::memory_order_relaxed);
+    const auto *src = static_cast<const uint8_t *>(
+        map_buffer_range(GL_PIXEL_PACK_BUFFER, 0, size_, GL_MAP_READ_BIT));
+
+    if (src) {
+        for (const auto &r: reads_) {
+            for (GLsizei k = 0; k < r.height; k ++)
+                memcpy(r.dst + k * r.pitch, src + r.offset + k * r.staged_pitch, r.row_size);
+        }
+
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    reads_.clear();
+    size_ = 0;
+}
+
+void
+PlaneTexture::detect_support()
+{
+    int major = 0;
+    int minor = 0;
+    const char *version = reinterpret_cast<const char *>(glGetString(GL_VERSION));
+    if (version)
+        sscanf(version, "%d.%d", &major, &minor);
+
+    const bool storage_supported = major > 4 || (major == 4 && minor >= 2) ||
+                                   has_extension("GL_ARB_texture_storage");
+
+    const bool pbo_supported = major >= 3 ||
+                               (has_extension("GL_ARB_pixel_buffer_object") &&
+                                has_extension("GL_ARB_map_buffer_range"));
+
+    g_tex_storage_2d = storage_supported ? reinterpret_cast<PFNGLTEXSTORAGE2DPROC>(
+                                               get_gl_proc_address("glTexStorage2D"))
+                                         : nullptr;
+
+    g_map_buffer_range = pbo_supported ? reinterpret_cast<PFNGLMAPBUFFERRANGEPROC>(
+                                             get_gl_proc_address("glMapBufferRange"))
+                                       : nullptr;
+}
+
+} // namespace vdp
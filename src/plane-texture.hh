@@ -0,0 +1,135 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <GL/gl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+namespace vdp {
+
+/// Texture which receives one plane of YCbCr data for shader-based conversion. Storage is
+/// allocated once and reused by following uploads for as long as plane layout stays the same.
+/// It's immutable if ARB_texture_storage is available.
+///
+/// Uploads are staged through a pixel unpack buffer owned by the current thread and context.
+/// Like QuadBatch's vertex stream, it gets orphaned when full, so uploads don't wait for
+/// the GPU to finish reading previous ones.
+///
+/// Object is protected by the lock of the resource it belongs to. All calls need a current GL
+/// context in the device's share group.
+class PlaneTexture
+{
+public:
+    PlaneTexture()
+        : id_{0}
+        , internal_format_{0}
+        , width_{0}
+        , height_{0}
+    {}
+
+    PlaneTexture(const PlaneTexture &) = delete;
+
+    PlaneTexture &
+    operator=(const PlaneTexture &) = delete;
+
+    /// binds texture to the active texture unit, first making sure it has `width`x`height`
+    /// texels of sized `internal_format`. Contents are undefined after layout changes.
+    void
+    allocate(GLenum internal_format, GLsizei width, GLsizei height);
+
+    /// replaces `width`x`height` texels at (`x`, `y`) with `data` of `format`, which is one of
+    /// GL_RED, GL_RG, or GL_RGBA. Components are unsigned bytes, or, for GL_RGBA, may be packed
+    /// into 32-bit words with `type` GL_UNSIGNED_INT_8_8_8_8_REV. Rows of `data` are `pitch`
+    /// bytes apart. Texture must have been allocated.
+    void
+    upload(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, const void *data,
+           uint32_t pitch, GLenum type = GL_UNSIGNED_BYTE);
+
+    /// deletes texture. Must be called before the owner is destroyed.
+    void
+    release();
+
+    GLuint
+    id() const { return id_; }
+
+    /// checks for texture storage and pixel buffer support of current context
+    static void
+    detect_support();
+
+private:
+    GLuint      id_;
+    GLenum      internal_format_;
+    GLsizei     width_;
+    GLsizei     height_;
+};
+
+/// Reads planes back from framebuffers. Reads are queued into a pixel pack buffer owned by the
+/// current thread and context, and get copied out together by finish(), so the GPU performs
+/// them back to back and the caller waits once. Without pixel buffer support each read is
+/// done right away.
+///
+/// All calls need a current GL context, the same one for the whole lifetime of the object.
+class PlaneReadback
+{
+public:
+    PlaneReadback()
+        : size_{0}
+    {}
+
+    PlaneReadback(const PlaneReadback &) = delete;
+
+    PlaneReadback &
+    operator=(const PlaneReadback &) = delete;
+
+    /// queues read of `width`x`height` texels at (`x`, `y`) of the bound read framebuffer. One
+    /// of GL_RED, GL_GREEN, GL_RG, or GL_RGBA components `format` is stored to `dst` as `type`,
+    /// with rows `pitch` bytes apart. Types other than unsigned bytes must pack whole texel
+    /// into 32 bits.
+    void
+    read(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, void *dst,
+         uint32_t pitch, GLenum type = GL_UNSIGNED_BYTE);
+
+    /// waits for queued reads and copies them to their destinations
+    void
+    finish();
+
+private:
+    struct Read {
+        size_t      offset;         ///< in pack buffer
+        size_t      staged_pitch;
+        size_t      row_size;
+        GLsizei     height;
+        uint8_t    *dst;
+        uint32_t    pitch;
+    };
+
+    std::vector<Read>   reads_;
+    size_t              size_;      ///< bytes of pack buffer used by queued reads
+};
+
+} // namespace vdp
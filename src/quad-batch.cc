@@ -0,0 +1,177 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define GL_GLEXT_PROTOTYPES
+#include "gl-state.hh"
+#include "glx-context.hh"
+#include "quad-batch.hh"
+#include <GL/gl.h>
+#include <map>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace vdp {
+
+namespace {
+
+const GLsizei kStreamVertices = 4096;
+
+struct Stream {
+    GLuint      buffer = 0;
+    GLint       next_vertex = 0;
+};
+
+// streams by context, guarded by g_streams_mtx. An entry is created on first use in its
+// context and removed, along with its buffer, right before the context is destroyed. Only the
+// thread the context is current on touches the stream itself.
+std::map<const void *, Stream>  g_streams;
+std::mutex                      g_streams_mtx;
+
+/// stream the current thread used last, valid while context epoch stays the same
+struct StreamCache {
+    const void *ctx = nullptr;
+    uint32_t    context_epoch = 0;
+    Stream     *stream = nullptr;
+};
+
+thread_local StreamCache t_stream;
+
+void
+drop_stream(const void *ctx)
+{
+    std::unique_lock<std::mutex> lock{g_streams_mtx};
+
+    auto it = g_streams.find(ctx);
+    if (it == g_streams.end())
+        return;
+
+    gl_state::delete_buffers(1, &it->second.buffer);
+    g_streams.erase(it);
+}
+
+Stream &
+current_stream()
+{
+    const void    *ctx = current_gl_context();
+    const uint32_t context_epoch = gl_state::context_epoch();
+    if (t_stream.stream && t_stream.ctx == ctx && t_stream.context_epoch == context_epoch)
+        return *t_stream.stream;
+
+    bool created;
+    {
+        std::unique_lock<std::mutex> lock{g_streams_mtx};
+        auto res = g_streams.emplace(ctx, Stream{});
+        t_stream.stream = &res.first->second;
+        created = res.second;
+    }
+
+    t_stream.ctx = ctx;
+    t_stream.context_epoch = context_epoch;
+
+    Stream &stream = *t_stream.stream;
+    if (!created)
+        return stream;
+
+    gl_state::at_context_destroy(ctx, [ctx] () { drop_stream(ctx); });
+
+    glGenBuffers(1, &stream.buffer);
+    gl_state::bind_array_buffer(stream.buffer);
+    glBufferData(GL_ARRAY_BUFFER, kStreamVertices * sizeof(QuadVertex), nullptr, GL_STREAM_DRAW);
+
+    // attribute arrays remember the buffer, and draws select vertices by index, so pointers
+    // are set once per context
+    const GLsizei stride = sizeof(QuadVertex);
+    glVertexAttribPointer(kQuadAttribPosition, 2, GL_FLOAT, GL_FALSE, stride,
+                          reinterpret_cast<const void *>(offsetof(QuadVertex, x)));
+    glVertexAttribPointer(kQuadAttribTexCoord, 2, GL_FLOAT, GL_FALSE, stride,
+                          reinterpret_cast<const void *>(offsetof(QuadVertex, s)));
+    glVertexAttribPointer(kQuadAttribColor, 4, GL_FLOAT, GL_FALSE, stride,
+                          reinterpret_cast<const void *>(offsetof(QuadVertex, r)));
+    glEnableVertexAttribArray(kQuadAttribPosition);
+    glEnableVertexAttribArray(kQuadAttribTexCoord);
+    glEnableVertexAttribArray(kQuadAttribColor);
+
+    return stream;
+}
+
+} // anonymous namespace
+
+void
+QuadBatch::add(const QuadVertex (&corners)[4])
+{
+    if (count_ + 6 > kMaxQuads * 6)
+        draw();
+
+    QuadVertex *v = &vertices_[count_];
+    v[0] = corners[0];
+    v[1] = corners[1];
+    v[2] = corners[2];
+    v[3] = corners[0];
+    v[4] = corners[2];
+    v[5] = corners[3];
+    count_ += 6;
+}
+
+void
+QuadBatch::add_rect(GLfloat x0, GLfloat y0, GLfloat x1, GLfloat y1,
+                    GLfloat s0, GLfloat t0, GLfloat s1, GLfloat t1,
+                    GLfloat r, GLfloat g, GLfloat b, GLfloat a)
+{
+    const QuadVertex corners[4] = {
+        {x0, y0, s0, t0, r, g, b, a},
+        {x1, y0, s1, t0, r, g, b, a},
+        {x1, y1, s1, t1, r, g, b, a},
+        {x0, y1, s0, t1, r, g, b, a},
+    };
+
+    add(corners);
+}
+
+void
+QuadBatch::draw()
+{
+    if (count_ == 0)
+        return;
+
+    Stream &stream = current_stream();
+    gl_state::bind_array_buffer(stream.buffer);
+
+    if (stream.next_vertex + count_ > kStreamVertices) {
+        // orphan the storage, GPU keeps reading the old one until pending draws complete
+        glBufferData(GL_ARRAY_BUFFER, kStreamVertices * sizeof(QuadVertex), nullptr,
+                     GL_STREAM_DRAW);
+        stream.next_vertex = 0;
+    }
+
+    glBufferSubData(GL_ARRAY_BUFFER, stream.next_vertex * sizeof(QuadVertex),
+                    count_ * sizeof(QuadVertex), vertices_);
+    glDrawArrays(GL_TRIANGLES, stream.next_vertex, count_);
+
+    stream.next_vertex += count_;
+    count_ = 0;
+}
+
+} // namespace vdp
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <GL/gl.h>
+
+
+namespace vdp {
+
+/// Vertex attribute locations of glsl/quad_vertex.glsl. Bound before linking each program.
+enum QuadAttrib {
+    kQuadAttribPosition = 0,
+    kQuadAttribTexCoord = 1,
+    kQuadAttribColor =    2,
+};
+
+struct QuadVertex {
+    GLfloat     x, y;           ///< position, transformed by modelview-projection matrix
+    GLfloat     s, t;           ///< texture coordinates, transformed by texture matrix
+    GLfloat     r, g, b, a;     ///< color
+};
+
+/// Collects quads and draws them with a single glDrawArrays() call. Vertices are streamed
+/// through a buffer object owned by the current thread and context, which keeps growing
+/// until it's full and then gets orphaned, so uploads never wait for the GPU.
+///
+/// Quads are drawn with the program and state which are current at draw() time. If the batch
+/// fills up, add() draws accumulated quads first.
+class QuadBatch
+{
+public:
+    QuadBatch()
+        : count_{0}
+    {}
+
+    QuadBatch(const QuadBatch &) = delete;
+
+    QuadBatch &
+    operator=(const QuadBatch &) = delete;
+
+    /// adds quad with corners in order: (x0, y0), (x1, y0), (x1, y1), (x0, y1)
+    void
+    add(const QuadVertex (&corners)[4]);
+
+    /// adds axis-aligned rectangle filled with single color
+    void
+    add_rect(GLfloat x0, GLfloat y0, GLfloat x1, GLfloat y1,
+             GLfloat s0, GLfloat t0, GLfloat s1, GLfloat t1,
+             GLfloat r = 1.0f, GLfloat g = 1.0f, GLfloat b = 1.0f, GLfloat a = 1.0f);
+
+    /// draws accumulated quads and empties the batch
+    void
+    draw();
+
+private:
+    static const int kMaxQuads = 16;
+
+    QuadVertex  vertices_[kMaxQuads * 6];   ///< two triangles per quad
+    int         count_;                     ///< number of vertices in vertices_
+};
+
+} // namespace vdp
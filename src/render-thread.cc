@@ -0,0 +1,226 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "compat.hh"
+#include "render-thread.hh"
+#include "reverse-constant.hh"
+#include "trace.hh"
+#include <string.h>
+
+
+namespace vdp {
+
+RenderThread::RenderThread()
+    : enqueue_pos_{0}
+    , dequeue_pos_{0}
+    , completed_{0}
+    , completed_waiters_{0}
+    , work_seq_{0}
+    , worker_sleeping_{0}
+    , submitters_{0}
+    , stopped_{false}
+{
+    for (uint32_t k = 0; k < kCapacity; k ++)
+        slots_[k].seq.store(k, std::memory_order_relaxed);
+
+    thread_ = std::thread([this] () {
+        thread_body();
+    });
+    thread_id_ = thread_.get_id();
+}
+
+RenderThread::~RenderThread()
+{
+    stop();
+}
+
+bool
+RenderThread::submit(std::function<void()> cmd, uint32_t *pos_out)
+{
+    // submitters_ is raised before checking stopped_, so the worker, which checks submitters_
+    // after stopped_ is set, either sees this command or the command isn't queued at all
+    submitters_.fetch_add(1);
+    if (stopped_.load()) {
+        submitters_.fetch_sub(1);
+        return false;
+    }
+
+    uint32_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+        slot = &slots_[pos & (kCapacity - 1)];
+        const int32_t diff = static_cast<int32_t>(slot->seq.load(std::memory_order_acquire) - pos);
+
+        if (diff == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // ring is full, wait for the worker to free a slot
+            std::this_thread::yield();
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->cmd = std::move(cmd);
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    work_seq_.fetch_add(1);
+    if (worker_sleeping_.load())
+        futex_wake_all(&work_seq_);
+
+    submitters_.fetch_sub(1);
+
+    *pos_out = pos;
+    return true;
+}
+
+void
+RenderThread::post(std::function<void()> cmd)
+{
+    uint32_t pos;
+    if (is_current() || !submit(cmd, &pos))
+        cmd();
+}
+
+void
+RenderThread::run(const std::function<void()> &cmd)
+{
+    uint32_t pos;
+    if (is_current() || !submit([&cmd] () { cmd(); }, &pos)) {
+        cmd();
+        return;
+    }
+
+    wait_completed(pos + 1);
+}
+
+void
+RenderThread::sync()
+{
+    if (is_current())
+        return;
+
+    wait_completed(enqueue_pos_.load(std::memory_order_acquire));
+}
+
+void
+RenderThread::stop()
+{
+    if (stopped_.exchange(true))
+        return;
+
+    // wake worker, so it notices the flag
+    work_seq_.fetch_add(1);
+    futex_wake_all(&work_seq_);
+
+    thread_.join();
+}
+
+void
+RenderThread::wait_completed(uint32_t target)
+{
+    while (true) {
+        const uint32_t done = completed_.load(std::memory_order_acquire);
+        if (static_cast<int32_t>(done - target) >= 0)
+            return;
+
+        completed_waiters_.fetch_add(1);
+        futex_wait(&completed_, done);
+        completed_waiters_.fetch_sub(1);
+    }
+}
+
+void
+RenderThread::thread_body()
+{
+    while (true) {
+        Slot *slot = &slots_[dequeue_pos_ & (kCapacity - 1)];
+
+        if (slot->seq.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+            // nothing to do. Exit if stopped and no submitter can queue anything anymore.
+            if (stopped_.load() && submitters_.load() == 0 &&
+                enqueue_pos_.load() == dequeue_pos_)
+            {
+                return;
+            }
+
+            if (stopped_.load()) {
+                // some submitter is still in flight
+                std::this_thread::yield();
+                continue;
+            }
+
+            const uint32_t seq = work_seq_.load();
+            worker_sleeping_.store(1);
+            if (slot->seq.load() != dequeue_pos_ + 1 && !stopped_.load())
+                futex_wait(&work_seq_, seq);
+            worker_sleeping_.store(0);
+            continue;
+        }
+
+        std::function<void()> cmd = std::move(slot->cmd);
+        slot->cmd = nullptr;
+        slot->seq.store(dequeue_pos_ + kCapacity, std::memory_order_release);
+        dequeue_pos_ += 1;
+
+        try {
+            cmd();
+        } catch (...) {
+            traceError("RenderThread::thread_body(): caught exception\n");
+        }
+
+        // destroy captured state before reporting completion, so resources it referenced are
+        // released by the time waiters continue
+        cmd = nullptr;
+
+        completed_.store(dequeue_pos_, std::memory_order_release);
+        if (completed_waiters_.load() > 0)
+            futex_wake_all(&completed_);
+    }
+}
+
+const void *
+DeferredData::copy_bytes(const void *src, size_t size)
+{
+    if (!src)
+        return nullptr;
+
+    blocks_.emplace_back(size);
+    memcpy(blocks_.back().data(), src, size);
+    return blocks_.back().data();
+}
+
+void
+post_call(RenderThread *thread, const char *where, std::function<VdpStatus()> fn)
+{
+    thread->post([where, fn] () {
+        const VdpStatus status = fn();
+        if (status != VDP_STATUS_OK)
+            traceError("%s(): deferred call failed: %s\n", where, reverse_status(status));
+    });
+}
+
+} // namespace vdp
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#include <vdpau/vdpau.h>
+#include <vector>
+
+
+namespace vdp {
+
+/// Worker thread that executes GL commands of a single device in submission order. Commands are
+/// passed through a bounded lock-free ring; any number of threads may submit, only the worker
+/// consumes. Submitters sleep only when the ring is full or when they wait for completion.
+/// Must be stopped (or destroyed) from a thread other than the worker.
+class RenderThread
+{
+public:
+    RenderThread();
+
+    ~RenderThread();
+
+    RenderThread(const RenderThread &) = delete;
+
+    RenderThread &
+    operator=(const RenderThread &) = delete;
+
+    /// queues command for asynchronous execution. After stop(), executes it immediately instead.
+    void
+    post(std::function<void()> cmd);
+
+    /// executes command on the worker and waits for its completion
+    void
+    run(const std::function<void()> &cmd);
+
+    /// waits until all commands submitted so far complete
+    void
+    sync();
+
+    /// executes remaining commands and terminates the worker
+    void
+    stop();
+
+    /// true if called from the worker thread
+    bool
+    is_current() const { return std::this_thread::get_id() == thread_id_; }
+
+private:
+    static const uint32_t kCapacity = 256;  ///< ring size, power of two
+
+    struct Slot {
+        std::atomic<uint32_t>   seq;    ///< equals position when free, position+1 when filled
+        std::function<void()>   cmd;
+    };
+
+    bool
+    submit(std::function<void()> cmd, uint32_t *pos);
+
+    void
+    wait_completed(uint32_t target);
+
+    void
+    thread_body();
+
+    Slot                    slots_[kCapacity];
+    std::atomic<uint32_t>   enqueue_pos_;
+    uint32_t                dequeue_pos_;           ///< touched by the worker only
+    std::atomic<uint32_t>   completed_;             ///< commands done, also a futex word
+    std::atomic<uint32_t>   completed_waiters_;     ///< threads sleeping on completed_
+    std::atomic<uint32_t>   work_seq_;              ///< bumped on each submission, futex word
+    std::atomic<uint32_t>   worker_sleeping_;
+    std::atomic<uint32_t>   submitters_;            ///< threads inside submit()
+    std::atomic<bool>       stopped_;
+    std::thread             thread_;
+    std::thread::id         thread_id_;
+};
+
+/// Owns copies of caller's buffers, so a deferred command can use them after the API call has
+/// returned
+class DeferredData
+{
+public:
+    template <class T>
+    const T *
+    copy(const T *src, size_t count = 1)
+    {
+        return static_cast<const T *>(copy_bytes(src, sizeof(T) * count));
+    }
+
+    const void *
+    copy_bytes(const void *src, size_t size);
+
+    /// copies image plane of given height; the last row may be shorter than pitch
+    const void *
+    copy_plane(const void *src, uint32_t pitch, uint32_t rows, size_t row_bytes)
+    {
+        return copy_bytes(src, rows > 0 ? (size_t)(rows - 1) * pitch + row_bytes : 0);
+    }
+
+private:
+    std::vector<std::vector<uint8_t>>   blocks_;
+};
+
+/// true if rectangle is either absent or not inverted
+inline bool
+rect_is_valid(const VdpRect *rect)
+{
+    return !rect || (rect->x0 <= rect->x1 && rect->y0 <= rect->y1);
+}
+
+/// queues an API call implementation on the render thread, tracing its result since there is
+/// nobody to return it to
+void
+post_call(RenderThread *thread, const char *where, std::function<VdpStatus()> fn);
+
+} // namespace vdp
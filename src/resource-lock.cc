@@ -0,0 +1,129 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "compat.hh"
+#include "resource-lock.hh"
+#include <thread>
+
+
+namespace vdp {
+
+namespace {
+
+// spin iterations before going to sleep
+const int kSpinCount = 200;
+
+// Unique non-zero value for each live thread. Address of a thread-local variable is cheaper than
+// a gettid() syscall and is unique among threads that exist at the same time.
+inline uintptr_t
+current_thread_token()
+{
+    static thread_local char token;
+    return reinterpret_cast<uintptr_t>(&token);
+}
+
+inline void
+cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+} // anonymous namespace
+
+void
+ResourceLock::lock()
+{
+    const uintptr_t self = current_thread_token();
+
+    if (owner_.load(std::memory_order_relaxed) == self) {
+        depth_ += 1;
+        return;
+    }
+
+    const uint32_t ticket = next_ticket_.fetch_add(1, std::memory_order_relaxed);
+
+    int spin = 0;
+    while (true) {
+        const uint32_t serving = now_serving_.load(std::memory_order_acquire);
+        if (serving == ticket)
+            break;
+
+        if (spin < kSpinCount) {
+            spin += 1;
+            cpu_relax();
+            continue;
+        }
+
+        sleepers_.fetch_add(1);
+        futex_wait(&now_serving_, serving);
+        sleepers_.fetch_sub(1);
+    }
+
+    owner_.store(self, std::memory_order_relaxed);
+    depth_ = 1;
+}
+
+bool
+ResourceLock::try_lock()
+{
+    const uintptr_t self = current_thread_token();
+
+    if (owner_.load(std::memory_order_relaxed) == self) {
+        depth_ += 1;
+        return true;
+    }
+
+    // succeed only if nobody holds or waits for the lock, i.e. the next ticket is being served
+    uint32_t ticket = now_serving_.load(std::memory_order_acquire);
+    if (!next_ticket_.compare_exchange_strong(ticket, ticket + 1, std::memory_order_acquire,
+                                              std::memory_order_relaxed))
+    {
+        return false;
+    }
+
+    owner_.store(self, std::memory_order_relaxed);
+    depth_ = 1;
+    return true;
+}
+
+void
+ResourceLock::unlock()
+{
+    depth_ -= 1;
+    if (depth_ > 0)
+        return;
+
+    owner_.store(0, std::memory_order_relaxed);
+    now_serving_.fetch_add(1);
+
+    // all sleepers are woken, since only one of them holds the next ticket
+    if (sleepers_.load() > 0)
+        futex_wake_all(&now_serving_);
+}
+
+} // namespace vdp
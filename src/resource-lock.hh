@@ -0,0 +1,73 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+
+namespace vdp {
+
+/// Recursive lock protecting a single resource. Waiters are served in FIFO order (ticket lock),
+/// so a thread cannot be starved by others that repeatedly re-acquire the same resource. After
+/// a short spin phase waiters sleep on a futex. Satisfies Lockable, so works with unique_lock.
+class ResourceLock
+{
+public:
+    ResourceLock()
+        : next_ticket_{0}
+        , now_serving_{0}
+        , sleepers_{0}
+        , owner_{0}
+        , depth_{0}
+    {}
+
+    ResourceLock(const ResourceLock &) = delete;
+
+    ResourceLock &
+    operator=(const ResourceLock &) = delete;
+
+    void
+    lock();
+
+    bool
+    try_lock();
+
+    void
+    unlock();
+
+    /// true if the next unlock() releases the lock. Valid only for the owning thread.
+    bool
+    is_last_level() const { return depth_ == 1; }
+
+private:
+    std::atomic<uint32_t>   next_ticket_;
+    std::atomic<uint32_t>   now_serving_;   ///< also serves as a futex word
+    std::atomic<uint32_t>   sleepers_;      ///< number of threads in futex_wait()
+    std::atomic<uintptr_t>  owner_;         ///< owning thread token, zero if not locked
+    uint32_t                depth_;         ///< recursion depth, modified by owner only
+};
+
+} // namespace vdp
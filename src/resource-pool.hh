@@ -0,0 +1,98 @@
+/*
+ * Copyright 2013-2016  Rinat Ibragimov
+ *
+ * This file is part of libvdpau-va-gl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <stddef.h>
+#include <type_traits>
+
+
+namespace vdp {
+
+/// Free-list allocator for objects of a single type. Memory is taken from the system in slabs
+/// and is never returned, so creating and destroying resources in a loop doesn't hit malloc.
+template <class T>
+class ResourcePool
+{
+public:
+    void *
+    allocate()
+    {
+        std::unique_lock<decltype(mtx_)> lock(mtx_);
+
+        if (!free_list_)
+            grow();
+
+        Block *block = free_list_;
+        free_list_ = block->next;
+        return &block->storage;
+    }
+
+    void
+    deallocate(void *ptr)
+    {
+        std::unique_lock<decltype(mtx_)> lock(mtx_);
+
+        Block *block = static_cast<Block *>(ptr);
+        block->next = free_list_;
+        free_list_ = block;
+    }
+
+    static ResourcePool &
+    instance()
+    {
+        // intentionally leaked: resources may still be released during static destruction
+        static ResourcePool *pool = new ResourcePool;
+        return *pool;
+    }
+
+private:
+    static const size_t kSlabSize = 32;    ///< objects per slab
+
+    union Block {
+        Block                                                          *next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type     storage;
+    };
+
+    ResourcePool()
+        : free_list_{nullptr}
+    {}
+
+    void
+    grow()
+    {
+        Block *slab = new Block[kSlabSize];
+
+        for (size_t k = 0; k < kSlabSize; k ++) {
+            slab[k].next = free_list_;
+            free_list_ = &slab[k];
+        }
+    }
+
+    std::mutex  mtx_;
+    Block      *free_list_;
+};
+
+} // namespace vdp
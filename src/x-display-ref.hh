@@ -24,6 +24,7 @@
 
 #pragma once
 
+#include "egl-context.hh"
 #include <mutex>
 #include <X11/Xlib.h>
 
@@ -37,13 +38,13 @@ public:
     {
         std::unique_lock<decltype(mtx_)> lock(mtx_);
 
-        const bool ref_cnt_was_zero = (ref_cnt_ == 0);
-
         ref_cnt_ += 1;
         if (one_more_ref)
             ref_cnt_ += 1;
 
-        if (ref_cnt_was_zero) {
+        // There is no X display to share in EGL mode. Backend may change once all devices are
+        // gone, while an extra reference keeps the count above zero, so it's checked each time.
+        if (!dpy_ && !egl::enabled()) {
             dpy_ = XOpenDisplay(nullptr);
 
             // TODO: do we need to throw if (dpy_ == nullptr)?
@@ -56,7 +57,8 @@ public:
 
         ref_cnt_ -= 1;
         if (ref_cnt_ <= 0) {
-            XCloseDisplay(dpy_);
+            if (dpy_)
+                XCloseDisplay(dpy_);
             dpy_ = nullptr;
         }
     }
@@ -0,0 +1,79 @@
+// Measures NV12 chroma deinterleave at 4K, for each kernel available on this CPU and for the
+// threaded path used by VdpVideoSurfaceGetBitsYCbCr. Threaded path is compared to the fastest
+// kernel running on one thread, which it uses itself.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <thread>
+#include <time.h>
+#include <vector>
+#include "../src/chroma-deinterleave.hh"
+
+
+static
+double
+now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1.0e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const uint32_t width = 3840 / 2;
+    const uint32_t height = 2160 / 2;
+    int rep_count = 200;
+    if (argc >= 2)
+        rep_count = atoi(argv[1]);
+
+    std::vector<uint8_t> src(2 * width * height);
+    std::vector<uint8_t> dst_0(width * height);
+    std::vector<uint8_t> dst_1(width * height);
+
+    for (size_t k = 0; k < src.size(); k ++)
+        src[k] = static_cast<uint8_t>(k);
+
+    double scalar_duration = 0;
+    double best_duration = 0;
+
+    for (const auto &kernel: vdp::chroma::deinterleave_kernels()) {
+        const double t_start = now();
+        for (int k = 0; k < rep_count; k ++) {
+            for (uint32_t y = 0; y < height; y ++) {
+                kernel.row(&src[2 * width * y], &dst_0[width * y], &dst_1[width * y],
+                           width);
+            }
+        }
+        const double duration = now() - t_start;
+
+        if (scalar_duration == 0)
+            scalar_duration = duration;
+
+        best_duration = duration;
+
+        printf("%-8s %8.3f ms per frame, %5.2fx\n", kernel.name, duration / rep_count * 1e3,
+               scalar_duration / duration);
+    }
+
+    // workers are started by the first call, it's not measured
+    vdp::chroma::deinterleave(src.data(), 2 * width, dst_0.data(), width, dst_1.data(), width,
+                              width, height);
+
+    const double t_start = now();
+    for (int k = 0; k < rep_count; k ++) {
+        vdp::chroma::deinterleave(src.data(), 2 * width, dst_0.data(), width, dst_1.data(),
+                                  width, width, height);
+    }
+    const double duration = now() - t_start;
+
+    printf("%-8s %8.3f ms per frame, %5.2fx\n", "threaded", duration / rep_count * 1e3,
+           scalar_duration / duration);
+    printf("threaded vs %s on one thread: %.2fx, %u hardware threads\n",
+           vdp::chroma::deinterleave_kernels().back().name, best_duration / duration,
+           std::thread::hardware_concurrency());
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <thread>
+#include <vector>
+#include "../src/resource-lock.hh"
+
+
+using std::thread;
+using std::vector;
+
+static
+void
+test_recursion()
+{
+    vdp::ResourceLock lock;
+
+    lock.lock();
+    lock.lock();
+    assert(lock.try_lock());
+    lock.unlock();
+    lock.unlock();
+
+    // still held by this thread, other threads must fail
+    bool acquired = true;
+    thread t([&] { acquired = lock.try_lock(); });
+    t.join();
+    assert(!acquired);
+
+    lock.unlock();
+
+    thread t2([&] {
+        acquired = lock.try_lock();
+        lock.unlock();
+    });
+    t2.join();
+    assert(acquired);
+}
+
+static
+void
+test_mutual_exclusion()
+{
+    vdp::ResourceLock lock;
+    const int thread_count = 8;
+    const int iterations = 20000;
+    int counter = 0;
+    vector<thread> threads;
+
+    for (int k = 0; k < thread_count; k ++) {
+        threads.emplace_back([&] {
+            for (int j = 0; j < iterations; j ++) {
+                lock.lock();
+                counter += 1;
+                lock.unlock();
+            }
+        });
+    }
+
+    for (auto &t: threads)
+        t.join();
+
+    assert(counter == thread_count * iterations);
+}
+
+int
+main()
+{
+    test_recursion();
+    test_mutual_exclusion();
+
+    printf("pass\n");
+}
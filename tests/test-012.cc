@@ -0,0 +1,87 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "../src/render-thread.hh"
+
+
+using std::thread;
+using std::vector;
+
+// commands from each submitter are executed in submission order, and none is lost
+static
+void
+test_ordering()
+{
+    vdp::RenderThread rt;
+    const int thread_count = 6;
+    const int iterations = 5000;
+    vector<int> last_seen(thread_count, -1);
+    int executed = 0;
+    vector<thread> threads;
+
+    for (int k = 0; k < thread_count; k ++) {
+        threads.emplace_back([&, k] {
+            for (int j = 0; j < iterations; j ++) {
+                rt.post([&, k, j] {
+                    assert(last_seen[k] == j - 1);
+                    last_seen[k] = j;
+                    executed += 1;
+                });
+            }
+        });
+    }
+
+    for (auto &t: threads)
+        t.join();
+
+    rt.sync();
+    assert(executed == thread_count * iterations);
+}
+
+// run() returns after its command is done, on the worker thread
+static
+void
+test_run()
+{
+    vdp::RenderThread rt;
+    std::atomic<int> counter{0};
+
+    for (int k = 0; k < 1000; k ++)
+        rt.post([&] { counter += 1; });
+
+    bool on_worker = false;
+    rt.run([&] { on_worker = rt.is_current(); });
+    assert(on_worker);
+    assert(counter == 1000);
+}
+
+// stop() drains the queue, later commands run on the caller
+static
+void
+test_stop()
+{
+    vdp::RenderThread rt;
+    int counter = 0;
+
+    for (int k = 0; k < 1000; k ++)
+        rt.post([&] { counter += 1; });
+
+    rt.stop();
+    assert(counter == 1000);
+
+    rt.post([&] { counter += 1; });
+    assert(counter == 1001);
+}
+
+int
+main()
+{
+    test_ordering();
+    test_run();
+    test_stop();
+
+    printf("pass\n");
+}
@@ -0,0 +1,191 @@
+// test-013
+// Upload each of packed YCbCr formats to a 5x2 video surface, render it to an output surface,
+// and read it back in the same format. Odd pixels are white, even are black, so both halves of
+// UYVY and YUYV texels and the incomplete texel at odd width get checked. Chroma is neutral,
+// results must be grey.
+// TOUCHES: VdpVideoSurfacePutBitsYCbCr
+// TOUCHES: VdpVideoSurfaceGetBitsYCbCr
+// TOUCHES: VdpVideoSurfaceQueryGetPutBitsYCbCrCapabilities
+
+#include "tests-common.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WIDTH   5
+#define HEIGHT  2
+
+static
+uint8_t
+luma(int x)
+{
+    return (x & 1) ? 255 : 0;
+}
+
+static
+void
+fill_source(VdpYCbCrFormat format, uint8_t *buf, uint32_t pitch)
+{
+    for (int y = 0; y < HEIGHT; y ++) {
+        uint8_t *row = buf + y * pitch;
+        uint32_t *words = (uint32_t *)row;
+
+        for (int x = 0; x < WIDTH; x ++) {
+            switch (format) {
+            case VDP_YCBCR_FORMAT_UYVY:
+                row[2 * (x & ~1) + 0] = 128;
+                row[2 * (x & ~1) + 2] = 128;
+                row[2 * x + 1] = luma(x);
+                break;
+            case VDP_YCBCR_FORMAT_YUYV:
+                row[2 * (x & ~1) + 1] = 128;
+                row[2 * (x & ~1) + 3] = 128;
+                row[2 * x] = luma(x);
+                break;
+            case VDP_YCBCR_FORMAT_Y8U8V8A8:
+                words[x] = (0xffu << 24) | (128 << 16) | (128 << 8) | luma(x);
+                break;
+            case VDP_YCBCR_FORMAT_V8U8Y8A8:
+                words[x] = (0xffu << 24) | ((uint32_t)luma(x) << 16) | (128 << 8) | 128;
+                break;
+            }
+        }
+    }
+}
+
+/// returns luma and chroma of pixel `x` in a row of `format`
+static
+void
+unpack_pixel(VdpYCbCrFormat format, const uint8_t *row, int x, int *y, int *cb, int *cr)
+{
+    const uint8_t *pair = row + 4 * (x / 2);
+    uint32_t word;
+
+    switch (format) {
+    case VDP_YCBCR_FORMAT_UYVY:
+        *y = pair[1 + 2 * (x & 1)];
+        *cb = pair[0];
+        *cr = pair[2];
+        break;
+    case VDP_YCBCR_FORMAT_YUYV:
+        *y = pair[2 * (x & 1)];
+        *cb = pair[1];
+        *cr = pair[3];
+        break;
+    case VDP_YCBCR_FORMAT_Y8U8V8A8:
+        memcpy(&word, row + 4 * x, 4);
+        *y = word & 0xff;
+        *cb = (word >> 8) & 0xff;
+        *cr = (word >> 16) & 0xff;
+        break;
+    case VDP_YCBCR_FORMAT_V8U8Y8A8:
+        memcpy(&word, row + 4 * x, 4);
+        *y = (word >> 16) & 0xff;
+        *cb = (word >> 8) & 0xff;
+        *cr = word & 0xff;
+        break;
+    }
+}
+
+static
+void
+test_format(VdpDevice device, VdpVideoMixer mixer, VdpOutputSurface out_surface,
+            VdpYCbCrFormat format)
+{
+    VdpBool is_supported = 0;
+    ASSERT_OK(vdpVideoSurfaceQueryGetPutBitsYCbCrCapabilities(device, VDP_CHROMA_TYPE_422,
+                                                              format, &is_supported));
+    assert(is_supported);
+
+    VdpVideoSurface surface;
+    ASSERT_OK(vdpVideoSurfaceCreate(device, VDP_CHROMA_TYPE_422, WIDTH, HEIGHT, &surface));
+
+    // rows are padded to make sure pitch is honored
+    const uint32_t pitch = 4 * WIDTH + 12;
+    uint8_t *buf = calloc(pitch, HEIGHT);
+    fill_source(format, buf, pitch);
+
+    const void * const source_data[] = {buf};
+    const uint32_t source_pitches[] = {pitch};
+    ASSERT_OK(vdpVideoSurfacePutBitsYCbCr(surface, format, source_data, source_pitches));
+
+    ASSERT_OK(vdpVideoMixerRender(mixer, VDP_INVALID_HANDLE, NULL,
+                                  VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME, 0, NULL, surface,
+                                  0, NULL, NULL, out_surface, NULL, NULL, 0, NULL));
+
+    uint32_t result[WIDTH * HEIGHT];
+    void * const dest_data[] = {result};
+    const uint32_t dest_pitches[] = {4 * WIDTH};
+    ASSERT_OK(vdpOutputSurfaceGetBitsNative(out_surface, NULL, dest_data, dest_pitches));
+
+    for (int y = 0; y < HEIGHT; y ++) {
+        for (int x = 0; x < WIDTH; x ++) {
+            const uint32_t px = result[y * WIDTH + x];
+            for (int c = 0; c < 3; c ++) {
+                const int value = (px >> (8 * c)) & 0xff;
+                if (abs(value - luma(x)) > 4) {
+                    printf("format %d, pixel (%d, %d): got %08x\n", format, x, y, px);
+                    assert(0);
+                }
+            }
+        }
+    }
+
+    // read back into a buffer of different pitch
+    const uint32_t get_pitch = 4 * WIDTH + 4;
+    uint8_t *get_buf = calloc(get_pitch, HEIGHT);
+    void * const get_data[] = {get_buf};
+    const uint32_t get_pitches[] = {get_pitch};
+    ASSERT_OK(vdpVideoSurfaceGetBitsYCbCr(surface, format, get_data, get_pitches));
+
+    for (int y = 0; y < HEIGHT; y ++) {
+        for (int x = 0; x < WIDTH; x ++) {
+            int luma_value, cb, cr;
+            unpack_pixel(format, get_buf + y * get_pitch, x, &luma_value, &cb, &cr);
+            if (abs(luma_value - luma(x)) > 4 || abs(cb - 128) > 4 || abs(cr - 128) > 4) {
+                printf("format %d, read back pixel (%d, %d): got %d %d %d\n", format, x, y,
+                       luma_value, cb, cr);
+                assert(0);
+            }
+        }
+    }
+
+    free(get_buf);
+    free(buf);
+    ASSERT_OK(vdpVideoSurfaceDestroy(surface));
+}
+
+int main(void)
+{
+    VdpDevice device = create_vdp_device();
+
+    VdpOutputSurface out_surface;
+    ASSERT_OK(vdpOutputSurfaceCreate(device, VDP_RGBA_FORMAT_B8G8R8A8, WIDTH, HEIGHT,
+                                     &out_surface));
+
+    const VdpVideoMixerParameter params[] = {
+        VDP_VIDEO_MIXER_PARAMETER_VIDEO_SURFACE_WIDTH,
+        VDP_VIDEO_MIXER_PARAMETER_VIDEO_SURFACE_HEIGHT,
+        VDP_VIDEO_MIXER_PARAMETER_CHROMA_TYPE,
+    };
+    const uint32_t width = WIDTH;
+    const uint32_t height = HEIGHT;
+    const VdpChromaType chroma_type = VDP_CHROMA_TYPE_422;
+    const void * const param_values[] = {&width, &height, &chroma_type};
+
+    VdpVideoMixer mixer;
+    ASSERT_OK(vdpVideoMixerCreate(device, 0, NULL, 3, params, param_values, &mixer));
+
+    test_format(device, mixer, out_surface, VDP_YCBCR_FORMAT_UYVY);
+    test_format(device, mixer, out_surface, VDP_YCBCR_FORMAT_YUYV);
+    test_format(device, mixer, out_surface, VDP_YCBCR_FORMAT_Y8U8V8A8);
+    test_format(device, mixer, out_surface, VDP_YCBCR_FORMAT_V8U8Y8A8);
+
+    ASSERT_OK(vdpVideoMixerDestroy(mixer));
+    ASSERT_OK(vdpOutputSurfaceDestroy(out_surface));
+    ASSERT_OK(vdpDeviceDestroy(device));
+
+    printf("pass\n");
+    return 0;
+}
@@ -0,0 +1,171 @@
+// test-014
+// Read video surfaces back as NV12 and YV12. Bits put as NV12 must come back exactly, in either
+// layout. Bits put as Y8U8V8A8 exist only as RGBA, so they are converted by GL. Their chroma is
+// flat, so subsampling doesn't change it.
+// TOUCHES: VdpVideoSurfacePutBitsYCbCr
+// TOUCHES: VdpVideoSurfaceGetBitsYCbCr
+
+#include "tests-common.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define WIDTH   6
+#define HEIGHT  4
+#define CB      100
+#define CR      160
+
+// NV12 rows are padded to make sure pitch is honored
+#define PITCH   (WIDTH + 10)
+
+static
+uint8_t
+luma(int x, int y)
+{
+    return 60 + 20 * x + 5 * y;
+}
+
+static
+uint8_t
+chroma(int x, int y, int k)
+{
+    return 40 + 30 * x + 20 * y + k;
+}
+
+static
+void
+check(const char *plane, int x, int y, int value, int expected, int tolerance)
+{
+    if (abs(value - expected) > tolerance) {
+        printf("%s plane, sample (%d, %d): got %d, expected %d\n", plane, x, y, value,
+               expected);
+        assert(0);
+    }
+}
+
+/// reads surface back in both layouts, `cb` and `cr` give expected chroma
+static
+void
+check_surface(VdpVideoSurface surface, uint8_t (*cb)(int x, int y), uint8_t (*cr)(int x, int y),
+              int tolerance)
+{
+    uint8_t nv12_y[PITCH * HEIGHT];
+    uint8_t nv12_uv[PITCH * HEIGHT / 2];
+    void * const nv12_data[] = {nv12_y, nv12_uv};
+    const uint32_t nv12_pitches[] = {PITCH, PITCH};
+    ASSERT_OK(vdpVideoSurfaceGetBitsYCbCr(surface, VDP_YCBCR_FORMAT_NV12, nv12_data,
+                                          nv12_pitches));
+
+    for (int y = 0; y < HEIGHT; y ++)
+        for (int x = 0; x < WIDTH; x ++)
+            check("NV12 Y", x, y, nv12_y[y * PITCH + x], luma(x, y), tolerance);
+
+    for (int y = 0; y < HEIGHT / 2; y ++) {
+        for (int x = 0; x < WIDTH / 2; x ++) {
+            check("NV12 U", x, y, nv12_uv[y * PITCH + 2 * x], cb(x, y), tolerance);
+            check("NV12 V", x, y, nv12_uv[y * PITCH + 2 * x + 1], cr(x, y), tolerance);
+        }
+    }
+
+    // YV12, V plane goes before U
+    uint8_t yv12_y[WIDTH * HEIGHT];
+    uint8_t yv12_v[WIDTH * HEIGHT / 4];
+    uint8_t yv12_u[WIDTH * HEIGHT / 4];
+    void * const yv12_data[] = {yv12_y, yv12_v, yv12_u};
+    const uint32_t yv12_pitches[] = {WIDTH, WIDTH / 2, WIDTH / 2};
+    ASSERT_OK(vdpVideoSurfaceGetBitsYCbCr(surface, VDP_YCBCR_FORMAT_YV12, yv12_data,
+                                          yv12_pitches));
+
+    for (int y = 0; y < HEIGHT; y ++)
+        for (int x = 0; x < WIDTH; x ++)
+            check("YV12 Y", x, y, yv12_y[y * WIDTH + x], luma(x, y), tolerance);
+
+    for (int y = 0; y < HEIGHT / 2; y ++) {
+        for (int x = 0; x < WIDTH / 2; x ++) {
+            check("YV12 U", x, y, yv12_u[y * WIDTH / 2 + x], cb(x, y), tolerance);
+            check("YV12 V", x, y, yv12_v[y * WIDTH / 2 + x], cr(x, y), tolerance);
+        }
+    }
+}
+
+static
+uint8_t
+nv12_cb(int x, int y)
+{
+    return chroma(x, y, 0);
+}
+
+static
+uint8_t
+nv12_cr(int x, int y)
+{
+    return chroma(x, y, 1);
+}
+
+static
+uint8_t
+flat_cb(int x, int y)
+{
+    (void)x;
+    (void)y;
+    return CB;
+}
+
+static
+uint8_t
+flat_cr(int x, int y)
+{
+    (void)x;
+    (void)y;
+    return CR;
+}
+
+int main(void)
+{
+    VdpDevice device = create_vdp_device();
+
+    VdpVideoSurface surface;
+    ASSERT_OK(vdpVideoSurfaceCreate(device, VDP_CHROMA_TYPE_420, WIDTH, HEIGHT, &surface));
+
+    // NV12
+    uint8_t y_plane[WIDTH * HEIGHT];
+    uint8_t uv_plane[WIDTH * HEIGHT / 2];
+
+    for (int y = 0; y < HEIGHT; y ++)
+        for (int x = 0; x < WIDTH; x ++)
+            y_plane[y * WIDTH + x] = luma(x, y);
+
+    for (int y = 0; y < HEIGHT / 2; y ++) {
+        for (int x = 0; x < WIDTH / 2; x ++) {
+            uv_plane[y * WIDTH + 2 * x] = nv12_cb(x, y);
+            uv_plane[y * WIDTH + 2 * x + 1] = nv12_cr(x, y);
+        }
+    }
+
+    const void * const nv12_data[] = {y_plane, uv_plane};
+    const uint32_t nv12_pitches[] = {WIDTH, WIDTH};
+    ASSERT_OK(vdpVideoSurfacePutBitsYCbCr(surface, VDP_YCBCR_FORMAT_NV12, nv12_data,
+                                          nv12_pitches));
+
+    check_surface(surface, nv12_cb, nv12_cr, 0);
+
+    // Y8U8V8A8
+    uint32_t words[WIDTH * HEIGHT];
+
+    for (int y = 0; y < HEIGHT; y ++)
+        for (int x = 0; x < WIDTH; x ++)
+            words[y * WIDTH + x] = (0xffu << 24) | (CR << 16) | (CB << 8) | luma(x, y);
+
+    const void * const packed_data[] = {words};
+    const uint32_t packed_pitches[] = {4 * WIDTH};
+    ASSERT_OK(vdpVideoSurfacePutBitsYCbCr(surface, VDP_YCBCR_FORMAT_Y8U8V8A8, packed_data,
+                                          packed_pitches));
+
+    check_surface(surface, flat_cb, flat_cr, 4);
+
+    ASSERT_OK(vdpVideoSurfaceDestroy(surface));
+    ASSERT_OK(vdpDeviceDestroy(device));
+
+    printf("pass\n");
+    return 0;
+}
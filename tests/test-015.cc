@@ -0,0 +1,88 @@
+#undef NDEBUG
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include "../src/chroma-deinterleave.hh"
+
+
+using std::vector;
+
+static
+void
+test_kernel(const vdp::chroma::DeinterleaveKernel &kernel)
+{
+    // odd counts and offsets exercise unaligned access and scalar tails
+    for (uint32_t count = 0; count < 100; count ++) {
+        for (uint32_t offset = 0; offset < 4; offset ++) {
+            vector<uint8_t> src(2 * count + offset);
+            vector<uint8_t> dst_0(count + offset + 1, 0xaa);
+            vector<uint8_t> dst_1(count + offset + 1, 0xaa);
+
+            for (size_t k = 0; k < src.size(); k ++)
+                src[k] = static_cast<uint8_t>(k * 7 + 3);
+
+            kernel.row(src.data() + offset, dst_0.data() + offset, dst_1.data() + offset,
+                       count);
+
+            for (uint32_t k = 0; k < count; k ++) {
+                assert(dst_0[offset + k] == src[offset + 2 * k]);
+                assert(dst_1[offset + k] == src[offset + 2 * k + 1]);
+            }
+
+            // nothing is written past the end
+            assert(dst_0[offset + count] == 0xaa);
+            assert(dst_1[offset + count] == 0xaa);
+        }
+    }
+}
+
+static
+void
+test_plane(uint32_t width, uint32_t height)
+{
+    const uint32_t src_pitch = 2 * width + 6;
+    const uint32_t pitch_0 = width + 3;
+    const uint32_t pitch_1 = width + 5;
+    vector<uint8_t> src(src_pitch * height);
+    vector<uint8_t> dst_0(pitch_0 * height);
+    vector<uint8_t> dst_1(pitch_1 * height);
+
+    for (size_t k = 0; k < src.size(); k ++)
+        src[k] = static_cast<uint8_t>(k * 13 + k / 251);
+
+    vdp::chroma::deinterleave(src.data(), src_pitch, dst_0.data(), pitch_0, dst_1.data(),
+                              pitch_1, width, height);
+
+    for (uint32_t y = 0; y < height; y ++) {
+        for (uint32_t x = 0; x < width; x ++) {
+            assert(dst_0[y * pitch_0 + x] == src[y * src_pitch + 2 * x]);
+            assert(dst_1[y * pitch_1 + x] == src[y * src_pitch + 2 * x + 1]);
+        }
+    }
+}
+
+int
+main(void)
+{
+    for (const auto &kernel: vdp::chroma::deinterleave_kernels()) {
+        printf("kernel %s\n", kernel.name);
+        test_kernel(kernel);
+    }
+
+    test_plane(7, 5);
+
+    // Large enough to be split across threads. Workers are reused between calls, and callers
+    // which find them busy do the work themselves.
+    std::thread t([] {
+        for (int k = 0; k < 3; k ++)
+            test_plane(1920, 1081);
+    });
+    for (int k = 0; k < 3; k ++)
+        test_plane(1920, 1081);
+    t.join();
+
+    printf("pass\n");
+    return 0;
+}
@@ -0,0 +1,54 @@
+// test-016
+// Create and destroy a video surface over and over, so its handle slot gets reused more times
+// than handle generation bits can count. No handle may repeat, and stale handles must stay
+// invalid.
+// TOUCHES: VdpVideoSurfaceCreate
+// TOUCHES: VdpVideoSurfaceDestroy
+
+#include "tests-common.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// generation field of a handle is 12 bits wide
+#define CYCLES  5000
+
+static
+int
+compare_handles(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(void)
+{
+    VdpDevice device = create_vdp_device();
+    uint32_t *handles = calloc(CYCLES, sizeof(uint32_t));
+    assert(handles);
+
+    for (int k = 0; k < CYCLES; k ++) {
+        VdpVideoSurface surface;
+        ASSERT_OK(vdpVideoSurfaceCreate(device, VDP_CHROMA_TYPE_420, 16, 16, &surface));
+        ASSERT_OK(vdpVideoSurfaceDestroy(surface));
+        handles[k] = surface;
+    }
+
+    for (int k = 0; k < CYCLES; k ++) {
+        VdpChromaType chroma_type;
+        uint32_t width, height;
+        assert(VDP_STATUS_INVALID_HANDLE ==
+               vdpVideoSurfaceGetParameters(handles[k], &chroma_type, &width, &height));
+    }
+
+    qsort(handles, CYCLES, sizeof(uint32_t), compare_handles);
+    for (int k = 1; k < CYCLES; k ++)
+        assert(handles[k - 1] != handles[k]);
+
+    free(handles);
+    ASSERT_OK(vdpDeviceDestroy(device));
+
+    printf("pass\n");
+    return 0;
+}
@@ -0,0 +1,86 @@
+// test-017
+// With RenderThread quirk, rendering calls are queued and return early. They still must report
+// invalid handles and arguments to the caller.
+// TOUCHES: VdpVideoMixerRender
+// TOUCHES: VdpOutputSurfaceRenderOutputSurface
+// TOUCHES: VdpOutputSurfaceRenderBitmapSurface
+
+#include "tests-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(void)
+{
+    setenv("VDPAU_QUIRKS", "RenderThread", 1);
+    VdpDevice device = create_vdp_device();
+
+    VdpOutputSurface out_surface;
+    ASSERT_OK(vdpOutputSurfaceCreate(device, VDP_RGBA_FORMAT_B8G8R8A8, 16, 16, &out_surface));
+
+    VdpVideoSurface video_surface;
+    ASSERT_OK(vdpVideoSurfaceCreate(device, VDP_CHROMA_TYPE_420, 16, 16, &video_surface));
+
+    VdpVideoMixer mixer;
+    ASSERT_OK(vdpVideoMixerCreate(device, 0, NULL, 0, NULL, NULL, &mixer));
+
+    // handles which were valid once
+    VdpOutputSurface stale_out_surface;
+    ASSERT_OK(vdpOutputSurfaceCreate(device, VDP_RGBA_FORMAT_B8G8R8A8, 16, 16,
+                                     &stale_out_surface));
+    ASSERT_OK(vdpOutputSurfaceDestroy(stale_out_surface));
+
+    VdpVideoSurface stale_video_surface;
+    ASSERT_OK(vdpVideoSurfaceCreate(device, VDP_CHROMA_TYPE_420, 16, 16, &stale_video_surface));
+    ASSERT_OK(vdpVideoSurfaceDestroy(stale_video_surface));
+
+    VdpBitmapSurface stale_bitmap_surface;
+    ASSERT_OK(vdpBitmapSurfaceCreate(device, VDP_RGBA_FORMAT_B8G8R8A8, 16, 16, 1,
+                                     &stale_bitmap_surface));
+    ASSERT_OK(vdpBitmapSurfaceDestroy(stale_bitmap_surface));
+
+    assert(VDP_STATUS_INVALID_HANDLE ==
+           vdpVideoMixerRender(mixer, VDP_INVALID_HANDLE, NULL,
+                               VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME, 0, NULL,
+                               stale_video_surface, 0, NULL, NULL, out_surface, NULL, NULL, 0,
+                               NULL));
+
+    assert(VDP_STATUS_INVALID_HANDLE ==
+           vdpVideoMixerRender(mixer, VDP_INVALID_HANDLE, NULL,
+                               VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME, 0, NULL, video_surface,
+                               0, NULL, NULL, stale_out_surface, NULL, NULL, 0, NULL));
+
+    assert(VDP_STATUS_INVALID_HANDLE ==
+           vdpOutputSurfaceRenderOutputSurface(out_surface, NULL, stale_out_surface, NULL, NULL,
+                                               NULL, 0));
+
+    assert(VDP_STATUS_INVALID_HANDLE ==
+           vdpOutputSurfaceRenderBitmapSurface(out_surface, NULL, stale_bitmap_surface, NULL,
+                                               NULL, NULL, 0));
+
+    VdpOutputSurfaceRenderBlendState blend_state = {
+        .struct_version = VDP_OUTPUT_SURFACE_RENDER_BLEND_STATE_VERSION + 1,
+        .blend_factor_source_color = VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE,
+        .blend_factor_destination_color = VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ZERO,
+        .blend_factor_source_alpha = VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE,
+        .blend_factor_destination_alpha = VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ZERO,
+        .blend_equation_color = VDP_OUTPUT_SURFACE_RENDER_BLEND_EQUATION_ADD,
+        .blend_equation_alpha = VDP_OUTPUT_SURFACE_RENDER_BLEND_EQUATION_ADD,
+    };
+
+    assert(VDP_STATUS_INVALID_VALUE ==
+           vdpOutputSurfaceRenderOutputSurface(out_surface, NULL, VDP_INVALID_HANDLE, NULL,
+                                               NULL, &blend_state, 0));
+
+    // valid calls are still queued fine
+    blend_state.struct_version = VDP_OUTPUT_SURFACE_RENDER_BLEND_STATE_VERSION;
+    ASSERT_OK(vdpOutputSurfaceRenderOutputSurface(out_surface, NULL, VDP_INVALID_HANDLE, NULL,
+                                                  NULL, &blend_state, 0));
+
+    ASSERT_OK(vdpVideoMixerDestroy(mixer));
+    ASSERT_OK(vdpVideoSurfaceDestroy(video_surface));
+    ASSERT_OK(vdpOutputSurfaceDestroy(out_surface));
+    ASSERT_OK(vdpDeviceDestroy(device));
+
+    printf("pass\n");
+    return 0;
+}